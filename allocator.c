@@ -0,0 +1,328 @@
+/*
+ * allocator.c
+ *
+ * The default allocator, an arena and a tracing allocator.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "allocator.h"
+
+// Put in front of each block that needs its size remembered, and sized
+// so that what follows it stays aligned for any type.
+typedef union {
+	size_t size;
+	long double align_float;
+	void *align_pointer;
+} BlockHeader;
+
+#define ALIGN_UP(x) (((x) + sizeof(BlockHeader) - 1) / sizeof(BlockHeader) * sizeof(BlockHeader))
+
+static void *
+default_allocate(Allocator *allocator, size_t size, int zero, const char *site)
+{
+	(void)allocator;
+	(void)site;
+	return zero ? calloc(1, size ? size : 1) : malloc(size ? size : 1);
+}
+
+static void *
+default_reallocate(Allocator *allocator, void *block, size_t size, const char *site)
+{
+	(void)allocator;
+	(void)site;
+	return realloc(block, size ? size : 1);
+}
+
+static void
+default_release(Allocator *allocator, void *block)
+{
+	(void)allocator;
+	free(block);
+}
+
+Allocator default_allocator = {default_allocate, default_reallocate, default_release};
+
+void *
+allocate_memory(Allocator *allocator, size_t size, int zero, const char *site)
+{
+	if(allocator == NULL) allocator = &default_allocator;
+	return allocator->allocate(allocator, size, zero, site);
+}
+
+// allocate_array
+// Allocates count zeroed elements, as calloc does.
+//
+// Returns:  NULL if out of memory or if the size overflows.
+void *
+allocate_array(Allocator *allocator, size_t count, size_t size, const char *site)
+{
+	if(size && count > (size_t)-1 / size) return NULL;
+	return allocate_memory(allocator, count * size, 1, site);
+}
+
+void *
+reallocate_memory(Allocator *allocator, void *block, size_t size, const char *site)
+{
+	if(allocator == NULL) allocator = &default_allocator;
+	return allocator->reallocate(allocator, block, size, site);
+}
+
+void
+release_memory(Allocator *allocator, void *block)
+{
+	if(block == NULL) return;
+	if(allocator == NULL) allocator = &default_allocator;
+	allocator->release(allocator, block);
+}
+
+/* Arena */
+
+struct ArenaBlock {
+	ArenaBlock *next;
+	size_t size;               // Bytes of data after the block header.
+	size_t used;
+};
+
+#define ARENA_DATA(block) ((uint8_t *)(block) + ALIGN_UP(sizeof(ArenaBlock)))
+
+static void *
+arena_allocate(Allocator *allocator, size_t size, int zero, const char *site)
+{
+	ArenaAllocator *arena = (ArenaAllocator *)allocator;
+	ArenaBlock *block = arena->blocks;
+	BlockHeader *header;
+	size_t need = sizeof(BlockHeader) + ALIGN_UP(size);
+	size_t block_size;
+
+	if(block == NULL || block->size - block->used < need) {
+		block_size = need > arena->block_size ? need : arena->block_size;
+		block = allocate_memory(arena->parent, ALIGN_UP(sizeof(ArenaBlock)) + block_size, 0, site);
+		if(block == NULL) return NULL;
+
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	header = (BlockHeader *)(ARENA_DATA(block) + block->used);
+	header->size = size;
+	block->used += need;
+
+	arena->last = header + 1;
+	if(zero) memset(arena->last, 0, size);
+	return arena->last;
+}
+
+static void *
+arena_reallocate(Allocator *allocator, void *old, size_t size, const char *site)
+{
+	ArenaAllocator *arena = (ArenaAllocator *)allocator;
+	ArenaBlock *block = arena->blocks;
+	BlockHeader *header;
+	size_t old_size;
+	void *new;
+
+	if(old == NULL) return arena_allocate(allocator, size, 0, site);
+
+	header = (BlockHeader *)old - 1;
+	old_size = header->size;
+	if(size <= old_size) return old;
+
+	// The newest allocation grows in place while its block has room.
+	if(old == arena->last && block->size - block->used >= ALIGN_UP(size) - ALIGN_UP(old_size)) {
+		block->used += ALIGN_UP(size) - ALIGN_UP(old_size);
+		header->size = size;
+		return old;
+	}
+
+	new = arena_allocate(allocator, size, 0, site);
+	if(new == NULL) return NULL;
+	memcpy(new, old, old_size);
+	return new;
+}
+
+static void
+arena_release(Allocator *allocator, void *block)
+{
+	ArenaAllocator *arena = (ArenaAllocator *)allocator;
+	BlockHeader *header = (BlockHeader *)block - 1;
+
+	if(block == arena->last) {
+		arena->blocks->used -= sizeof(BlockHeader) + ALIGN_UP(header->size);
+		arena->last = NULL;
+	}
+}
+
+// init_arena_allocator
+// Readies an arena that takes block_size bytes at a time from parent.
+void
+init_arena_allocator(ArenaAllocator *arena, Allocator *parent, size_t block_size)
+{
+	memset(arena, 0, sizeof(ArenaAllocator));
+	arena->allocator.allocate = arena_allocate;
+	arena->allocator.reallocate = arena_reallocate;
+	arena->allocator.release = arena_release;
+	arena->parent = parent;
+	arena->block_size = block_size ? block_size : 1 << 20;
+}
+
+// reset_arena_allocator
+// Frees everything the arena handed out.
+void
+reset_arena_allocator(ArenaAllocator *arena)
+{
+	ArenaBlock *block, *next;
+
+	for(block = arena->blocks; block; block = next) {
+		next = block->next;
+		release_memory(arena->parent, block);
+	}
+
+	arena->blocks = NULL;
+	arena->last = NULL;
+}
+
+/* Tracking */
+
+static void
+track_site(TrackingAllocator *tracking, const char *site, size_t size)
+{
+	AllocationSite *entry;
+	int i;
+
+	for(i=0; i < tracking->num_sites; i++) {
+		if(tracking->sites[i].site == site) break;
+	}
+
+	if(i == tracking->num_sites) {
+		if(tracking->num_sites < TRACKING_MAX_SITES) {
+			tracking->sites[i].site = site;
+			tracking->num_sites++;
+		} else {
+			i = TRACKING_MAX_SITES;
+			tracking->sites[i].site = "other";
+		}
+	}
+
+	entry = &tracking->sites[i];
+	entry->count++;
+	entry->bytes += size;
+	tracking->bytes += size;
+}
+
+static void
+track_use(TrackingAllocator *tracking, size_t freed, size_t used)
+{
+	tracking->current = tracking->current - freed + used;
+	if(tracking->current > tracking->peak) tracking->peak = tracking->current;
+}
+
+static void *
+tracking_allocate(Allocator *allocator, size_t size, int zero, const char *site)
+{
+	TrackingAllocator *tracking = (TrackingAllocator *)allocator;
+	BlockHeader *header;
+
+	header = allocate_memory(tracking->parent, sizeof(BlockHeader) + size, zero, site);
+	if(header == NULL) return NULL;
+
+	header->size = size;
+	tracking->allocations++;
+	track_site(tracking, site, size);
+	track_use(tracking, 0, size);
+
+	return header + 1;
+}
+
+static void *
+tracking_reallocate(Allocator *allocator, void *block, size_t size, const char *site)
+{
+	TrackingAllocator *tracking = (TrackingAllocator *)allocator;
+	BlockHeader *header;
+	size_t old_size;
+
+	if(block == NULL) return tracking_allocate(allocator, size, 0, site);
+
+	header = (BlockHeader *)block - 1;
+	old_size = header->size;
+	header = reallocate_memory(tracking->parent, header, sizeof(BlockHeader) + size, site);
+	if(header == NULL) return NULL;
+
+	header->size = size;
+	tracking->reallocations++;
+	track_site(tracking, site, size);
+	track_use(tracking, old_size, size);
+
+	return header + 1;
+}
+
+static void
+tracking_release(Allocator *allocator, void *block)
+{
+	TrackingAllocator *tracking = (TrackingAllocator *)allocator;
+	BlockHeader *header = (BlockHeader *)block - 1;
+
+	tracking->releases++;
+	track_use(tracking, header->size, 0);
+	release_memory(tracking->parent, header);
+}
+
+// init_tracking_allocator
+// Readies an allocator that counts every call before passing it on to
+// parent.
+void
+init_tracking_allocator(TrackingAllocator *tracking, Allocator *parent)
+{
+	memset(tracking, 0, sizeof(TrackingAllocator));
+	tracking->allocator.allocate = tracking_allocate;
+	tracking->allocator.reallocate = tracking_reallocate;
+	tracking->allocator.release = tracking_release;
+	tracking->parent = parent;
+}
+
+static int
+compare_sites(const void *a, const void *b)
+{
+	const AllocationSite *x = a;
+	const AllocationSite *y = b;
+
+	if(x->count != y->count) return x->count > y->count ? -1 : 1;
+	if(x->bytes != y->bytes) return x->bytes > y->bytes ? -1 : 1;
+	return 0;
+}
+
+// print_allocation_report
+// Prints the totals and the max_sites call sites that allocated most
+// often.
+void
+print_allocation_report(FILE *outfile, const TrackingAllocator *tracking, int max_sites)
+{
+	AllocationSite sites[TRACKING_MAX_SITES + 1];
+	const char *name, *slash;
+	int num_sites = tracking->num_sites;
+	int i;
+
+	fprintf(outfile, "Allocations: %"PRIu64", reallocations: %"PRIu64", frees: %"PRIu64"\n",
+		tracking->allocations, tracking->reallocations, tracking->releases);
+	fprintf(outfile, "Bytes asked for: %"PRIu64", peak in use: %zu, still in use: %zu\n",
+		tracking->bytes, tracking->peak, tracking->current);
+
+	memcpy(sites, tracking->sites, sizeof(sites));
+	if(sites[TRACKING_MAX_SITES].count) sites[num_sites++] = sites[TRACKING_MAX_SITES];
+	qsort(sites, num_sites, sizeof(AllocationSite), compare_sites);
+
+	for(i=0; i < num_sites && i < max_sites; i++) {
+		// Leave off the directory that __FILE__ may carry.
+		name = sites[i].site;
+		for(slash = name; *slash; slash++) {
+			if(*slash == '/' || *slash == '\\') name = slash + 1;
+		}
+
+		fprintf(outfile, "  %-20s %10"PRIu64" calls %14"PRIu64" bytes\n", name, sites[i].count, sites[i].bytes);
+	}
+}
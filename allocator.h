@@ -0,0 +1,84 @@
+/*
+ * allocator.h
+ *
+ * Allocators that the midi reader and the converter get their memory
+ * from.  An Allocator is a table of functions, so a caller can hand in
+ * its own.  A NULL Allocator * means malloc and free.
+ *
+ */
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+typedef struct Allocator Allocator;
+
+// site names the line that asked for the memory, as "file.c:123".
+struct Allocator {
+	void *(*allocate)(Allocator *, size_t size, int zero, const char *site);
+	void *(*reallocate)(Allocator *, void *block, size_t size, const char *site);
+	void (*release)(Allocator *, void *block);
+};
+
+extern Allocator default_allocator;
+
+void *allocate_memory(Allocator *, size_t size, int zero, const char *site);
+void *allocate_array(Allocator *, size_t count, size_t size, const char *site);
+void *reallocate_memory(Allocator *, void *block, size_t size, const char *site);
+void release_memory(Allocator *, void *block);
+
+#define ALLOCATOR_STRING_(x) #x
+#define ALLOCATOR_STRING(x) ALLOCATOR_STRING_(x)
+#define ALLOCATOR_SITE __FILE__ ":" ALLOCATOR_STRING(__LINE__)
+
+// Drop in replacements for malloc, calloc, realloc and free.
+#define mem_malloc(a, size) allocate_memory((a), (size), 0, ALLOCATOR_SITE)
+#define mem_calloc(a, count, size) allocate_array((a), (count), (size), ALLOCATOR_SITE)
+#define mem_realloc(a, block, size) reallocate_memory((a), (block), (size), ALLOCATOR_SITE)
+#define mem_free(a, block) release_memory((a), (block))
+
+// Hands out memory from large blocks and gives it all back at once.
+// Freeing only returns memory if it was the last thing allocated.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+	Allocator allocator;       // First, so that &arena.allocator can be passed around.
+	Allocator *parent;         // Where blocks come from.
+	size_t block_size;
+	ArenaBlock *blocks;        // Newest first.
+	void *last;                // Last allocation, which can grow in place.
+} ArenaAllocator;
+
+void init_arena_allocator(ArenaAllocator *, Allocator *parent, size_t block_size);
+void reset_arena_allocator(ArenaAllocator *);
+
+// Counts what goes through it on the way to parent.  It is not thread
+// safe.
+#define TRACKING_MAX_SITES 64
+
+typedef struct {
+	const char *site;
+	uint64_t count;            // Allocations and reallocations.
+	uint64_t bytes;            // Bytes asked for.
+} AllocationSite;
+
+typedef struct {
+	Allocator allocator;       // First, so that &tracking.allocator can be passed around.
+	Allocator *parent;
+	uint64_t allocations;
+	uint64_t reallocations;
+	uint64_t releases;
+	uint64_t bytes;            // Bytes asked for, over all calls.
+	size_t current;            // Bytes in use.
+	size_t peak;               // Most bytes in use at once.
+	int num_sites;
+	AllocationSite sites[TRACKING_MAX_SITES + 1]; // The last catches any sites past the limit.
+} TrackingAllocator;
+
+void init_tracking_allocator(TrackingAllocator *, Allocator *parent);
+void print_allocation_report(FILE *, const TrackingAllocator *, int max_sites);
+
+#endif /* ALLOCATOR_H */
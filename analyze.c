@@ -0,0 +1,392 @@
+/*
+ * analyze.c
+ *
+ * Each file is fed through the push parser with a handler that only
+ * keeps what the statistics need: the times that notes start and end,
+ * the tempos and the time signatures.  No events are stored, and
+ * nothing is converted.  Every thread adds its files into statistics of
+ * its own, which are merged once all the files are done.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "analyze.h"
+#include "midi.h"
+#include "midistream.h"
+#include "thread.h"
+
+// Bytes read from a file at a time.
+#define ANALYZE_CHUNK 65536
+
+typedef struct {
+	long int time;
+	uint8_t channel;
+	uint8_t note;
+	uint8_t on;
+} NoteEdge;
+
+// What is kept while one file is parsed.
+typedef struct {
+	uint16_t channels;          // Channels whose notes count towards polyphony.
+	uint32_t track;             // Track that time is in.
+	long int time;
+	long int end_time;          // Latest event in any track.
+	long int signature_time;    // Time of the time signature in effect at the end.
+	uint16_t ticks_per_beat;    // Set by it, as midi_to_mod does.
+	uint16_t default_ticks;
+	size_t tempos;
+	size_t notes;
+	NoteEdge *edges;
+	size_t num_edges;
+	size_t capacity;
+	int failed;
+} FileScan;
+
+typedef struct {
+	char **inputs;
+	int num_inputs;
+	int next;                   // Next input to analyze.
+	Mutex lock;
+	uint16_t channels;
+} Corpus;
+
+typedef struct {
+	Corpus *corpus;
+	CorpusStats stats;
+	int started;
+} AnalyzeWorker;
+
+static int
+scan_event(void *context, uint32_t track, const MidiEvent *event)
+{
+	FileScan *scan = context;
+	NoteEdge *edges;
+
+	if(track != scan->track) {
+		scan->track = track;
+		scan->time = 0;
+	}
+	scan->time += event->delta_time;
+	if(scan->time > scan->end_time) scan->end_time = scan->time;
+
+	if(event->type == MIDI_EVENT_META) {
+		if(event->meta_type == MIDI_META_SETTEMPO) {
+			scan->tempos++;
+		} else if(event->meta_type == MIDI_META_TIMESIGNATURE && scan->time >= scan->signature_time &&
+		          event->time_signature.ticks_per_click) {
+			scan->signature_time = scan->time;
+			scan->ticks_per_beat = event->time_signature.ticks_per_click;
+		}
+		return 0;
+	}
+
+	if(event->type != MIDI_EVENT || !(scan->channels & (1 << event->channel))) return 0;
+	if(event->command != MIDI_NOTEON && event->command != MIDI_NOTEOFF) return 0;
+
+	if(scan->num_edges == scan->capacity) {
+		scan->capacity = scan->capacity ? 2 * scan->capacity : 4096;
+		edges = realloc(scan->edges, scan->capacity * sizeof(NoteEdge));
+		if(edges == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			scan->failed = 1;
+			return 1;
+		}
+		scan->edges = edges;
+	}
+
+	edges = &scan->edges[scan->num_edges++];
+	edges->time = scan->time;
+	// Masked as pair_note_spans does, since they index max_polyphony's table.
+	edges->channel = event->channel & 0x0F;
+	edges->note = event->note & 0x7F;
+	edges->on = event->command == MIDI_NOTEON && event->velocity;
+	if(edges->on) scan->notes++;
+
+	return 0;
+}
+
+// Orders edges by time, with notes ending before others start.
+static int
+compare_edges(const void *a, const void *b)
+{
+	const NoteEdge *x = a, *y = b;
+
+	if(x->time != y->time) return x->time < y->time ? -1 : 1;
+	return (int)x->on - (int)y->on;
+}
+
+// max_polyphony
+// Returns:  The most notes sounding at once.  A note started again
+//           before it ends still counts once, as midi_to_mod plays it
+//           on the same channel.
+static int
+max_polyphony(FileScan *scan)
+{
+	uint8_t on[16][128];
+	int sounding = 0, most = 0;
+	size_t i;
+	NoteEdge *edge;
+
+	qsort(scan->edges, scan->num_edges, sizeof(NoteEdge), compare_edges);
+	memset(on, 0, sizeof(on));
+
+	for(i=0; i < scan->num_edges; i++) {
+		edge = &scan->edges[i];
+		if(edge->on && !on[edge->channel][edge->note]) {
+			on[edge->channel][edge->note] = 1;
+			if(++sounding > most) most = sounding;
+		} else if(!edge->on && on[edge->channel][edge->note]) {
+			on[edge->channel][edge->note] = 0;
+			sounding--;
+		}
+	}
+
+	return most;
+}
+
+// scan_file
+// Parses one file into scan and stream.
+//
+// Returns:  Non-zero on error.
+static int
+scan_file(const char *name, FileScan *scan, MidiStream *stream, uint8_t *buffer)
+{
+	FILE *file;
+	size_t length;
+	int status = 0;
+
+	#ifdef _WIN32
+	if(fopen_s(&file, name, "rb")) file = NULL;
+	#else
+	file = fopen(name, "rb");
+	#endif
+
+	if(file == NULL) {
+		fprintf(stderr, "Unable to open %s.\n", name);
+		return 1;
+	}
+
+	scan->track = 0;
+	scan->time = 0;
+	scan->end_time = 0;
+	scan->signature_time = 0;
+	scan->ticks_per_beat = scan->default_ticks;
+	scan->tempos = 0;
+	scan->notes = 0;
+	scan->num_edges = 0;
+	scan->failed = 0;
+	init_midi_stream(stream, scan_event, scan);
+
+	while(!status && (length = fread(buffer, 1, ANALYZE_CHUNK, file)) > 0) {
+		status = feed_midi_stream(stream, buffer, length);
+	}
+	if(!status) status = finish_midi_stream(stream);
+	fclose(file);
+
+	return status || scan->failed;
+}
+
+// add_file
+// Adds what was found in one file to stats.
+static void
+add_file(CorpusStats *stats, const FileScan *scan, const MidiStream *stream, int polyphony)
+{
+	const MidiPatch *patch;
+	CorpusPatch *total;
+	size_t patterns, changes;
+	int i, bucket;
+
+	stats->files++;
+	stats->notes += scan->notes;
+
+	for(i=0; i < 128; i++) {
+		patch = &stream->patches[i];
+		total = &stats->patches[i];
+		if(patch->used) total->files++;
+		if(!patch->min) continue;
+
+		if(!total->min || patch->min < total->min) total->min = patch->min;
+		if(patch->max > total->max) total->max = patch->max;
+	}
+
+	stats->polyphony[polyphony > CORPUS_MAX_POLYPHONY ? CORPUS_MAX_POLYPHONY + 1 : polyphony]++;
+	if(polyphony > stats->max_polyphony) stats->max_polyphony = polyphony;
+
+	changes = scan->tempos > 1 ? scan->tempos - 1 : 0;
+	stats->tempo_changes += changes;
+	if(changes) stats->files_changing_tempo++;
+	if(changes > stats->max_tempo_changes) stats->max_tempo_changes = changes;
+
+	// As midi_to_mod places the last event, with 64 divisions a pattern.
+	patterns = scan->end_time / scan->ticks_per_beat / 64 + 1;
+	for(bucket=0; bucket < CORPUS_PATTERN_BUCKETS && patterns > ((size_t)1 << bucket); bucket++);
+	stats->patterns[bucket]++;
+	if(patterns > stats->max_patterns) stats->max_patterns = patterns;
+	if(patterns > 128) stats->files_over_mod++;
+}
+
+static void
+merge_stats(CorpusStats *stats, const CorpusStats *part)
+{
+	int i;
+
+	stats->files += part->files;
+	stats->failed += part->failed;
+	stats->notes += part->notes;
+
+	for(i=0; i < 128; i++) {
+		stats->patches[i].files += part->patches[i].files;
+		if(part->patches[i].min && (!stats->patches[i].min || part->patches[i].min < stats->patches[i].min))
+			stats->patches[i].min = part->patches[i].min;
+		if(part->patches[i].max > stats->patches[i].max) stats->patches[i].max = part->patches[i].max;
+	}
+
+	for(i=0; i < CORPUS_MAX_POLYPHONY + 2; i++) stats->polyphony[i] += part->polyphony[i];
+	if(part->max_polyphony > stats->max_polyphony) stats->max_polyphony = part->max_polyphony;
+
+	stats->tempo_changes += part->tempo_changes;
+	stats->files_changing_tempo += part->files_changing_tempo;
+	if(part->max_tempo_changes > stats->max_tempo_changes) stats->max_tempo_changes = part->max_tempo_changes;
+
+	for(i=0; i <= CORPUS_PATTERN_BUCKETS; i++) stats->patterns[i] += part->patterns[i];
+	if(part->max_patterns > stats->max_patterns) stats->max_patterns = part->max_patterns;
+	stats->files_over_mod += part->files_over_mod;
+}
+
+static void
+analyze_worker(void *arg)
+{
+	AnalyzeWorker *worker = arg;
+	Corpus *corpus = worker->corpus;
+	FileScan scan;
+	MidiStream *stream;
+	uint8_t *buffer;
+	char *env_ticks_per_beat = getenv("TICKS_PER_BEAT");
+	int i;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.channels = corpus->channels;
+	scan.default_ticks = 64;
+	if(env_ticks_per_beat != NULL && atoi(env_ticks_per_beat) > 0) scan.default_ticks = atoi(env_ticks_per_beat);
+
+	stream = malloc(sizeof(MidiStream));
+	buffer = malloc(ANALYZE_CHUNK);
+
+	for(;;) {
+		mutex_lock(&corpus->lock);
+		i = corpus->next < corpus->num_inputs ? corpus->next++ : -1;
+		mutex_unlock(&corpus->lock);
+		if(i < 0) break;
+
+		if(stream == NULL || buffer == NULL || scan_file(corpus->inputs[i], &scan, stream, buffer)) {
+			fprintf(stderr, "Unable to analyze %s.\n", corpus->inputs[i]);
+			worker->stats.failed++;
+			continue;
+		}
+
+		add_file(&worker->stats, &scan, stream, max_polyphony(&scan));
+	}
+
+	free(scan.edges);
+	free(stream);
+	free(buffer);
+}
+
+// analyze_corpus
+// Gathers statistics over every input.  A file that can not be read is
+// counted as failed and the rest carry on.  Only notes on the channels
+// in mask count towards polyphony.
+//
+// Takes:  num_threads - Threads to read files with, 0 for one per
+//                       processor.
+//
+// Returns:  Non-zero if any file failed.
+int
+analyze_corpus(char **inputs, int num_inputs, uint16_t channels, int num_threads, CorpusStats *stats)
+{
+	Corpus corpus;
+	AnalyzeWorker *workers;
+	Thread *threads;
+	int i;
+
+	memset(stats, 0, sizeof(CorpusStats));
+
+	if(num_threads <= 0) num_threads = thread_count();
+	if(num_threads > num_inputs) num_threads = num_inputs ? num_inputs : 1;
+
+	workers = calloc(num_threads, sizeof(AnalyzeWorker));
+	threads = calloc(num_threads, sizeof(Thread));
+	if(workers == NULL || threads == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(workers);
+		free(threads);
+		return 1;
+	}
+
+	corpus.inputs = inputs;
+	corpus.num_inputs = num_inputs;
+	corpus.next = 0;
+	corpus.channels = channels;
+	mutex_init(&corpus.lock);
+
+	for(i=0; i < num_threads; i++) {
+		workers[i].corpus = &corpus;
+		workers[i].started = i > 0 && !thread_create(&threads[i], analyze_worker, &workers[i]);
+	}
+
+	// This thread works too, and takes over if no thread could be started.
+	analyze_worker(&workers[0]);
+
+	for(i=0; i < num_threads; i++) {
+		if(workers[i].started) thread_join(threads[i]);
+		merge_stats(stats, &workers[i].stats);
+	}
+
+	mutex_destroy(&corpus.lock);
+	free(workers);
+	free(threads);
+
+	return stats->failed != 0;
+}
+
+void
+print_corpus_report(FILE *outfile, const CorpusStats *stats)
+{
+	size_t low, high;
+	int i;
+
+	fprintf(outfile, "Files: %zu analyzed, %zu failed.\n", stats->files, stats->failed);
+	fprintf(outfile, "Notes: %zu.\n", stats->notes);
+
+	fprintf(outfile, "\nPatches used:\n");
+	for(i=0; i < 128; i++) {
+		if(!stats->patches[i].files) continue;
+		fprintf(outfile, "%3d: %-28s files: %zu, min: %d, max: %d\n", i, MIDI_PATCH_NAMES[i],
+		        stats->patches[i].files, stats->patches[i].min, stats->patches[i].max);
+	}
+
+	fprintf(outfile, "\nMost notes at once, in the channels analyzed:\n");
+	for(i=0; i <= CORPUS_MAX_POLYPHONY; i++) {
+		if(stats->polyphony[i]) fprintf(outfile, "%6d: %zu files\n", i, stats->polyphony[i]);
+	}
+	if(stats->polyphony[CORPUS_MAX_POLYPHONY + 1])
+		fprintf(outfile, "  >%-3d: %zu files\n", CORPUS_MAX_POLYPHONY, stats->polyphony[CORPUS_MAX_POLYPHONY + 1]);
+	fprintf(outfile, "Most in one file: %d.\n", stats->max_polyphony);
+
+	fprintf(outfile, "\nTempo changes: %zu, in %zu files, most in one file: %zu.\n",
+	        stats->tempo_changes, stats->files_changing_tempo, stats->max_tempo_changes);
+
+	fprintf(outfile, "\nEstimated patterns:\n");
+	for(i=0; i <= CORPUS_PATTERN_BUCKETS; i++) {
+		if(!stats->patterns[i]) continue;
+		high = (size_t)1 << i;
+		low = i ? high / 2 + 1 : 1;
+		if(i == CORPUS_PATTERN_BUCKETS) fprintf(outfile, "   >%-6zu: %zu files\n", high / 2, stats->patterns[i]);
+		else                            fprintf(outfile, "%4zu-%-5zu: %zu files\n", low, high, stats->patterns[i]);
+	}
+	fprintf(outfile, "Most in one file: %zu, files over the 128 of a mod: %zu.\n",
+	        stats->max_patterns, stats->files_over_mod);
+}
@@ -0,0 +1,47 @@
+/*
+ * analyze.h
+ *
+ * Statistics over a whole corpus of midi files, for choosing sample
+ * banks and channel counts before converting any of them.
+ *
+ */
+
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+// Files counted by their most notes at once, up to this many, with the
+// last count for any more.
+#define CORPUS_MAX_POLYPHONY 32
+// Files counted by estimated patterns, in buckets of powers of two up
+// to this many patterns, with the last bucket for any more.
+#define CORPUS_PATTERN_BUCKETS 9
+
+typedef struct {
+	size_t files;              // Files that play the patch.
+	uint8_t min;               // Lowest note played with it, 0 if none.
+	uint8_t max;
+} CorpusPatch;
+
+typedef struct {
+	size_t files;
+	size_t failed;
+	size_t notes;
+	CorpusPatch patches[128];
+	size_t polyphony[CORPUS_MAX_POLYPHONY + 2]; // Files by most notes at once.
+	int max_polyphony;
+	size_t tempo_changes;      // Tempos set after the first, in all files.
+	size_t files_changing_tempo;
+	size_t max_tempo_changes;
+	size_t patterns[CORPUS_PATTERN_BUCKETS + 1];
+	size_t max_patterns;
+	size_t files_over_mod;     // Files estimated to need more than 128 patterns.
+} CorpusStats;
+
+int analyze_corpus(char **inputs, int num_inputs, uint16_t channels, int num_threads, CorpusStats *);
+void print_corpus_report(FILE *, const CorpusStats *);
+
+#endif /* ANALYZE_H */
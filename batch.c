@@ -0,0 +1,428 @@
+/*
+ * batch.c
+ *
+ * The calling thread drives the I/O: it keeps up to a window of input
+ * files being read or held in memory, and hands each one that has been
+ * read to the converting threads.  A converting thread parses the midi
+ * from memory, encodes the mod into memory and submits its write, then
+ * moves on to the next file without waiting for the write to finish.
+ * Each mod is written under a temporary name and renamed once it is
+ * whole, so nothing watching the output ever sees part of one.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "batch.h"
+#include "batchio.h"
+#include "midistream.h"
+#include "modtune.h"
+#include "probes.h"
+#include "thread.h"
+
+typedef struct BatchJob {
+	const char *input;
+	char *output;
+	char *partial;              // Where output is written before it is renamed.
+	uint8_t *data;              // The midi read, then the mod to write.
+	size_t size;
+	BatchKept *kept;            // Its last conversion, NULL if none is kept.
+	const struct BatchJob *clash; // Earlier job with the same output, NULL if none.
+} BatchJob;
+
+typedef struct {
+	const BatchSettings *settings;
+	BatchIo *io;
+	Mutex lock;
+	Condition ready;
+	BatchJob **queue;           // Jobs that have been read, waiting to be converted.
+	int head;
+	int tail;
+	int stopping;
+	Mutex soundfont_lock;       // soundfont_to_mod fills the shared sample cache.
+} Batch;
+
+// output_name
+// Makes the name of the mod written for input: input's file name in
+// dir, or next to input if dir is NULL, with its extension changed to
+// .mod.
+static char *
+output_name(const char *dir, const char *input)
+{
+	const char *base = input;
+	const char *p, *dot = NULL;
+	size_t dir_length;
+	size_t base_length;
+	char *name;
+
+	for(p = input; *p; p++) {
+		if(*p == '/' || *p == '\\') base = p + 1;
+	}
+	for(p = base; *p; p++) {
+		if(*p == '.') dot = p;
+	}
+	base_length = dot && dot != base ? (size_t)(dot - base) : strlen(base);
+
+	if(dir == NULL) {
+		// Keep input's own directory, and the separator after it.
+		dir = input;
+		dir_length = base - input;
+		name = malloc(dir_length + base_length + 5);
+		if(name == NULL) return NULL;
+		memcpy(name, dir, dir_length);
+	} else {
+		dir_length = strlen(dir);
+		name = malloc(dir_length + 1 + base_length + 5);
+		if(name == NULL) return NULL;
+		memcpy(name, dir, dir_length);
+		name[dir_length++] = '/';
+	}
+
+	memcpy(name + dir_length, base, base_length);
+	strcpy(name + dir_length + base_length, ".mod");
+
+	return name;
+}
+
+// partial_name
+// Makes the name that output is written under until it is whole.
+static char *
+partial_name(const char *output)
+{
+	char *name = malloc(strlen(output) + 5);
+
+	if(name == NULL) return NULL;
+	strcpy(name, output);
+	strcat(name, ".tmp");
+
+	return name;
+}
+
+// destroy_batch_kept
+// Frees what a kept conversion holds, leaving it to start afresh.
+void
+destroy_batch_kept(BatchKept *kept)
+{
+	destroy_mod(&kept->mod);
+	destroy_mod_incremental(&kept->incremental);
+	memset(kept, 0, sizeof(BatchKept));
+	init_mod_incremental(&kept->incremental);
+}
+
+// convert_job
+// Turns the midi in job->data into a mod in job->data, from its kept
+// conversion if it has one.
+//
+// Returns:  Non-zero on error.
+static int
+convert_job(Batch *batch, BatchJob *job)
+{
+	const BatchSettings *settings = batch->settings;
+	MidiToModOptions options = settings->options;
+	ModTuning tuning;
+	Midi midi;
+	Mod fresh;
+	Mod *mod;
+	int status, i;
+
+	status = read_midi_from_memory(&midi, job->data, job->size, options.allocator);
+	free(job->data);
+	job->data = NULL;
+	if(status) return 1;
+
+	if(settings->first_bar) {
+		options.start_time = midi_bar_time(&midi, settings->first_bar);
+		options.end_time = midi_bar_time(&midi, settings->last_bar + 1);
+		if(options.start_time > 0 && index_midi_time(&midi, MIDI_CHECKPOINT_EVENTS)) {
+			destroy_midi(&midi);
+			return 1;
+		}
+	}
+
+	// Files are already converted in parallel, so tune on this thread.
+	if(settings->tune) {
+		if(tune_midi_to_mod(&midi, &options, 1, &tuning)) {
+			destroy_midi(&midi);
+			return 1;
+		}
+		options.ticks_per_beat = tuning.ticks_per_beat;
+		options.speed = tuning.speed;
+	}
+
+	mod = job->kept != NULL ? &job->kept->mod : &fresh;
+	if(job->kept == NULL) memset(&fresh, 0, sizeof(fresh));
+
+	// A kept mod's samples are made again.  Their data stays in the
+	// soundfont's cache, so they still match when the patches do.
+	for(i=0; i < 32; i++) {
+		free(mod->samples[i]);
+		mod->samples[i] = NULL;
+	}
+	memset(mod->patch_sample, 0, sizeof(mod->patch_sample));
+
+	if(settings->soundfont != NULL) {
+		mutex_lock(&batch->soundfont_lock);
+		status = soundfont_to_mod(mod, &midi, settings->soundfont);
+		mutex_unlock(&batch->soundfont_lock);
+	}
+
+	if(job->kept != NULL) {
+		if(!status) status = midi_to_mod_incremental(mod, &midi, &options, &job->kept->incremental);
+		if(!status) {
+			job->size = job->kept->incremental.file_size;
+			job->data = malloc(job->size);
+			if(job->data == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				status = 1;
+			} else {
+				memcpy(job->data, job->kept->incremental.file, job->size);
+			}
+		}
+		// Start afresh next time rather than trust what is left.
+		if(status) destroy_batch_kept(job->kept);
+	} else {
+		if(!status) status = midi_to_mod(mod, &midi, &options);
+		if(!status) status = encode_mod_file(mod, NULL, &job->data, &job->size);
+		destroy_mod(mod);
+	}
+
+	destroy_midi(&midi);
+
+	return status;
+}
+
+// Converts job and starts writing it, or posts its failure.
+static void
+process_job(Batch *batch, BatchJob *job)
+{
+	if(convert_job(batch, job))
+		batch_io_note(batch->io, job, 1);
+	else if(batch_io_write(batch->io, job->partial, job->data, job->size, job)) {
+		// A note carries no data, so the mod is freed here.
+		free(job->data);
+		job->data = NULL;
+		batch_io_note(batch->io, job, 1);
+	}
+}
+
+static void
+batch_worker(void *arg)
+{
+	Batch *batch = arg;
+	BatchJob *job;
+
+	for(;;) {
+		mutex_lock(&batch->lock);
+		while(batch->head == batch->tail && !batch->stopping) condition_wait(&batch->ready, &batch->lock);
+		job = batch->head < batch->tail ? batch->queue[batch->head++] : NULL;
+		mutex_unlock(&batch->lock);
+		if(job == NULL) break;
+
+		process_job(batch, job);
+	}
+}
+
+static void
+queue_job(Batch *batch, BatchJob *job)
+{
+	mutex_lock(&batch->lock);
+	batch->queue[batch->tail++] = job;
+	condition_signal(&batch->ready);
+	mutex_unlock(&batch->lock);
+}
+
+// Orders jobs by output, then as they were given.
+static int
+compare_outputs(const void *a, const void *b)
+{
+	const BatchJob *x = *(const BatchJob * const *)a, *y = *(const BatchJob * const *)b;
+	int order = strcmp(x->output, y->output);
+
+	if(order) return order;
+	return x < y ? -1 : x > y;
+}
+
+// find_clashes
+// Points each job whose output an earlier job also writes, such as
+// a/x.mid and b/x.mid both into one directory, at that earlier job.
+//
+// Returns:  Non-zero on error.
+static int
+find_clashes(BatchJob *jobs, int num_jobs)
+{
+	BatchJob **sorted = malloc((num_jobs ? num_jobs : 1) * sizeof(BatchJob *));
+	int i;
+
+	if(sorted == NULL) return 1;
+
+	for(i=0; i < num_jobs; i++) sorted[i] = &jobs[i];
+	qsort(sorted, num_jobs, sizeof(BatchJob *), compare_outputs);
+	for(i=1; i < num_jobs; i++) {
+		if(!strcmp(sorted[i]->output, sorted[i-1]->output))
+			sorted[i]->clash = sorted[i-1]->clash ? sorted[i-1]->clash : sorted[i-1];
+	}
+
+	free(sorted);
+	return 0;
+}
+
+// convert_batch
+// Converts every input into settings->output_dir, or next to it.  A
+// file that fails is reported and the rest carry on.  Of inputs that
+// would be written to the same output, only the first is converted.
+//
+// Takes:  kept - NULL, or for each input the conversion to reuse and
+//                keep for next time.  Each must have been zeroed and
+//                init_mod_incremental'd before its first use.
+//
+// Returns:  Non-zero if any file failed.
+int
+convert_batch(char **inputs, BatchKept **kept, int num_inputs, const BatchSettings *settings)
+{
+	Batch batch;
+	BatchJob *jobs;
+	BatchJob *job;
+	BatchIoCompletion completion;
+	Thread *threads;
+	int *started;
+	int num_threads = settings->num_threads > 0 ? settings->num_threads : thread_count();
+	int window = settings->window > 0 ? settings->window : 4 * num_threads;
+	int next = 0, in_memory = 0, finished = 0, failed = 0;
+	int num_started = 0;
+	int status = 0;
+	int i;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.settings = settings;
+	jobs = calloc(num_inputs ? num_inputs : 1, sizeof(BatchJob));
+	batch.queue = calloc(num_inputs ? num_inputs : 1, sizeof(BatchJob *));
+	threads = calloc(num_threads, sizeof(Thread));
+	started = calloc(num_threads, sizeof(int));
+	if(jobs == NULL || batch.queue == NULL || threads == NULL || started == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(jobs);
+		free(batch.queue);
+		free(threads);
+		free(started);
+		return 1;
+	}
+
+	for(i=0; i < num_inputs; i++) {
+		jobs[i].input = inputs[i];
+		jobs[i].kept = kept != NULL ? kept[i] : NULL;
+		jobs[i].output = output_name(settings->output_dir, inputs[i]);
+		jobs[i].partial = jobs[i].output ? partial_name(jobs[i].output) : NULL;
+		if(jobs[i].partial == NULL) status = 1;
+	}
+	if(!status) status = find_clashes(jobs, num_inputs);
+
+	batch.io = status ? NULL : open_batch_io(window, settings->use_threads);
+	if(batch.io == NULL) {
+		if(status) fprintf(stderr, "Out of memory.\n");
+		for(i=0; i < num_inputs; i++) {
+			free(jobs[i].output);
+			free(jobs[i].partial);
+		}
+		free(jobs);
+		free(batch.queue);
+		free(threads);
+		free(started);
+		return 1;
+	}
+
+	mutex_init(&batch.lock);
+	mutex_init(&batch.soundfont_lock);
+	condition_init(&batch.ready);
+
+	for(i=0; i < num_threads; i++) {
+		started[i] = !thread_create(&threads[i], batch_worker, &batch);
+		num_started += started[i];
+	}
+
+	while(finished < num_inputs) {
+		// Keep the window full of files being read or converted.
+		while(next < num_inputs && in_memory < window) {
+			if(jobs[next].clash != NULL) {
+				fprintf(stderr, "Not converting %s, as %s is also written to %s.\n", jobs[next].input,
+				        jobs[next].clash->input, jobs[next].output);
+				failed++;
+				finished++;
+			} else if(batch_io_read(batch.io, jobs[next].input, &jobs[next])) {
+				failed++;
+				finished++;
+			} else {
+				in_memory++;
+			}
+			next++;
+		}
+		if(finished == num_inputs) break;
+
+		if(batch_io_wait(batch.io, &completion)) {
+			status = 1;
+			break;
+		}
+		job = completion.tag;
+
+		if(completion.op == BATCH_IO_READ && !completion.status) {
+			PROBE1(file_open, job->input);
+			job->data = completion.data;
+			job->size = completion.size;
+
+			// Convert here if no thread could be started.
+			if(num_started) queue_job(&batch, job);
+			else            process_job(&batch, job);
+			continue;
+		}
+
+		if(completion.op == BATCH_IO_READ) {
+			fprintf(stderr, "Unable to read %s: %s.\n", job->input, strerror(completion.status));
+		} else if(completion.op == BATCH_IO_WRITE) {
+			free(completion.data);
+			job->data = NULL;
+#ifdef _WIN32
+			// rename will not replace a file here.
+			if(!completion.status) remove(job->output);
+#endif
+			if(!completion.status && rename(job->partial, job->output)) completion.status = errno;
+			if(completion.status) {
+				fprintf(stderr, "Unable to write %s: %s.\n", job->output, strerror(completion.status));
+				remove(job->partial);
+			}
+		} else {
+			fprintf(stderr, "Unable to convert %s.\n", job->input);
+		}
+
+		if(completion.status) failed++;
+		finished++;
+		in_memory--;
+	}
+
+	mutex_lock(&batch.lock);
+	batch.stopping = 1;
+	condition_broadcast(&batch.ready);
+	mutex_unlock(&batch.lock);
+
+	for(i=0; i < num_threads; i++) {
+		if(started[i]) thread_join(threads[i]);
+	}
+
+	printf("Converted %d of %d files, with %s I/O.\n", num_inputs - failed, num_inputs, batch_io_backend(batch.io));
+
+	close_batch_io(batch.io);
+	condition_destroy(&batch.ready);
+	mutex_destroy(&batch.soundfont_lock);
+	mutex_destroy(&batch.lock);
+
+	for(i=0; i < num_inputs; i++) {
+		free(jobs[i].output);
+		free(jobs[i].partial);
+	}
+	free(jobs);
+	free(batch.queue);
+	free(threads);
+	free(started);
+
+	return status || failed;
+}
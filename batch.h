@@ -0,0 +1,37 @@
+/*
+ * batch.h
+ *
+ * Converts many midi files at once.  Reading and writing go through
+ * batchio, so that the threads converting only ever work from memory.
+ *
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "mod.h"
+#include "sf2.h"
+
+typedef struct {
+	const char *output_dir;     // Where each input.mid is written as input.mod, NULL for next to it.
+	MidiToModOptions options;   // Its allocator must be safe to share between threads.
+	int first_bar;              // Bars to convert, 0 for the whole song.
+	int last_bar;
+	int tune;                   // Pick the divisions per beat and speed for each file.
+	SoundFont *soundfont;       // NULL for the default waves.
+	int window;                 // Most files in memory at once, 0 for a default.
+	int num_threads;            // Converting threads, 0 for one per processor.
+	int use_threads;            // Do I/O with threads even where io_uring works.
+} BatchSettings;
+
+// A file's last conversion, kept so that converting it again only
+// converts the patterns that changed.
+typedef struct {
+	Mod mod;
+	ModIncremental incremental;
+} BatchKept;
+
+void destroy_batch_kept(BatchKept *);
+int convert_batch(char **inputs, BatchKept **kept, int num_inputs, const BatchSettings *);
+
+#endif /* BATCH_H */
@@ -0,0 +1,684 @@
+/*
+ * batchio.c
+ *
+ * Every request goes through the same stages: open, then as many reads
+ * or writes as it takes, then close.  With io_uring each stage is one
+ * submission, and the next stage is submitted when batch_io_wait reaps
+ * the completion of the last.  The thread fallback runs all the stages
+ * of a request in one go on one of its threads.
+ *
+ * Any thread may submit work, but only one thread may wait.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "batchio.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// Opening, reading, writing and closing through the ring came with
+// kernel 5.6.  IORING_FEAT_FAST_POLL came with 5.7 and, unlike the ops,
+// is a macro that can be tested for.
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_FAST_POLL)
+#define HAVE_IO_URING
+#endif
+#endif
+
+// Size of the first read of a file, doubled until the file fits.
+#define BATCH_IO_READ_SIZE 65536
+// Threads of the fallback.
+#define BATCH_IO_THREADS 4
+
+enum {
+	STAGE_OPEN,
+	STAGE_TRANSFER,
+	STAGE_CLOSE
+};
+
+typedef struct BatchIoRequest BatchIoRequest;
+
+struct BatchIoRequest {
+	int op;
+	int stage;
+	int fd;
+	char *path;
+	void *tag;
+	int status;
+	uint8_t *data;
+	size_t size;           // Bytes read so far, or bytes to write.
+	size_t capacity;       // Size of the read buffer.
+	size_t done;           // Bytes written so far.
+	BatchIoRequest *next;
+};
+
+typedef struct {
+	BatchIoRequest *head;
+	BatchIoRequest *tail;
+} RequestList;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+	int fd;
+	unsigned entries;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+} Ring;
+#endif
+
+struct BatchIo {
+	int use_ring;
+	Mutex lock;            // Guards submission, and the lists of the fallback.
+	Condition wake;        // Fallback: work queued, or work done.
+	RequestList queued;    // Fallback: requests for the threads.
+	RequestList finished;  // Requests done, for batch_io_wait.
+	int stopping;
+	Thread threads[BATCH_IO_THREADS];
+	int num_threads;
+#ifdef HAVE_IO_URING
+	Ring ring;
+#endif
+};
+
+static void
+push_request(RequestList *list, BatchIoRequest *request)
+{
+	request->next = NULL;
+	if(list->tail) list->tail->next = request;
+	else           list->head = request;
+	list->tail = request;
+}
+
+static BatchIoRequest *
+pop_request(RequestList *list)
+{
+	BatchIoRequest *request = list->head;
+	if(request) {
+		list->head = request->next;
+		if(list->head == NULL) list->tail = NULL;
+	}
+	return request;
+}
+
+static BatchIoRequest *
+new_request(int op, const char *path, void *tag)
+{
+	BatchIoRequest *request = calloc(1, sizeof(BatchIoRequest));
+	if(request == NULL) return NULL;
+
+	request->op = op;
+	request->fd = -1;
+	request->tag = tag;
+	if(path) {
+		request->path = malloc(strlen(path) + 1);
+		if(request->path == NULL) {
+			free(request);
+			return NULL;
+		}
+		strcpy(request->path, path);
+	}
+
+	return request;
+}
+
+// Makes room in a read buffer for at least one more chunk.
+static int
+grow_read_buffer(BatchIoRequest *request)
+{
+	size_t capacity = request->capacity ? 2 * request->capacity : BATCH_IO_READ_SIZE;
+	uint8_t *data = realloc(request->data, capacity);
+
+	if(data == NULL) return ENOMEM;
+	request->data = data;
+	request->capacity = capacity;
+	return 0;
+}
+
+/* io_uring */
+
+#ifdef HAVE_IO_URING
+static int
+ring_setup(Ring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	uint8_t *sq, *cq;
+
+	memset(ring, 0, sizeof(Ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd < 0) return 1;
+	if(!(params.features & IORING_FEAT_FAST_POLL)) {
+		close(ring->fd);
+		return 1;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_map == MAP_FAILED) {
+		close(ring->fd);
+		return 1;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                    ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_map == MAP_FAILED) {
+			munmap(ring->sq_map, ring->sq_map_size);
+			close(ring->fd);
+			return 1;
+		}
+	}
+
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		if(ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+		munmap(ring->sq_map, ring->sq_map_size);
+		close(ring->fd);
+		return 1;
+	}
+
+	sq = ring->sq_map;
+	cq = ring->cq_map;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+static void
+ring_teardown(Ring *ring)
+{
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if(ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+	munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+}
+
+static int
+ring_enter(Ring *ring, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	int result;
+
+	do {
+		result = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+	} while(result < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+
+	return result < 0 ? errno : 0;
+}
+
+// Submits the next stage of request.  Every submission is entered at
+// once, so the queue never holds more than one entry.
+static int
+ring_submit(BatchIo *io, BatchIoRequest *request)
+{
+	Ring *ring = &io->ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+	int status;
+
+	mutex_lock(&io->lock);
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)request;
+
+	if(request->op == BATCH_IO_NOTE) {
+		sqe->opcode = IORING_OP_NOP;
+	} else if(request->stage == STAGE_OPEN) {
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)request->path;
+		sqe->open_flags = request->op == BATCH_IO_READ ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+		sqe->len = 0644;
+	} else if(request->stage == STAGE_TRANSFER && request->op == BATCH_IO_READ) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = request->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(request->data + request->size);
+		sqe->len = request->capacity - request->size;
+		sqe->off = request->size;
+	} else if(request->stage == STAGE_TRANSFER) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = request->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(request->data + request->done);
+		sqe->len = request->size - request->done;
+		sqe->off = request->done;
+	} else {
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = request->fd;
+	}
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	status = ring_enter(ring, 1, 0, 0);
+
+	// The kernel only looks at the queue while it is entered, and takes
+	// the entry there or not at all.  One it took completes, whatever
+	// io_uring_enter returned, while one it left is taken back so that
+	// a later call can not submit it after the request has been freed.
+	if(__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) != tail) {
+		status = 0;
+	} else {
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		if(!status) status = EAGAIN;
+	}
+
+	mutex_unlock(&io->lock);
+	return status;
+}
+
+// Moves request on to its next stage after a stage ended with result.
+//
+// Returns:  Non-zero once the request is done.
+static int
+ring_advance(BatchIo *io, BatchIoRequest *request, int result)
+{
+	int status;
+
+	if(request->op == BATCH_IO_NOTE) return 1;
+
+	switch(request->stage) {
+	case STAGE_OPEN:
+		if(result < 0) {
+			request->status = -result;
+			return 1;
+		}
+		request->fd = result;
+		request->stage = STAGE_TRANSFER;
+		if(request->op == BATCH_IO_READ && (request->status = grow_read_buffer(request)))
+			request->stage = STAGE_CLOSE;
+		else if(request->op == BATCH_IO_WRITE && request->size == 0)
+			request->stage = STAGE_CLOSE;
+		break;
+
+	case STAGE_TRANSFER:
+		if(result < 0) {
+			request->status = -result;
+			request->stage = STAGE_CLOSE;
+		} else if(request->op == BATCH_IO_READ) {
+			request->size += result;
+			if(result == 0)
+				request->stage = STAGE_CLOSE;
+			else if(request->size == request->capacity && (request->status = grow_read_buffer(request)))
+				request->stage = STAGE_CLOSE;
+		} else {
+			request->done += result;
+			if(result == 0) {
+				request->status = EIO;
+				request->stage = STAGE_CLOSE;
+			} else if(request->done == request->size) {
+				request->stage = STAGE_CLOSE;
+			}
+		}
+		break;
+
+	case STAGE_CLOSE:
+		if(result < 0 && !request->status) request->status = -result;
+		return 1;
+	}
+
+	status = ring_submit(io, request);
+	if(status) {
+		if(!request->status) request->status = status;
+		if(request->fd >= 0 && request->stage != STAGE_OPEN) close(request->fd);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Moves every completion waiting in the ring along.
+static void
+ring_reap(BatchIo *io)
+{
+	Ring *ring = &io->ring;
+	struct io_uring_cqe *cqe;
+	BatchIoRequest *request;
+	unsigned head, tail;
+	int result;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		request = (BatchIoRequest *)(uintptr_t)cqe->user_data;
+		result = cqe->res;
+
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if(ring_advance(io, request, result)) push_request(&io->finished, request);
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+#endif
+
+/* Thread fallback */
+
+static void
+run_request(BatchIoRequest *request)
+{
+#ifdef _WIN32
+	FILE *file;
+	size_t n;
+
+	if(request->op == BATCH_IO_READ) {
+		if(fopen_s(&file, request->path, "rb")) {
+			request->status = errno ? errno : ENOENT;
+			return;
+		}
+		do {
+			if(request->size == request->capacity && (request->status = grow_read_buffer(request))) break;
+			n = fread(request->data + request->size, 1, request->capacity - request->size, file);
+			request->size += n;
+		} while(n > 0);
+		if(ferror(file) && !request->status) request->status = EIO;
+	} else {
+		if(fopen_s(&file, request->path, "wb")) {
+			request->status = errno ? errno : EACCES;
+			return;
+		}
+		request->done = fwrite(request->data, 1, request->size, file);
+		if(request->done != request->size) request->status = EIO;
+	}
+	if(fclose(file) && !request->status) request->status = EIO;
+#else
+	ssize_t n;
+
+	if(request->op == BATCH_IO_READ) request->fd = open(request->path, O_RDONLY);
+	else                             request->fd = open(request->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(request->fd < 0) {
+		request->status = errno;
+		return;
+	}
+
+	if(request->op == BATCH_IO_READ) {
+		do {
+			if(request->size == request->capacity && (request->status = grow_read_buffer(request))) break;
+			n = pread(request->fd, request->data + request->size, request->capacity - request->size, request->size);
+			if(n < 0 && errno == EINTR) continue;
+			if(n < 0) request->status = errno;
+			else      request->size += n;
+		} while(n > 0 || (n < 0 && errno == EINTR));
+	} else {
+		while(request->done < request->size) {
+			n = pwrite(request->fd, request->data + request->done, request->size - request->done, request->done);
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) {
+				request->status = n < 0 ? errno : EIO;
+				break;
+			}
+			request->done += n;
+		}
+	}
+
+	if(close(request->fd) && !request->status) request->status = errno;
+#endif
+}
+
+static void
+io_thread(void *arg)
+{
+	BatchIo *io = arg;
+	BatchIoRequest *request;
+
+	mutex_lock(&io->lock);
+	for(;;) {
+		while(io->queued.head == NULL && !io->stopping) condition_wait(&io->wake, &io->lock);
+		request = pop_request(&io->queued);
+		if(request == NULL) break;
+
+		mutex_unlock(&io->lock);
+		run_request(request);
+		mutex_lock(&io->lock);
+
+		push_request(&io->finished, request);
+		condition_broadcast(&io->wake);
+	}
+	mutex_unlock(&io->lock);
+}
+
+/* */
+
+static int
+submit(BatchIo *io, BatchIoRequest *request)
+{
+#ifdef HAVE_IO_URING
+	int status;
+
+	if(io->use_ring) {
+		status = ring_submit(io, request);
+		if(status) {
+			fprintf(stderr, "Unable to submit I/O: %s.\n", strerror(status));
+			free(request->path);
+			free(request);
+		}
+		return status != 0;
+	}
+#endif
+
+	mutex_lock(&io->lock);
+	if(request->op == BATCH_IO_NOTE) push_request(&io->finished, request);
+	else                             push_request(&io->queued, request);
+	condition_broadcast(&io->wake);
+	mutex_unlock(&io->lock);
+
+	return 0;
+}
+
+// open_batch_io
+// Starts an I/O backend with room for queue_depth requests at once.
+// io_uring is used when available, unless use_threads is set.
+//
+// Returns:  The backend, or NULL on error.
+BatchIo *
+open_batch_io(int queue_depth, int use_threads)
+{
+	BatchIo *io = calloc(1, sizeof(BatchIo));
+	unsigned entries = 8;
+	int i;
+
+	if(io == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return NULL;
+	}
+
+	mutex_init(&io->lock);
+	condition_init(&io->wake);
+
+#ifdef HAVE_IO_URING
+	while(entries < (unsigned)queue_depth) entries *= 2;
+	if(!use_threads && !ring_setup(&io->ring, entries)) {
+		io->use_ring = 1;
+		return io;
+	}
+#else
+	(void)entries;
+	(void)queue_depth;
+	(void)use_threads;
+#endif
+
+	for(i=0; i < BATCH_IO_THREADS; i++) {
+		if(thread_create(&io->threads[io->num_threads], io_thread, io)) break;
+		io->num_threads++;
+	}
+
+	if(io->num_threads == 0) {
+		close_batch_io(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+// close_batch_io
+// Stops the backend.  Requests still in flight must be waited for first.
+void
+close_batch_io(BatchIo *io)
+{
+	int i;
+
+#ifdef HAVE_IO_URING
+	if(io->use_ring) ring_teardown(&io->ring);
+#endif
+
+	mutex_lock(&io->lock);
+	io->stopping = 1;
+	condition_broadcast(&io->wake);
+	mutex_unlock(&io->lock);
+	for(i=0; i < io->num_threads; i++) thread_join(io->threads[i]);
+
+	condition_destroy(&io->wake);
+	mutex_destroy(&io->lock);
+	free(io);
+}
+
+const char *
+batch_io_backend(const BatchIo *io)
+{
+	return io->use_ring ? "io_uring" : "threads";
+}
+
+// batch_io_read
+// Reads the whole of the file at path.
+//
+// Returns:  Non-zero if the read could not be started.
+int
+batch_io_read(BatchIo *io, const char *path, void *tag)
+{
+	BatchIoRequest *request = new_request(BATCH_IO_READ, path, tag);
+	if(request == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	return submit(io, request);
+}
+
+// batch_io_write
+// Writes size bytes of data as the file at path, replacing any file
+// there.  data must stay as it is until the write completes.
+//
+// Returns:  Non-zero if the write could not be started.
+int
+batch_io_write(BatchIo *io, const char *path, uint8_t *data, size_t size, void *tag)
+{
+	BatchIoRequest *request = new_request(BATCH_IO_WRITE, path, tag);
+	if(request == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	request->data = data;
+	request->size = size;
+	return submit(io, request);
+}
+
+// batch_io_note
+// Posts a completion carrying only tag and status, so a thread that has
+// nothing to write can still wake the one waiting.
+int
+batch_io_note(BatchIo *io, void *tag, int status)
+{
+	BatchIoRequest *request = new_request(BATCH_IO_NOTE, NULL, tag);
+	if(request == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	request->status = status;
+	return submit(io, request);
+}
+
+// batch_io_wait
+// Waits for any request to finish and fills in completion for it.
+//
+// Returns:  Non-zero on error.
+int
+batch_io_wait(BatchIo *io, BatchIoCompletion *completion)
+{
+	BatchIoRequest *request;
+
+#ifdef HAVE_IO_URING
+	int status;
+
+	if(io->use_ring) {
+		for(;;) {
+			ring_reap(io);
+			request = pop_request(&io->finished);
+			if(request) break;
+
+			status = ring_enter(&io->ring, 0, 1, IORING_ENTER_GETEVENTS);
+			if(status) {
+				fprintf(stderr, "Unable to wait for I/O: %s.\n", strerror(status));
+				return 1;
+			}
+		}
+	} else
+#endif
+	{
+		mutex_lock(&io->lock);
+		while((request = pop_request(&io->finished)) == NULL) condition_wait(&io->wake, &io->lock);
+		mutex_unlock(&io->lock);
+	}
+
+	completion->op = request->op;
+	completion->tag = request->tag;
+	completion->status = request->status;
+	completion->data = request->data;
+	completion->size = request->size;
+
+	// A failed read gives nothing back.
+	if(request->op == BATCH_IO_READ && request->status) {
+		free(request->data);
+		completion->data = NULL;
+		completion->size = 0;
+	}
+
+	free(request->path);
+	free(request);
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * batchio.h
+ *
+ * Asynchronous whole-file reads and writes for converting many files at
+ * once.  On Linux the files are opened, read, written and closed through
+ * io_uring.  Elsewhere, or where io_uring is not allowed, a few threads
+ * do the same with blocking calls.  Either way, the threads that submit
+ * work never wait on the disk.
+ *
+ */
+
+#ifndef BATCHIO_H
+#define BATCHIO_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define BATCH_IO_READ  1
+#define BATCH_IO_WRITE 2
+#define BATCH_IO_NOTE  3   // Posted by batch_io_note, with no I/O behind it.
+
+typedef struct {
+	int op;
+	void *tag;             // As passed when the work was submitted.
+	int status;            // 0, or the errno of what failed.
+	uint8_t *data;         // The file read, which the caller frees, or the data written.
+	size_t size;
+} BatchIoCompletion;
+
+typedef struct BatchIo BatchIo;
+
+BatchIo *open_batch_io(int queue_depth, int use_threads);
+void close_batch_io(BatchIo *);
+const char *batch_io_backend(const BatchIo *);
+
+int batch_io_read(BatchIo *, const char *path, void *tag);
+int batch_io_write(BatchIo *, const char *path, uint8_t *data, size_t size, void *tag);
+int batch_io_note(BatchIo *, void *tag, int status);
+int batch_io_wait(BatchIo *, BatchIoCompletion *);
+
+#endif /* BATCHIO_H */
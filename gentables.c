@@ -0,0 +1,150 @@
+/*
+ * gentables.c
+ *
+ * Writes modtables.h, the lookup tables that midi notes and velocities
+ * are converted with.  It is run by the build.
+ *
+ *   gentables curve output.h
+ *
+ * curve picks how velocities become volumes:
+ *   linear  Volume in proportion to velocity, 127 playing at 64.
+ *   square  Volume in proportion to the square of velocity, as General
+ *           MIDI recommends.
+ *   legacy  velocity * 100 / 256, as midi2mod always used, which plays
+ *           127 at 49.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mod.h"
+
+// ProTracker's periods for its three octaves, from MOD_BASE_NOTE - 12,
+// without fine tune.  Trackers only name the notes written with these
+// exact periods, so they are kept rather than worked out.
+static const int PROTRACKER_PERIOD[36] = {
+	856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
+	428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
+	214, 202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113};
+
+// fit_note
+// Returns:  note moved by whole octaves to between low and high.
+static int
+fit_note(int note, int low, int high)
+{
+	while(note < low) note += 12;
+	while(note > high) note -= 12;
+	return note;
+}
+
+// note_period
+// Returns:  The period of a note within the period table, played with a
+//           sample of the given fine tune, -8 to 7.
+static int
+note_period(int note, int fine_tune)
+{
+	int base = MOD_BASE_NOTE - 12;
+
+	if(!fine_tune && note >= base && note < base + 36) return PROTRACKER_PERIOD[note - base];
+
+	return (int)floor(MOD_BASE_PERIOD * pow(2, -(note - MOD_BASE_NOTE) / 12.0 - fine_tune / 96.0) + 0.5);
+}
+
+// velocity_volume
+// Returns:  The EF_VOLUME value, 0 to 64, for a velocity.
+static int
+velocity_volume(const char *curve, int velocity)
+{
+	double v = velocity / 127.0;
+	int volume;
+
+	if(!strcmp(curve, "legacy")) return velocity * 100 / 256;
+
+	volume = (int)floor(64 * (!strcmp(curve, "square") ? v * v : v) + 0.5);
+	// Notes that are played at all are heard.
+	return velocity && !volume ? 1 : volume;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *out;
+	int f, n, note, high;
+
+	if(argc != 3 || (strcmp(argv[1], "linear") && strcmp(argv[1], "square") && strcmp(argv[1], "legacy"))) {
+		fprintf(stderr, "Usage: %s linear|square|legacy output.h\n", argv[0]);
+		return 1;
+	}
+
+	out = fopen(argv[2], "w");
+	if(out == NULL) {
+		fprintf(stderr, "Could not open %s.\n", argv[2]);
+		return 1;
+	}
+
+	fprintf(out,
+		"/*\n"
+		" * modtables.h\n"
+		" *\n"
+		" * Generated by gentables with the %s volume curve.  Do not edit.\n"
+		" *\n"
+		" */\n"
+		"\n"
+		"#ifndef MODTABLES_H\n"
+		"#define MODTABLES_H\n"
+		"\n"
+		"#include <inttypes.h>\n"
+		"\n", argv[1]);
+
+	fprintf(out,
+		"// Period of each midi note, [fine tune & 0x0F][note].  Notes outside\n"
+		"// MOD_LOWEST_NOTE to MOD_HIGHEST_NOTE are moved by whole octaves to\n"
+		"// within them.  Notes are written with fine tune 0, and a sample's\n"
+		"// fine tune picks the period that they play at.\n"
+		"static const uint16_t MOD_NOTE_PERIOD[16][128] = {\n");
+	for(f=0; f < 16; f++) {
+		fprintf(out, "\t{");
+		for(n=0; n < 128; n++) {
+			note = fit_note(n, MOD_LOWEST_NOTE, MOD_HIGHEST_NOTE);
+			fprintf(out, "%s%4d%s", n % 12 ? "" : "\n\t", note_period(note, f < 8 ? f : f - 16), n < 127 ? "," : "");
+		}
+		fprintf(out, "}%s\n", f < 15 ? "," : "");
+	}
+	fprintf(out, "};\n\n");
+
+	// The high wave lets notes an octave up keep to ProTracker's periods.
+	high = MOD_BASE_NOTE + 23;
+	fprintf(out,
+		"typedef struct {\n"
+		"\tuint16_t period;\n"
+		"\tuint8_t octave;            // 1 to play the note with the default wave an octave up.\n"
+		"} ModWaveNote;\n"
+		"\n"
+		"// How each midi note is played with the default waves.  Notes up to\n"
+		"// %d use the low wave, and higher ones the high wave.  Notes outside\n"
+		"// what the two waves can play are moved by whole octaves.\n"
+		"static const ModWaveNote MOD_WAVE_NOTE[128] = {", high);
+	for(n=0; n < 128; n++) {
+		note = fit_note(n, MOD_LOWEST_NOTE, MOD_HIGHEST_NOTE + 12);
+		fprintf(out, "%s{%4d, %d}%s", n % 8 ? " " : "\n\t", note_period(note > high ? note - 12 : note, 0), note > high,
+		        n < 127 ? "," : "");
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out,
+		"// EF_VOLUME value for each midi velocity.\n"
+		"static const uint8_t MOD_VELOCITY_VOLUME[128] = {");
+	for(n=0; n < 128; n++) {
+		fprintf(out, "%s%2d%s", n % 16 ? " " : "\n\t", velocity_volume(argv[1], n), n < 127 ? "," : "");
+	}
+	fprintf(out, "};\n\n#endif /* MODTABLES_H */\n");
+
+	if(fclose(out)) {
+		fprintf(stderr, "Could not write %s.\n", argv[2]);
+		return 1;
+	}
+
+	return 0;
+}
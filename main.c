@@ -1,38 +1,393 @@
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include "midi.h"
+#include "midistream.h"
+#include "allocator.h"
+#include "analyze.h"
+#include "batch.h"
 #include "mod.h"
+#include "sf2.h"
+#include "modrender.h"
+#include "modtune.h"
+#include "xm.h"
+#include "watch.h"
+#include "probes.h"
 
-int main(int argc, char **argv)
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+static void usage(const char *name)
 {
-    char* outfile_name = "test.mod";
-    if (argc > 2) {
-        outfile_name = argv[2];
+    fprintf(stderr, "Usage: %s [-s soundfont.sf2] [-p preview.wav] [-c channels] [-b bars] [-n channels] [-t] [-m] input.mid [output.mod|output.xm]\n", name);
+    fprintf(stderr, "       %s -d directory [-s soundfont.sf2] [-c channels] [-b bars] [-t] input.mid...\n", name);
+    fprintf(stderr, "       %s -w [-d directory] [-s soundfont.sf2] [-c channels] [-b bars] [-t] watched...\n", name);
+    fprintf(stderr, "       %s -a [-c channels] input.mid...\n", name);
+    fprintf(stderr, "  input.mid    Midi file to convert, or - to read it from standard input.\n");
+    fprintf(stderr, "  -c channels  Midi channels to convert, 1 to 16, such as 1-9,11-16.\n");
+    fprintf(stderr, "  -b bars      Bars to convert, counting from 1, such as 40-56.\n");
+    fprintf(stderr, "  -n channels  Channels to fill, 8 by default.  More than 8 needs an .xm output.\n");
+    fprintf(stderr, "  -t           Pick the divisions per beat and speed that suit the song.\n");
+    fprintf(stderr, "  -m           Print how reading and converting used memory.\n");
+    fprintf(stderr, "  -d directory Convert every input into directory, several at a time.\n");
+    fprintf(stderr, "               Set MIDI2MOD_IO=threads to not use io_uring.\n");
+    fprintf(stderr, "  -w           Convert midi files as they are written into each watched directory,\n");
+    fprintf(stderr, "               until interrupted.  Mods go next to them, or with -d into a directory\n");
+    fprintf(stderr, "               named after the watched one.\n");
+    fprintf(stderr, "  -a           Print statistics over every input, without converting.\n");
+}
+
+// Parses a list of channels such as "1-9,11" into a mask.
+static int parse_channels(const char *list, uint16_t *mask)
+{
+    char* end;
+    long first, last;
+
+    *mask = 0;
+    while (*list) {
+        first = strtol(list, &end, 10);
+        if (end == list) {
+            return 1;
+        }
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) {
+                return 1;
+            }
+        }
+        if (first < 1 || last > 16 || first > last) {
+            return 1;
+        }
+
+        for (; first <= last; first++) {
+            *mask |= 1 << (first - 1);
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return 1;
+        }
+        list = end;
     }
 
-    FILE* infile;
-    FILE* outfile;
+    return 0;
+}
+
+// Whether name ends in extension, ignoring case.
+static int has_extension(const char *name, const char *extension)
+{
+    size_t length = strlen(name);
+    size_t extension_length = strlen(extension);
+    size_t i;
+
+    if (length < extension_length) {
+        return 0;
+    }
+    name += length - extension_length;
+    for (i = 0; i < extension_length; i++) {
+        if (tolower((unsigned char)name[i]) != extension[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Renders mod into a WAV file.
+static int write_preview(const Mod *mod, const char *wav_name)
+{
+    FILE* file;
+    int status;
 
     #ifdef _WIN32
-    fopen_s(&infile, argv[1], "rb");
-    fopen_s(&outfile, outfile_name, "wb");
+    fopen_s(&file, wav_name, "wb");
     #else
-    infile = fopen(argv[1], "rb");
-    outfile = fopen(outfile_name, "wb");
+    file = fopen(wav_name, "wb");
     #endif
 
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open %s.\n", wav_name);
+        return 1;
+    }
+
+    status = write_wav_file(mod, MOD_RENDER_RATE, 0, file);
+    fclose(file);
+
+    return status;
+}
+
+// Renders the MOD that was written, as a check that it plays back.
+static int preview_mod(const char *mod_name, const char *wav_name)
+{
+    FILE* file;
+    Mod mod;
+    int status;
+
+    #ifdef _WIN32
+    fopen_s(&file, mod_name, "rb");
+    #else
+    file = fopen(mod_name, "rb");
+    #endif
+
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open %s.\n", mod_name);
+        return 1;
+    }
+
+    status = read_mod_file(&mod, file);
+    fclose(file);
+    if (status) {
+        return 1;
+    }
+
+    status = write_preview(&mod, wav_name);
+    destroy_mod(&mod);
+
+    return status;
+}
+
+// Converts many files into one directory, or with watch, the files
+// written into the directories given as inputs.
+static int convert_batch_files(char **inputs, int num_inputs, const char *dir, const MidiToModOptions *options,
+                               const char *soundfont_name, int first_bar, int last_bar, int tune, int watch)
+{
+    BatchSettings settings;
+    SoundFont soundfont;
+    const char *io = getenv("MIDI2MOD_IO");
+    int status;
+
+    memset(&settings, 0, sizeof(settings));
+    settings.output_dir = dir;
+    settings.options = *options;
+    settings.first_bar = first_bar;
+    settings.last_bar = last_bar;
+    settings.tune = tune;
+    settings.use_threads = io != NULL && !strcmp(io, "threads");
+
+    if (soundfont_name != NULL) {
+        if (read_soundfont(&soundfont, soundfont_name)) {
+            return 1;
+        }
+        settings.soundfont = &soundfont;
+    }
+
+    if (watch) {
+        status = watch_directories(inputs, num_inputs, &settings);
+    } else {
+        status = convert_batch(inputs, NULL, num_inputs, &settings);
+    }
+
+    if (soundfont_name != NULL) {
+        destroy_soundfont(&soundfont);
+    }
+
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    char* infile_name = NULL;
+    char* outfile_name = "test.mod";
+    char* soundfont_name = NULL;
+    char* preview_name = NULL;
+    char* batch_dir = NULL;
+    char** inputs;
+    int first_bar = 0;
+    int last_bar = 0;
+    int positional = 0;
+    int status = 0;
+    int trace_memory = 0;
+    int write_xm = 0;
+    int tune = 0;
+    int analyze = 0;
+    int watch = 0;
+    int i;
+    MidiToModOptions options;
+    TrackingAllocator tracking;
+    Allocator* allocator = NULL;
+
+    init_midi_to_mod_options(&options);
 
+    inputs = malloc(argc * sizeof(char *));
+    if (inputs == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            soundfont_name = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            preview_name = argv[++i];
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d-%d", &first_bar, &last_bar) != 2 || first_bar < 1 || last_bar < first_bar) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            if (parse_channels(argv[++i], &options.channels)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            options.num_channels = atoi(argv[++i]);
+            if (options.num_channels < 1 || options.num_channels > MOD_MAX_CHANNELS) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            batch_dir = argv[++i];
+        } else if (!strcmp(argv[i], "-w")) {
+            watch = 1;
+        } else if (!strcmp(argv[i], "-a")) {
+            analyze = 1;
+        } else if (!strcmp(argv[i], "-t")) {
+            tune = 1;
+        } else if (!strcmp(argv[i], "-m")) {
+            trace_memory = 1;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            inputs[positional++] = argv[i];
+        }
+    }
+
+    if (analyze) {
+        CorpusStats stats;
+
+        if (positional == 0) {
+            usage(argv[0]);
+            free(inputs);
+            return 1;
+        }
+        status = analyze_corpus(inputs, positional, options.channels, 0, &stats);
+        print_corpus_report(stdout, &stats);
+        free(inputs);
+        return status;
+    }
+
+    if (batch_dir != NULL || watch) {
+        status = 1;
+        if (positional == 0 || preview_name != NULL || trace_memory) {
+            usage(argv[0]);
+        } else {
+            status = convert_batch_files(inputs, positional, batch_dir, &options, soundfont_name, first_bar, last_bar, tune,
+                                         watch);
+        }
+        free(inputs);
+        return status;
+    }
+
+    if (positional == 0) {
+        usage(argv[0]);
+        free(inputs);
+        return 1;
+    }
+    infile_name = inputs[0];
+    if (positional >= 2) {
+        outfile_name = inputs[1];
+    }
+    free(inputs);
+
+    // An XM holds twice the patterns of a MOD.
+    write_xm = has_extension(outfile_name, ".xm");
+    if (write_xm) {
+        options.max_patterns = MOD_MAX_PATTERNS;
+    }
+
+    FILE* infile;
+    FILE* outfile;
     Midi midi;
-    if (read_midi_from_file(&midi, infile)) {
+
+    if (trace_memory) {
+        init_tracking_allocator(&tracking, NULL);
+        allocator = &tracking.allocator;
+        options.allocator = allocator;
+    }
+
+    if (!strcmp(infile_name, "-")) {
+        // A pipe is parsed as it arrives.
+        #ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        #endif
+        if (read_midi_from_stream(&midi, stdin, allocator)) {
+            return 1;
+        }
+    } else {
+        #ifdef _WIN32
+        fopen_s(&infile, infile_name, "rb");
+        #else
+        infile = fopen(infile_name, "rb");
+        #endif
+
+        if (infile == NULL) {
+            fprintf(stderr, "Unable to open %s.\n", infile_name);
+            return 1;
+        }
+        PROBE1(file_open, infile_name);
+
+        if (read_midi_from_file(&midi, infile, allocator)) {
+            fclose(infile);
+            return 1;
+        }
         fclose(infile);
-        return 1;
     }
-    fclose(infile);
 
 
+    if (first_bar) {
+        options.start_time = midi_bar_time(&midi, first_bar);
+        options.end_time = midi_bar_time(&midi, last_bar + 1);
+        if (options.start_time > 0 && index_midi_time(&midi, MIDI_CHECKPOINT_EVENTS)) {
+            destroy_midi(&midi);
+            return 1;
+        }
+    }
+
+    if (tune) {
+        ModTuning tuning;
+
+        if (tune_midi_to_mod(&midi, &options, 0, &tuning)) {
+            destroy_midi(&midi);
+            return 1;
+        }
+        options.ticks_per_beat = tuning.ticks_per_beat;
+        options.speed = tuning.speed;
+        printf("Tuned to %d ticks per division at speed %d: %zu of %zu notes dropped, %d patterns.\n",
+               tuning.ticks_per_beat, tuning.speed, tuning.dropped_notes, tuning.notes, tuning.num_patterns);
+    }
+
     Mod mod;
-    int i;
+    SoundFont soundfont;
+    memset(&mod, 0, sizeof(mod));
+
+    if (soundfont_name != NULL) {
+        if (read_soundfont(&soundfont, soundfont_name)) {
+            destroy_midi(&midi);
+            return 1;
+        }
+        if (soundfont_to_mod(&mod, &midi, &soundfont)) {
+            destroy_soundfont(&soundfont);
+            destroy_midi(&midi);
+            return 1;
+        }
+    }
 
-    midi_to_mod(&mod, &midi);
+    if (midi_to_mod(&mod, &midi, &options)) {
+        destroy_mod(&mod);
+        if (soundfont_name != NULL) {
+            destroy_soundfont(&soundfont);
+        }
+        destroy_midi(&midi);
+        return 1;
+    }
 
     for (i=0; i<128; i++) {
         if (midi.patches[i].used) {
@@ -40,11 +395,39 @@ int main(int argc, char **argv)
         }
     }
 
-    write_mod_file(&mod, outfile);
+    #ifdef _WIN32
+    fopen_s(&outfile, outfile_name, "wb");
+    #else
+    outfile = fopen(outfile_name, "wb");
+    #endif
+
+    if (outfile == NULL) {
+        fprintf(stderr, "Unable to open %s.\n", outfile_name);
+        status = 1;
+    } else {
+        status = write_xm ? write_xm_file(&mod, outfile) : write_mod_file(&mod, outfile);
+        fclose(outfile);
+    }
+
+    // There is no XM reader, so an XM is previewed from what was converted.
+    if (!status && preview_name != NULL && write_xm) {
+        status = write_preview(&mod, preview_name);
+    }
+
+    destroy_mod(&mod);
+
+    if (!status && preview_name != NULL && !write_xm) {
+        status = preview_mod(outfile_name, preview_name);
+    }
 
+    if (soundfont_name != NULL) {
+        destroy_soundfont(&soundfont);
+    }
     destroy_midi(&midi);
 
-    fclose(outfile);
+    if (trace_memory) {
+        print_allocation_report(stderr, &tracking, 10);
+    }
 
-    return 0;
+    return status;
 }
@@ -11,7 +11,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include "midi.h"
-#include "stringcatalog.h"
+#include "allocator.h"
+#include "probes.h"
 
 #ifdef _WIN32
 #include "winsock2.h"
@@ -32,52 +33,81 @@ const char *MIDI_NOTE_STRING[128] =
 	 "c''''", "c#''''", "d''''", "d#''''", "e''''", "f''''", "f#''''", "g''''", "g#''''", "a''''", "a#''''", "b''''",
 	 "c'''''", "c#'''''", "d'''''", "d#'''''", "e'''''", "f'''''", "f#'''''", "g'''''"};
 
-const int MIDI_EVENT_COMMAND_STRINGS_LENGTH = 7;
-const StringEntry MIDI_EVENT_COMMAND_STRINGS[] =
-	{{MIDI_NOTEOFF, "note off"},
-	 {MIDI_NOTEON, "note on"},
-	 {MIDI_KEYAFTERTOUCH, "key after touch"},
-	 {MIDI_CONTROLCHANGE, "control change"},
-	 {MIDI_PATCHCHANGE, "patch change"},
-	 {MIDI_CHANNELAFTERTOUCH, "channel after touch"},
-	 {MIDI_PITCHWHEEL, "pitch wheel"}};
-
-const int MIDI_META_COMMAND_STRINGS_LENGTH = 13;
-const StringEntry MIDI_META_COMMAND_STRINGS[] =
-	{{MIDI_META_SEQUENCENUMBER, "sequence number"},
-	 {MIDI_META_TEXT,           "text"},
-	 {MIDI_META_COPYRIGHT,      "copyright"},
-	 {MIDI_META_TRACKNAME,      "track name"},
-	 {MIDI_META_INSTRUMENTNAME, "instrument name"},
-	 {MIDI_META_LYRIC,          "lyric"},
-	 {MIDI_META_MARKER,         "marker"},
-	 {MIDI_META_CUEPOINT,       "cue point"},
-	 {MIDI_META_ENDTRACK,       "end of track"},
-	 {MIDI_META_SETTEMPO,       "set tempo"},
-	 {MIDI_META_TIMESIGNATURE,  "time signature"},
-	 {MIDI_META_KEYSIGNATURE,   "key signature"},
-	 {MIDI_META_SEQUENCERINFO,  "sequencer specific information"}};
-
+// Names of the channel commands, by the command's first nibble.
+const char *MIDI_EVENT_COMMAND_NAMES[16] = {
+	[MIDI_NOTEOFF >> 4]           = "note off",
+	[MIDI_NOTEON >> 4]            = "note on",
+	[MIDI_KEYAFTERTOUCH >> 4]     = "key after touch",
+	[MIDI_CONTROLCHANGE >> 4]     = "control change",
+	[MIDI_PATCHCHANGE >> 4]       = "patch change",
+	[MIDI_CHANNELAFTERTOUCH >> 4] = "channel after touch",
+	[MIDI_PITCHWHEEL >> 4]        = "pitch wheel"};
+
+// Names of the meta events, by meta type.
+const char *MIDI_META_COMMAND_NAMES[128] = {
+	[MIDI_META_SEQUENCENUMBER] = "sequence number",
+	[MIDI_META_TEXT]           = "text",
+	[MIDI_META_COPYRIGHT]      = "copyright",
+	[MIDI_META_TRACKNAME]      = "track name",
+	[MIDI_META_INSTRUMENTNAME] = "instrument name",
+	[MIDI_META_LYRIC]          = "lyric",
+	[MIDI_META_MARKER]         = "marker",
+	[MIDI_META_CUEPOINT]       = "cue point",
+	[MIDI_META_ENDTRACK]       = "end of track",
+	[MIDI_META_SETTEMPO]       = "set tempo",
+	[MIDI_META_TIMESIGNATURE]  = "time signature",
+	[MIDI_META_KEYSIGNATURE]   = "key signature",
+	[MIDI_META_SEQUENCERINFO]  = "sequencer specific information"};
+
+// read_midi_from_file
+// Reads a whole midi file.  All of its memory comes from allocator, or
+// from malloc if allocator is NULL.
+//
+// Returns:  Non-zero on error.
 int
-read_midi_from_file(Midi *midi, FILE *infile)
+read_midi_from_file(Midi *midi, FILE *infile, Allocator *allocator)
 {
 	MidiTrack *track;
 	size_t i;
 	int chan_patch[16];
 
+	midi->allocator = allocator;
+	midi->num_tracks = 0;
+	midi->tracks = NULL;
     if (read_midi_header(midi, infile)) {
         return 1;
     }
+	PROBE1(read_start, midi->num_tracks);
 
 	memset(midi->patches, 0, sizeof(midi->patches));
 	memset(chan_patch, 0, sizeof(chan_patch));
 	for(i=0; i < midi->num_tracks; i++) {
-		track = calloc(1, sizeof(MidiTrack));
-		if(!read_midi_track(track, midi->patches, chan_patch, infile))
+		track = mem_calloc(allocator, 1, sizeof(MidiTrack));
+		if(track == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+
+		if(!read_midi_track(track, midi->patches, chan_patch, infile, allocator))
 			midi->tracks[i] = track;
+		else
+			destroy_midi_track(track, allocator);
 	}
+	PROBE1(read_done, midi->num_tracks);
 
-	return 0;
+	return index_midi(midi);
+}
+
+// index_midi
+// Builds the channel index of a midi whose tracks have been read.  The
+// time index is left for index_midi_time, as only seeks past the start
+// need it.
+int
+index_midi(Midi *midi)
+{
+	memset(midi->channel_events, 0, sizeof(midi->channel_events));
+	memset(&midi->seek, 0, sizeof(midi->seek));
+	return index_midi_channels(midi);
 }
 
 int
@@ -131,12 +161,12 @@ read_midi_header(Midi *midi, FILE *infile)
 
 	midi->format = format;
 	midi->division = division;
-	midi->num_tracks = num_tracks;
-	midi->tracks = calloc(num_tracks, sizeof(MidiTrack));
+	midi->tracks = mem_calloc(midi->allocator, num_tracks, sizeof(MidiTrack *));
 	if (midi->tracks == NULL) {
 		fprintf(stderr, "Out of memory.\n");
 		return 1;
 	}
+	midi->num_tracks = num_tracks;
 
 	for (i = 0; i < num_tracks; i++) {
 		midi->tracks[i] = NULL;
@@ -148,7 +178,7 @@ read_midi_header(Midi *midi, FILE *infile)
 // patches: 128 element array of MidiPatches
 // chan_patch: Mapping of channel number to patch number
 int
-read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *infile)
+read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *infile, Allocator *allocator)
 {
 	uint8_t MTrk[4];
 	uint32_t length;
@@ -177,8 +207,9 @@ read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *
 		return 1;
 	}
 	length = ntohl(length);
+	PROBE1(track_start, length);
 
-	data = calloc(length, sizeof(uint8_t));
+	data = mem_calloc(allocator, length, sizeof(uint8_t));
 	if (data == NULL) {
 		fprintf(stderr, "Out of memory.\n");
 		return 1;
@@ -191,9 +222,13 @@ read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *
 	}
 	
 	while(head < data + length) {
-		event = calloc(1, sizeof(MidiEvent));
+		event = mem_calloc(allocator, 1, sizeof(MidiEvent));
+		if(event == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
 
-		event_length = get_midi_event(event, patches, chan_patch, head);
+		event_length = get_midi_event(event, patches, chan_patch, head, allocator);
 		if(event_length < 0) {
 			fprintf(stderr, "Error reading event.\n");
 			return 1;
@@ -201,7 +236,7 @@ read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *
 
 		track->num_events++;
 
-		track->events = realloc(track->events, track->num_events * sizeof(MidiEvent *));
+		track->events = mem_realloc(allocator, track->events, track->num_events * sizeof(MidiEvent *));
 		if(track->events == NULL) {
 			fprintf(stderr, "Out of memory.\n");
 			return 1;
@@ -212,7 +247,8 @@ read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *
 		head += event_length;
 	}
 
-	free(data);
+	mem_free(allocator, data);
+	PROBE1(track_done, track->num_events);
 
 	return 0;
 }
@@ -220,7 +256,7 @@ read_midi_track(MidiTrack *track, MidiPatch *patches, int chan_patch[16], FILE *
 // patches: 128 element array of MidiPatches
 // chan_patch: Mapping of channel number to patch number
 int
-get_midi_event(MidiEvent *event, MidiPatch *patches, int chan_patch[16], const uint8_t *data)
+get_midi_event(MidiEvent *event, MidiPatch *patches, int chan_patch[16], const uint8_t *data, Allocator *allocator)
 {
 	uint8_t *head = (uint8_t *)data;
 	uint8_t command;
@@ -259,8 +295,9 @@ get_midi_event(MidiEvent *event, MidiPatch *patches, int chan_patch[16], const u
 		if(command == MIDI_NOTEOFF ||
 		   command == MIDI_NOTEON ||
 		   command == MIDI_KEYAFTERTOUCH) {
-			event->note = *head;
-			event->velocity = *(head+1);
+			// Data bytes only have 7 bits, whatever a bad file says.
+			event->note = *head & 0x7F;
+			event->velocity = *(head+1) & 0x7F;
 
 			patch = &patches[(size_t)chan_patch[event->channel]];
 			if(event->note < patch->min || !patch->min)
@@ -271,7 +308,7 @@ get_midi_event(MidiEvent *event, MidiPatch *patches, int chan_patch[16], const u
 
 			command_length = 2;
 		} else if(command == MIDI_PATCHCHANGE) {
-			event->patch = *head;
+			event->patch = *head & 0x7F;
 			patches[event->patch].used = 1;
 			chan_patch[event->channel] = event->patch;
 			command_length = 1;
@@ -294,7 +331,7 @@ get_midi_event(MidiEvent *event, MidiPatch *patches, int chan_patch[16], const u
 		if(event->meta_type >= MIDI_META_TEXT &&     // Text event
 		   event->meta_type <= MIDI_META_CUEPOINT) { //
 			event->data_length = command_length;
-			event->data = calloc(command_length + 1, sizeof(uint8_t));
+			event->data = mem_calloc(allocator, command_length + 1, sizeof(uint8_t));
 			if (event->data == NULL) {
 				fprintf(stderr, "Out of memory.\n");
 				return 1;
@@ -307,7 +344,8 @@ get_midi_event(MidiEvent *event, MidiPatch *patches, int chan_patch[16], const u
 			//fprintf(stderr, "Midi read tempo %"PRIu32"\n", event->tempo);
 		} else if(event->meta_type == MIDI_META_TIMESIGNATURE) {
 			event->time_signature.numerator = *head;
-			event->time_signature.denominator = 0x01 << *(head+1);  // 2^(*(head+1))
+			// 2^(*(head+1)), which past 2^7 would not fit.
+			event->time_signature.denominator = 0x01 << (*(head+1) < 7 ? *(head+1) : 7);
 			event->time_signature.ticks_per_click = *(head+2);
 			event->time_signature.n32_per_click = *(head+3);
 		}
@@ -358,34 +396,297 @@ get_vl_quantity(uint32_t *q, const uint8_t *head)
 	return -1;
 }
 
+int
+compare_absolute_midi_event(const void *a, const void *b)
+{
+	const AbsoluteMidiEvent *x = a;
+	const AbsoluteMidiEvent *y = b;
+
+	if(x->time != y->time) return x->time < y->time ? -1 : 1;
+	if(x->order != y->order) return x->order < y->order ? -1 : 1;
+	return 0;
+}
+
+// index_midi_channels
+// Sorts the events of every track by time into one list per channel,
+// and one for meta and sysex events, so that a conversion only has to
+// look at the channels it wants.
+int
+index_midi_channels(Midi *midi)
+{
+	MidiTrack *track;
+	MidiEvent *event;
+	MidiEventList *list;
+	uint32_t counts[17];
+	uint32_t order;
+	long int time;
+	size_t i, j;
+
+	memset(counts, 0, sizeof(counts));
+	for(i=0; i < midi->num_tracks; i++) {
+		track = midi->tracks[i];
+		if(track == NULL) continue;
+
+		for(j=0; j < track->num_events; j++) {
+			event = track->events[j];
+			counts[event->type == MIDI_EVENT ? event->channel : MIDI_OTHER_EVENTS]++;
+		}
+	}
+
+	for(i=0; i < 17; i++) {
+		list = &midi->channel_events[i];
+		list->num_events = 0;
+		list->events = mem_calloc(midi->allocator, counts[i] ? counts[i] : 1, sizeof(AbsoluteMidiEvent));
+		if(list->events == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+	}
+
+	order = 0;
+	for(i=0; i < midi->num_tracks; i++) {
+		track = midi->tracks[i];
+		if(track == NULL) continue;
+
+		time = 0;
+		for(j=0; j < track->num_events; j++) {
+			event = track->events[j];
+			time += event->delta_time;
+
+			list = &midi->channel_events[event->type == MIDI_EVENT ? event->channel : MIDI_OTHER_EVENTS];
+			list->events[list->num_events].time = time;
+			list->events[list->num_events].order = order++;
+			list->events[list->num_events].event = event;
+			list->num_events++;
+		}
+	}
+
+	for(i=0; i < 17; i++) {
+		list = &midi->channel_events[i];
+		qsort(list->events, list->num_events, sizeof(AbsoluteMidiEvent), compare_absolute_midi_event);
+	}
+
+	return 0;
+}
+
+static void
+update_checkpoint(MidiCheckpoint *state, const MidiEvent *event)
+{
+	int channel = event->channel & 0x0F;
+
+	if(event->type == MIDI_EVENT) {
+		if(event->command == MIDI_NOTEON && event->velocity)
+			state->velocity[channel][event->note & 0x7F] = event->velocity;
+		else if(event->command == MIDI_NOTEON || event->command == MIDI_NOTEOFF)
+			state->velocity[channel][event->note & 0x7F] = 0;
+		else if(event->command == MIDI_PATCHCHANGE)
+			state->patch[channel] = event->patch & 0x7F;
+	} else if(event->type == MIDI_EVENT_META) {
+		if(event->meta_type == MIDI_META_SETTEMPO)
+			state->tempo = event->tempo;
+		else if(event->meta_type == MIDI_META_TIMESIGNATURE)
+			state->time_signature = event->time_signature;
+	}
+}
+
+static void
+clear_checkpoint(MidiCheckpoint *state)
+{
+	int i;
+
+	memset(state, 0, sizeof(MidiCheckpoint));
+	for(i=0; i < 16; i++) state->patch[i] = -1;
+}
+
+// index_midi_time
+// Takes a checkpoint of the song every interval events, so that
+// seek_midi only has to look at the events since the last one.  Long
+// songs get fewer checkpoints, further apart, rather than more than
+// MIDI_MAX_CHECKPOINTS.
+//
+// Every channel only changes its own part of the state, so each
+// channel_events list is walked on its own.
+int
+index_midi_time(Midi *midi, uint32_t interval)
+{
+	MidiSeekIndex *seek = &midi->seek;
+	const MidiEventList *list;
+	MidiCheckpoint *checkpoint;
+	MidiCheckpoint state;
+	uint32_t next[17];
+	size_t total = 0, count = 0;
+	long int time;
+	uint32_t i, j, k, max_checkpoints;
+	int c;
+
+	for(i=0; i < 17; i++) total += midi->channel_events[i].num_events;
+
+	if(interval == 0) interval = 1;
+	if(total / interval >= MIDI_MAX_CHECKPOINTS) interval = total / (MIDI_MAX_CHECKPOINTS - 1) + 1;
+	max_checkpoints = total / interval + 1;
+
+	mem_free(midi->allocator, seek->checkpoints);
+	seek->interval = interval;
+	seek->checkpoints = mem_calloc(midi->allocator, max_checkpoints, sizeof(MidiCheckpoint));
+	if(seek->checkpoints == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		seek->num_checkpoints = 0;
+		return 1;
+	}
+
+	// The checkpoints go at the time of every interval'th event, in the
+	// order the channels' events are merged in.
+	memset(next, 0, sizeof(next));
+	clear_checkpoint(&seek->checkpoints[0]);
+	k = 1;
+	for(;;) {
+		c = -1;
+		for(i=0; i < 17; i++) {
+			list = &midi->channel_events[i];
+			if(next[i] < list->num_events && (c < 0 || list->events[next[i]].time < midi->channel_events[c].events[next[c]].time))
+				c = i;
+		}
+		if(c < 0 || k == max_checkpoints) break;
+
+		time = midi->channel_events[c].events[next[c]++].time;
+		if(++count % interval == 0 && time > seek->checkpoints[k - 1].time) {
+			clear_checkpoint(&seek->checkpoints[k]);
+			seek->checkpoints[k++].time = time;
+		}
+	}
+	seek->num_checkpoints = k;
+
+	for(i=0; i < 17; i++) {
+		list = &midi->channel_events[i];
+		clear_checkpoint(&state);
+
+		j = 0;
+		for(k=0; k < seek->num_checkpoints; k++) {
+			checkpoint = &seek->checkpoints[k];
+			for(; j < list->num_events && list->events[j].time < checkpoint->time; j++)
+				update_checkpoint(&state, list->events[j].event);
+
+			checkpoint->next[i] = j;
+			if(i < 16) {
+				checkpoint->patch[i] = state.patch[i];
+				memcpy(checkpoint->velocity[i], state.velocity[i], sizeof(state.velocity[i]));
+			} else {
+				checkpoint->tempo = state.tempo;
+				checkpoint->time_signature = state.time_signature;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// seek_midi
+// Works out the state of the song at time, from the last checkpoint
+// before it, or from the start if the midi has no time index.
+int
+seek_midi(const Midi *midi, long int time, MidiCheckpoint *state)
+{
+	const MidiSeekIndex *seek = &midi->seek;
+	const MidiEventList *list;
+	uint32_t i, low, high, middle;
+
+	if(time < 0) time = 0;
+
+	if(seek->num_checkpoints == 0) {
+		clear_checkpoint(state);
+	} else {
+		// The last checkpoint at or before time.
+		low = 0;
+		high = seek->num_checkpoints;
+		while(high - low > 1) {
+			middle = low + (high - low) / 2;
+			if(seek->checkpoints[middle].time <= time) low = middle;
+			else high = middle;
+		}
+		*state = seek->checkpoints[low];
+	}
+	state->time = time;
+
+	for(i=0; i < 17; i++) {
+		list = &midi->channel_events[i];
+		for(; state->next[i] < list->num_events && list->events[state->next[i]].time < time; state->next[i]++)
+			update_checkpoint(state, list->events[state->next[i]].event);
+	}
+
+	return 0;
+}
+
+// midi_bar_time
+// Finds the time at which a bar starts, counting from 1 and following
+// time signature changes.  Bars are taken to be 4/4 until the first
+// time signature.
+long int
+midi_bar_time(const Midi *midi, int bar)
+{
+	const MidiEventList *list = &midi->channel_events[MIDI_OTHER_EVENTS];
+	const MidiEvent *event;
+	long int time = 0;
+	long int bar_length = 4L * midi->division;
+	uint32_t i = 0;
+
+	for(; bar > 1; bar--) {
+		// A time signature at the start of the bar sets its length.
+		for(; i < list->num_events && list->events[i].time <= time; i++) {
+			event = list->events[i].event;
+			if(event->type == MIDI_EVENT_META && event->meta_type == MIDI_META_TIMESIGNATURE &&
+			   event->time_signature.numerator && event->time_signature.denominator)
+				bar_length = 4L * midi->division * event->time_signature.numerator / event->time_signature.denominator;
+		}
+
+		time += bar_length;
+	}
+
+	return time;
+}
+
 void
 destroy_midi(Midi *midi)
 {
 	size_t i;
 	for(i=0; i < midi->num_tracks; i++) {
 		if(midi->tracks[i])
-			destroy_midi_track(midi->tracks[i]);
+			destroy_midi_track(midi->tracks[i], midi->allocator);
 	}
 
-	free(midi->tracks);
+	for(i=0; i < 17; i++) {
+		mem_free(midi->allocator, midi->channel_events[i].events);
+		midi->channel_events[i].events = NULL;
+		midi->channel_events[i].num_events = 0;
+	}
+
+	mem_free(midi->allocator, midi->seek.checkpoints);
+	midi->seek.checkpoints = NULL;
+	midi->seek.num_checkpoints = 0;
+
+	mem_free(midi->allocator, midi->tracks);
+	midi->tracks = NULL;
+	midi->num_tracks = 0;
 }
 
+// destroy_midi_track
+// Frees a track and its events, which came from allocator.
 void
-destroy_midi_track(MidiTrack *track)
+destroy_midi_track(MidiTrack *track, Allocator *allocator)
 {
 	size_t i;
 	for(i=0; i < track->num_events; i++) {
-		destroy_midi_event(track->events[i]);
+		destroy_midi_event(track->events[i], allocator);
 	}
 
-	free(track->events);
+	mem_free(allocator, track->events);
+	mem_free(allocator, track);
 }
 
 void
-destroy_midi_event(MidiEvent *event)
+destroy_midi_event(MidiEvent *event, Allocator *allocator)
 {
-	free(event->data);
-	free(event);
+	mem_free(allocator, event->data);
+	mem_free(allocator, event);
 }
 
 void
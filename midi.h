@@ -12,7 +12,7 @@
 #include <stdio.h>
 #include <inttypes.h>
 
-#include "stringcatalog.h"
+#include "allocator.h"
 
 #define MIDI_EVENT			0x01
 #define MIDI_EVENT_SYSEX		0x02
@@ -51,12 +51,10 @@
 extern const char *MIDI_NOTE_STRING[];
 #define midi_note_string(x) MIDI_NOTE_STRING[(x)]
 
-extern const int MIDI_EVENT_COMMAND_STRINGS_LENGTH;
-extern const StringEntry MIDI_EVENT_COMMAND_STRINGS[];
-extern const int MIDI_META_COMMAND_STRINGS_LENGTH;
-extern const StringEntry MIDI_META_COMMAND_STRINGS[];
-#define get_midi_event_command_string(x) get_string((x), MIDI_EVENT_COMMAND_STRINGS, MIDI_EVENT_COMMAND_STRINGS_LENGTH)
-#define get_midi_meta_command_string(x) get_string((x), MIDI_META_COMMAND_STRINGS, MIDI_META_COMMAND_STRINGS_LENGTH)
+extern const char *MIDI_EVENT_COMMAND_NAMES[16];
+extern const char *MIDI_META_COMMAND_NAMES[128];
+#define get_midi_event_command_string(x) MIDI_EVENT_COMMAND_NAMES[((x) >> 4) & 0x0F]
+#define get_midi_meta_command_string(x) ((x) < 128 ? MIDI_META_COMMAND_NAMES[(x)] : NULL)
 
 typedef struct {
 	uint8_t numerator;
@@ -86,6 +84,42 @@ typedef struct {
 	MidiEvent **events;
 } MidiTrack;
 
+typedef struct {
+	long int time;  // Absolute time of event.
+	uint32_t order; // Position in the file, to keep simultaneous events in order.
+	MidiEvent *event;
+} AbsoluteMidiEvent;
+
+typedef struct {
+	uint32_t num_events;
+	AbsoluteMidiEvent *events;
+} MidiEventList;
+
+// Meta and sysex events are listed after the 16 channels.
+#define MIDI_OTHER_EVENTS 16
+
+// State of the song at a point in time.
+typedef struct {
+	long int time;
+	uint32_t next[17];                  // First event of each channel_events list at or after time.
+	uint32_t tempo;                     // Tempo in effect, 0 if none has been set.
+	MidiTimeSignature time_signature;   // Numerator is 0 if none has been set.
+	int16_t patch[16];                  // Patch of each channel, -1 if none has been set.
+	uint8_t velocity[16][128];          // Velocity of each sounding note, 0 if off.
+} MidiCheckpoint;
+
+// Most checkpoints a time index takes, so that it stays small.
+#define MIDI_MAX_CHECKPOINTS 256
+
+// Events between checkpoints, for songs short enough.
+#define MIDI_CHECKPOINT_EVENTS 1024
+
+typedef struct {
+	uint32_t interval;                  // Events between checkpoints.
+	uint32_t num_checkpoints;
+	MidiCheckpoint *checkpoints;
+} MidiSeekIndex;
+
 typedef struct {
 	uint8_t used; /* Whether or not this patch is used in this midi */
 	uint8_t min;  /* Lowest note used in this patch */
@@ -98,18 +132,28 @@ typedef struct {
 	uint32_t num_tracks;
 	MidiTrack **tracks;
 	MidiPatch patches[128];
+	MidiEventList channel_events[17]; /* Events of each channel in time order */
+	MidiSeekIndex seek;
+	Allocator *allocator;             /* Where the memory above came from, NULL for malloc */
 } Midi;
 
-int read_midi_from_file(Midi *, FILE *);
+int read_midi_from_file(Midi *, FILE *, Allocator *);
 int read_midi_header(Midi *, FILE *);
-int read_midi_track(MidiTrack *, MidiPatch *, int chan_patch[16], FILE *);
+int read_midi_track(MidiTrack *, MidiPatch *, int chan_patch[16], FILE *, Allocator *);
 
-int get_midi_event(MidiEvent *, MidiPatch *, int chan_patch[16], const uint8_t *);
+int get_midi_event(MidiEvent *, MidiPatch *, int chan_patch[16], const uint8_t *, Allocator *);
 int get_vl_quantity(uint32_t* q, const uint8_t* head);
 
+int index_midi(Midi *);
+int index_midi_channels(Midi *);
+int index_midi_time(Midi *, uint32_t interval);
+int seek_midi(const Midi *, long int time, MidiCheckpoint *);
+long int midi_bar_time(const Midi *, int bar);
+int compare_absolute_midi_event(const void *a, const void *b);
+
 void destroy_midi(Midi *);
-void destroy_midi_track(MidiTrack *);
-void destroy_midi_event(MidiEvent *);
+void destroy_midi_track(MidiTrack *, Allocator *);
+void destroy_midi_event(MidiEvent *, Allocator *);
 
 void print_midi_event(FILE *, const MidiEvent *);
 
@@ -0,0 +1,451 @@
+/*
+ * mididump.c
+ *
+ * Dumps the events of a midi file, as text, JSON Lines or fixed size
+ * binary records.  Events are written from the stream parser straight
+ * into a large buffer, so dumping runs at about the speed of parsing.
+ *
+ *   mididump [-f text|json|binary] input.mid
+ *
+ * An input of - reads standard input.
+ *
+ * Binary output starts with "MDMP", then the format, division and
+ * number of tracks as little endian 16 bit numbers.  Every event follows
+ * as 16 bytes, little endian:
+ *
+ *   0  track (16 bits)     8  channel      12  value (32 bits)
+ *   2  type                9  meta type
+ *   3  command            10  note or patch
+ *   4  delta time (32)    11  velocity
+ *
+ * value is the tempo of a set tempo event, the numerator, denominator,
+ * ticks per click and 32nds per click of a time signature from the low
+ * byte up, and the text length of a text event.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "midi.h"
+#include "midistream.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+enum {
+	DUMP_TEXT,
+	DUMP_JSON,
+	DUMP_BINARY
+};
+
+#define DUMP_BUFFER (1 << 20)
+// Most any one event can take, with its text escaped for JSON.
+#define DUMP_EVENT_MAX (6 * MIDI_STREAM_TEXT + 512)
+#define DUMP_CHUNK 65536
+
+typedef struct {
+	FILE *outfile;
+	char *buffer;
+	size_t used;
+	int format;
+	int started;         // Whether the header has been written.
+	uint32_t track;      // Last track written, for text output.
+	MidiStream *stream;
+} Dump;
+
+static int
+flush_dump(Dump *dump)
+{
+	if(dump->used && fwrite(dump->buffer, 1, dump->used, dump->outfile) != dump->used) {
+		fprintf(stderr, "Unable to write dump.\n");
+		return 1;
+	}
+
+	dump->used = 0;
+	return 0;
+}
+
+static char *
+put_string(char *p, const char *s)
+{
+	size_t length = strlen(s);
+	memcpy(p, s, length);
+	return p + length;
+}
+
+static char *
+put_uint(char *p, uint32_t v)
+{
+	char digits[10];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while(v);
+
+	while(n) *p++ = digits[--n];
+	return p;
+}
+
+static char *
+put_le16(char *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static char *
+put_le32(char *p, uint32_t v)
+{
+	return put_le16(put_le16(p, v & 0xFFFF), v >> 16);
+}
+
+static char *
+put_json_string(char *p, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	*p++ = '"';
+	for(; *s; s++) {
+		c = *s;
+		if(c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if(c < 0x20) {
+			p = put_string(p, "\\u00");
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 0x0F];
+		} else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+
+	return p;
+}
+
+static char *
+put_header(char *p, const MidiStream *stream, int format)
+{
+	if(format == DUMP_BINARY) {
+		p = put_string(p, "MDMP");
+		p = put_le16(p, stream->format);
+		p = put_le16(p, stream->division);
+		return put_le16(p, stream->num_tracks);
+	}
+
+	if(format == DUMP_JSON) {
+		p = put_string(p, "{\"format\":");
+		p = put_uint(p, stream->format);
+		p = put_string(p, ",\"tracks\":");
+		p = put_uint(p, stream->num_tracks);
+		p = put_string(p, ",\"division\":");
+		p = put_uint(p, stream->division);
+		return put_string(p, "}\n");
+	}
+
+	p = put_string(p, "Header:  Format ");
+	p = put_uint(p, stream->format);
+	p = put_string(p, ", ");
+	p = put_uint(p, stream->num_tracks);
+	p = put_string(p, " tracks, division = ");
+	p = put_uint(p, stream->division);
+	return put_string(p, ".\n");
+}
+
+static int
+is_text_event(const MidiEvent *event)
+{
+	return event->type == MIDI_EVENT_META &&
+	       event->meta_type >= MIDI_META_TEXT &&
+	       event->meta_type <= MIDI_META_CUEPOINT;
+}
+
+static int
+is_note_event(const MidiEvent *event)
+{
+	return event->type == MIDI_EVENT &&
+	       (event->command == MIDI_NOTEOFF ||
+	        event->command == MIDI_NOTEON ||
+	        event->command == MIDI_KEYAFTERTOUCH);
+}
+
+// Lines are as print_midi_event writes them.
+static char *
+put_text_event(char *p, const MidiEvent *event)
+{
+	const char *name;
+
+	if(event->type == MIDI_EVENT) {
+		p = put_string(p, "Midi event:\t");
+		p = put_uint(p, event->delta_time);
+		p = put_string(p, ",\t");
+		p = put_string(p, get_midi_event_command_string(event->command));
+		p = put_string(p, ",\t");
+		p = put_uint(p, event->channel);
+
+		if(is_note_event(event)) {
+			p = put_string(p, ",\tNote:  ");
+			p = put_string(p, midi_note_string(event->note & 0x7F));
+			p = put_string(p, " (");
+			p = put_uint(p, event->velocity);
+			p = put_string(p, ")");
+		} else if(event->command == MIDI_PATCHCHANGE) {
+			p = put_string(p, ",\tPatch:  ");
+			p = put_uint(p, event->patch);
+		}
+	} else if(event->type == MIDI_EVENT_META) {
+		name = get_midi_meta_command_string(event->meta_type);
+		p = put_string(p, "Meta event:\t");
+		p = put_uint(p, event->delta_time);
+		p = put_string(p, ",\t");
+		p = put_string(p, name ? name : "(null)");
+
+		if(is_text_event(event)) {
+			p = put_string(p, ",\t");
+			p = put_string(p, (const char *)event->data);
+		} else if(event->meta_type == MIDI_META_SETTEMPO) {
+			p = put_string(p, ",\t");
+			p = put_uint(p, event->tempo);
+			p = put_string(p, " microseconds/quarter note");
+		} else if(event->meta_type == MIDI_META_TIMESIGNATURE) {
+			p = put_string(p, ",\t");
+			p = put_uint(p, event->time_signature.numerator);
+			p = put_string(p, "/");
+			p = put_uint(p, event->time_signature.denominator);
+			p = put_string(p, ", ");
+			p = put_uint(p, event->time_signature.ticks_per_click);
+			p = put_string(p, " ticks per beat, ");
+			p = put_uint(p, event->time_signature.n32_per_click);
+			p = put_string(p, " 32nd notes per beat.");
+		}
+	} else {
+		p = put_string(p, "Sysex event:\t");
+		p = put_uint(p, event->delta_time);
+		p = put_string(p, ",\t");
+		p = put_uint(p, event->command);
+	}
+
+	return put_string(p, "\n");
+}
+
+static char *
+put_json_event(char *p, uint32_t track, const MidiEvent *event)
+{
+	const char *name;
+
+	p = put_string(p, "{\"track\":");
+	p = put_uint(p, track);
+	p = put_string(p, ",\"delta\":");
+	p = put_uint(p, event->delta_time);
+
+	if(event->type == MIDI_EVENT) {
+		p = put_string(p, ",\"type\":\"midi\",\"command\":\"");
+		p = put_string(p, get_midi_event_command_string(event->command));
+		p = put_string(p, "\",\"channel\":");
+		p = put_uint(p, event->channel);
+
+		if(is_note_event(event)) {
+			p = put_string(p, ",\"note\":");
+			p = put_uint(p, event->note);
+			p = put_string(p, ",\"velocity\":");
+			p = put_uint(p, event->velocity);
+		} else if(event->command == MIDI_PATCHCHANGE) {
+			p = put_string(p, ",\"patch\":");
+			p = put_uint(p, event->patch);
+		}
+	} else if(event->type == MIDI_EVENT_META) {
+		name = get_midi_meta_command_string(event->meta_type);
+		p = put_string(p, ",\"type\":\"meta\",\"meta_type\":");
+		p = put_uint(p, event->meta_type);
+		if(name) {
+			p = put_string(p, ",\"command\":\"");
+			p = put_string(p, name);
+			p = put_string(p, "\"");
+		}
+
+		if(is_text_event(event)) {
+			p = put_string(p, ",\"text\":");
+			p = put_json_string(p, (const char *)event->data);
+		} else if(event->meta_type == MIDI_META_SETTEMPO) {
+			p = put_string(p, ",\"tempo\":");
+			p = put_uint(p, event->tempo);
+		} else if(event->meta_type == MIDI_META_TIMESIGNATURE) {
+			p = put_string(p, ",\"numerator\":");
+			p = put_uint(p, event->time_signature.numerator);
+			p = put_string(p, ",\"denominator\":");
+			p = put_uint(p, event->time_signature.denominator);
+			p = put_string(p, ",\"ticks_per_click\":");
+			p = put_uint(p, event->time_signature.ticks_per_click);
+			p = put_string(p, ",\"n32_per_click\":");
+			p = put_uint(p, event->time_signature.n32_per_click);
+		}
+	} else {
+		p = put_string(p, ",\"type\":\"sysex\",\"command\":");
+		p = put_uint(p, event->command);
+	}
+
+	return put_string(p, "}\n");
+}
+
+static char *
+put_binary_event(char *p, uint32_t track, const MidiEvent *event)
+{
+	uint32_t value = 0;
+
+	if(is_text_event(event)) {
+		value = event->data_length;
+	} else if(event->type == MIDI_EVENT_META && event->meta_type == MIDI_META_SETTEMPO) {
+		value = event->tempo;
+	} else if(event->type == MIDI_EVENT_META && event->meta_type == MIDI_META_TIMESIGNATURE) {
+		value = event->time_signature.numerator |
+		        event->time_signature.denominator << 8 |
+		        event->time_signature.ticks_per_click << 16 |
+		        (uint32_t)event->time_signature.n32_per_click << 24;
+	}
+
+	p = put_le16(p, track);
+	*p++ = event->type;
+	*p++ = event->command;
+	p = put_le32(p, event->delta_time);
+	*p++ = event->channel;
+	*p++ = event->meta_type;
+	*p++ = event->command == MIDI_PATCHCHANGE ? event->patch : event->note;
+	*p++ = event->velocity;
+	return put_le32(p, value);
+}
+
+static int
+dump_event(void *context, uint32_t track, const MidiEvent *event)
+{
+	Dump *dump = context;
+	char *p;
+
+	if(dump->used + DUMP_EVENT_MAX > DUMP_BUFFER && flush_dump(dump))
+		return 1;
+	p = dump->buffer + dump->used;
+
+	if(!dump->started) {
+		p = put_header(p, dump->stream, dump->format);
+		dump->started = 1;
+		dump->track = (uint32_t)-1;
+	}
+
+	if(dump->format == DUMP_TEXT) {
+		if(track != dump->track) {
+			p = put_string(p, "\nTrack:  ");
+			p = put_uint(p, track);
+			p = put_string(p, ".\n");
+			dump->track = track;
+		}
+		p = put_text_event(p, event);
+	} else if(dump->format == DUMP_JSON) {
+		p = put_json_event(p, track, event);
+	} else {
+		p = put_binary_event(p, track, event);
+	}
+
+	dump->used = p - dump->buffer;
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f text|json|binary] input.mid\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	Dump dump;
+	MidiStream stream;
+	FILE *infile;
+	const char *infile_name = NULL;
+	uint8_t *chunk;
+	size_t length;
+	int status = 0;
+	int i;
+
+	memset(&dump, 0, sizeof(dump));
+	dump.format = DUMP_TEXT;
+
+	for(i=1; i < argc; i++) {
+		if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+			i++;
+			if     (!strcmp(argv[i], "text"))   dump.format = DUMP_TEXT;
+			else if(!strcmp(argv[i], "json"))   dump.format = DUMP_JSON;
+			else if(!strcmp(argv[i], "binary")) dump.format = DUMP_BINARY;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if(infile_name == NULL) {
+			infile_name = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(infile_name == NULL) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(!strcmp(infile_name, "-")) {
+		infile = stdin;
+		#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+		#endif
+	} else {
+		#ifdef _WIN32
+		fopen_s(&infile, infile_name, "rb");
+		#else
+		infile = fopen(infile_name, "rb");
+		#endif
+	}
+
+	if(infile == NULL) {
+		fprintf(stderr, "Unable to open %s.\n", infile_name);
+		return 1;
+	}
+
+	#ifdef _WIN32
+	if(dump.format == DUMP_BINARY) _setmode(_fileno(stdout), _O_BINARY);
+	#endif
+
+	dump.outfile = stdout;
+	dump.stream = &stream;
+	dump.buffer = malloc(DUMP_BUFFER);
+	chunk = malloc(DUMP_CHUNK);
+	if(dump.buffer == NULL || chunk == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	init_midi_stream(&stream, dump_event, &dump);
+	while(!status && (length = fread(chunk, 1, DUMP_CHUNK, infile)) > 0) {
+		status = feed_midi_stream(&stream, chunk, length);
+	}
+	if(!status) status = finish_midi_stream(&stream);
+
+	// A file with no events still gets its header.
+	if(!status && !dump.started) {
+		dump.used = put_header(dump.buffer, &stream, dump.format) - dump.buffer;
+	}
+
+	if(flush_dump(&dump)) status = 1;
+
+	if(infile != stdin) fclose(infile);
+	free(dump.buffer);
+	free(chunk);
+
+	return status;
+}
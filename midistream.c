@@ -0,0 +1,524 @@
+/*
+ * midistream.c
+ *
+ * Push parser for midi files.  The parser is a state machine that keeps
+ * only the event being read and a few bytes of any value split between
+ * chunks, so it never needs to see a whole track at once.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "midi.h"
+#include "midistream.h"
+#include "allocator.h"
+#include "probes.h"
+
+enum {
+	STREAM_HEADER,
+	STREAM_TRACK_HEADER,
+	STREAM_SKIP_CHUNK,
+	STREAM_DELTA,
+	STREAM_STATUS,
+	STREAM_CHANNEL_DATA,
+	STREAM_META_TYPE,
+	STREAM_META_LENGTH,
+	STREAM_META_DATA,
+	STREAM_SYSEX_LENGTH,
+	STREAM_SYSEX_DATA,
+	STREAM_DONE,
+	STREAM_ERROR
+};
+
+// Bytes read from a pipe at a time.
+#define MIDI_STREAM_CHUNK 4096
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int
+stream_error(MidiStream *stream, const char *message)
+{
+	fprintf(stderr, "%s\n", message);
+	stream->stage = STREAM_ERROR;
+	return 1;
+}
+
+static void
+start_track(MidiStream *stream)
+{
+	stream->running_status = 0;
+	stream->have = 0;
+	stream->stage = stream->track < stream->num_tracks ? STREAM_TRACK_HEADER : STREAM_DONE;
+	if(stream->stage == STREAM_DONE) PROBE1(read_done, stream->num_tracks);
+}
+
+static void
+finish_track(MidiStream *stream)
+{
+	PROBE1(track_done, stream->track_events);
+	stream->track++;
+	start_track(stream);
+}
+
+static void
+start_event(MidiStream *stream)
+{
+	memset(&stream->event, 0, sizeof(stream->event));
+	stream->quantity = 0;
+	stream->quantity_length = 0;
+	stream->stage = STREAM_DELTA;
+}
+
+static int
+finish_event(MidiStream *stream)
+{
+	if(stream->handler(stream->context, stream->track, &stream->event))
+		return stream_error(stream, "Midi stream stopped.");
+	stream->track_events++;
+
+	if(stream->track_left == 0) {
+		finish_track(stream);
+	} else {
+		start_event(stream);
+	}
+
+	return 0;
+}
+
+// read_quantity
+// Adds one byte to the variable length quantity being read.
+//
+// Returns:  1 once the quantity is complete, 0 if more bytes are needed,
+//           negative if the quantity is too long.
+static int
+read_quantity(MidiStream *stream, uint8_t byte)
+{
+	stream->quantity = (stream->quantity << 7) | (byte & 0x7F);
+	stream->quantity_length++;
+
+	if(byte < 0x80) return 1;
+	if(stream->quantity_length == 4) return -1;
+	return 0;
+}
+
+// Fills in the event from its data bytes, just as get_midi_event does.
+static void
+set_channel_event(MidiStream *stream)
+{
+	MidiEvent *event = &stream->event;
+	MidiPatch *patch;
+
+	if(event->command == MIDI_NOTEOFF ||
+	   event->command == MIDI_NOTEON ||
+	   event->command == MIDI_KEYAFTERTOUCH) {
+		event->note = stream->buffer[0];
+		event->velocity = stream->buffer[1];
+
+		patch = &stream->patches[(size_t)stream->chan_patch[event->channel]];
+		if(event->note < patch->min || !patch->min)
+			patch->min = event->note;
+
+		if(event->note > patch->max)
+			patch->max = event->note;
+	} else if(event->command == MIDI_PATCHCHANGE) {
+		event->patch = stream->buffer[0];
+		stream->patches[event->patch].used = 1;
+		stream->chan_patch[event->channel] = event->patch;
+	}
+}
+
+static void
+set_meta_event(MidiStream *stream)
+{
+	MidiEvent *event = &stream->event;
+	uint8_t *head = stream->text;
+
+	if(event->meta_type >= MIDI_META_TEXT &&
+	   event->meta_type <= MIDI_META_CUEPOINT) {
+		event->data_length = stream->have;
+		event->data = stream->text;
+		stream->text[stream->have] = 0;
+	} else if(event->meta_type == MIDI_META_SETTEMPO) {
+		event->tempo = 0 | *head << 16 | *(head+1) << 8 | *(head+2);
+	} else if(event->meta_type == MIDI_META_TIMESIGNATURE) {
+		event->time_signature.numerator = *head;
+		// Past 2^7 the denominator would not fit, or the shift be undefined.
+		event->time_signature.denominator = 0x01 << (*(head+1) < 7 ? *(head+1) : 7);
+		event->time_signature.ticks_per_click = *(head+2);
+		event->time_signature.n32_per_click = *(head+3);
+	}
+}
+
+// Starts reading an event from its status byte, or from its first data
+// byte under running status.
+static int
+read_status(MidiStream *stream, uint8_t byte)
+{
+	MidiEvent *event = &stream->event;
+	uint8_t command;
+
+	if(byte < 0x80) {
+		if(!stream->running_status)
+			return stream_error(stream, "Bad event status.");
+		command = stream->running_status;
+	} else {
+		command = byte;
+	}
+
+	if(command >= MIDI_NOTEOFF && (command & 0xF0) <= MIDI_PITCHWHEEL) {
+		stream->running_status = command;
+		event->type = MIDI_EVENT;
+		event->channel = command & 0x0F;
+		event->command = command & 0xF0;
+
+		stream->need = event->command == MIDI_PATCHCHANGE ||
+		               event->command == MIDI_CHANNELAFTERTOUCH ? 1 : 2;
+		stream->have = 0;
+		stream->stage = STREAM_CHANNEL_DATA;
+		if(byte < 0x80) {
+			// Under running status this is the first data byte, which
+			// is all that patch changes and channel aftertouch have.
+			stream->buffer[stream->have++] = byte;
+			if(stream->have == stream->need) {
+				set_channel_event(stream);
+				return finish_event(stream);
+			}
+		}
+	} else if(command == MIDI_META) {
+		stream->running_status = 0;
+		event->type = MIDI_EVENT_META;
+		event->command = command;
+		stream->stage = STREAM_META_TYPE;
+	} else if(command == MIDI_SYSEX || command == MIDI_SYSEX_LITERAL) {
+		stream->running_status = 0;
+		event->type = MIDI_EVENT_SYSEX;
+		event->command = command;
+		stream->stage = STREAM_SYSEX_LENGTH;
+	} else {
+		return stream_error(stream, "Bad event status.");
+	}
+
+	return 0;
+}
+
+// init_midi_stream
+// Readies stream to parse a midi file from its first byte.  handler is
+// called with each event, and context passed along to it.
+void
+init_midi_stream(MidiStream *stream, MidiStreamHandler handler, void *context)
+{
+	memset(stream, 0, sizeof(MidiStream));
+	stream->stage = STREAM_HEADER;
+	stream->handler = handler;
+	stream->context = context;
+}
+
+// feed_midi_stream
+// Parses the next length bytes of the file.  Chunks may be of any size
+// and may split events anywhere.  Bytes after the last track are ignored.
+//
+// Returns:  Non-zero on error, after which the stream takes no more bytes.
+int
+feed_midi_stream(MidiStream *stream, const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+	uint32_t n, keep;
+	uint8_t byte;
+	int status;
+
+	while(data < end) {
+		switch(stream->stage) {
+		case STREAM_HEADER:
+		case STREAM_TRACK_HEADER:
+			// Chunk headers are collected whole before they are looked at.
+			n = stream->stage == STREAM_HEADER ? 14 : 8;
+			while(stream->have < n && data < end) stream->buffer[stream->have++] = *data++;
+			if(stream->have < n) break;
+			stream->have = 0;
+
+			if(stream->stage == STREAM_HEADER) {
+				if(memcmp(stream->buffer, "MThd", 4))
+					return stream_error(stream, "Not a midi file.");
+				if(get_be32(stream->buffer + 4) != 6)
+					return stream_error(stream, "Header is of incorrect size.");
+
+				stream->format = stream->buffer[8] << 8 | stream->buffer[9];
+				stream->num_tracks = stream->buffer[10] << 8 | stream->buffer[11];
+				stream->division = stream->buffer[12] << 8 | stream->buffer[13];
+				stream->track = 0;
+				PROBE1(read_start, stream->num_tracks);
+				start_track(stream);
+			} else if(memcmp(stream->buffer, "MTrk", 4)) {
+				// Chunks of unknown types are to be skipped.
+				stream->need = get_be32(stream->buffer + 4);
+				stream->stage = STREAM_SKIP_CHUNK;
+			} else {
+				stream->track_left = get_be32(stream->buffer + 4);
+				stream->track_events = 0;
+				PROBE1(track_start, stream->track_left);
+				if(stream->track_left == 0) {
+					finish_track(stream);
+				} else {
+					start_event(stream);
+				}
+			}
+			break;
+
+		case STREAM_SKIP_CHUNK:
+			n = (size_t)(end - data) < stream->need ? (uint32_t)(end - data) : stream->need;
+			data += n;
+			stream->need -= n;
+			if(stream->need == 0) start_track(stream);
+			break;
+
+		case STREAM_SYSEX_DATA:
+		case STREAM_META_DATA:
+			n = (size_t)(end - data) < stream->need ? (uint32_t)(end - data) : stream->need;
+			if(n > stream->track_left)
+				return stream_error(stream, "Track ends inside an event.");
+
+			// Only as much of a meta event as fits in text is kept.
+			if(stream->stage == STREAM_META_DATA && stream->have < MIDI_STREAM_TEXT) {
+				keep = MIDI_STREAM_TEXT - stream->have < n ? MIDI_STREAM_TEXT - stream->have : n;
+				memcpy(stream->text + stream->have, data, keep);
+				stream->have += keep;
+			}
+
+			data += n;
+			stream->need -= n;
+			stream->track_left -= n;
+			if(stream->need > 0) break;
+
+			if(stream->stage == STREAM_META_DATA) set_meta_event(stream);
+			if(finish_event(stream)) return 1;
+			break;
+
+		case STREAM_DONE:
+			return 0;
+
+		case STREAM_ERROR:
+			return 1;
+
+		default:
+			// Every other stage takes one byte of the track at a time.
+			if(stream->track_left == 0)
+				return stream_error(stream, "Track ends inside an event.");
+			byte = *data++;
+			stream->track_left--;
+
+			switch(stream->stage) {
+			case STREAM_DELTA:
+				status = read_quantity(stream, byte);
+				if(status < 0) return stream_error(stream, "Bad delta time.");
+				if(status == 0) break;
+
+				stream->event.delta_time = stream->quantity;
+				stream->stage = STREAM_STATUS;
+				break;
+
+			case STREAM_STATUS:
+				if(read_status(stream, byte)) return 1;
+				break;
+
+			case STREAM_CHANNEL_DATA:
+				// Data bytes only have 7 bits, whatever a bad file says.
+				stream->buffer[stream->have++] = byte & 0x7F;
+				if(stream->have < stream->need) break;
+
+				set_channel_event(stream);
+				if(finish_event(stream)) return 1;
+				break;
+
+			case STREAM_META_TYPE:
+				stream->event.meta_type = byte;
+				stream->quantity = 0;
+				stream->quantity_length = 0;
+				stream->stage = STREAM_META_LENGTH;
+				break;
+
+			case STREAM_META_LENGTH:
+			case STREAM_SYSEX_LENGTH:
+				status = read_quantity(stream, byte);
+				if(status < 0) return stream_error(stream, "Bad command length.");
+				if(status == 0) break;
+
+				stream->need = stream->quantity;
+				stream->have = 0;
+				memset(stream->text, 0, 4);
+				stream->stage = stream->stage == STREAM_META_LENGTH ? STREAM_META_DATA : STREAM_SYSEX_DATA;
+
+				if(stream->need == 0) {
+					if(stream->stage == STREAM_META_DATA) set_meta_event(stream);
+					if(finish_event(stream)) return 1;
+				}
+				break;
+			}
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// finish_midi_stream
+// Checks that the whole file has been fed to stream.
+//
+// Returns:  Non-zero if the file ended early.
+int
+finish_midi_stream(const MidiStream *stream)
+{
+	if(stream->stage == STREAM_ERROR) return 1;
+
+	if(stream->stage != STREAM_DONE) {
+		fprintf(stderr, "Midi ended before its last track.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+typedef struct {
+	Midi *midi;
+	MidiStream *stream;
+	uint32_t capacity;    // Room for events in the track being read.
+} MidiCollector;
+
+static int
+allocate_tracks(Midi *midi, const MidiStream *stream)
+{
+	midi->tracks = mem_calloc(midi->allocator, stream->num_tracks ? stream->num_tracks : 1, sizeof(MidiTrack *));
+	if(midi->tracks == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	midi->format = stream->format;
+	midi->division = stream->division;
+	midi->num_tracks = stream->num_tracks;
+
+	return 0;
+}
+
+// Keeps a copy of each event in the track it came from.
+static int
+collect_event(void *context, uint32_t track_index, const MidiEvent *event)
+{
+	MidiCollector *collector = context;
+	Midi *midi = collector->midi;
+	MidiTrack *track;
+	MidiEvent *copy;
+	MidiEvent **events;
+
+	if(midi->tracks == NULL && allocate_tracks(midi, collector->stream))
+		return 1;
+
+	track = midi->tracks[track_index];
+	if(track == NULL) {
+		track = mem_calloc(midi->allocator, 1, sizeof(MidiTrack));
+		if(track == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+		midi->tracks[track_index] = track;
+		collector->capacity = 0;
+	}
+
+	if(track->num_events == collector->capacity) {
+		collector->capacity = collector->capacity ? 2 * collector->capacity : 256;
+		events = mem_realloc(midi->allocator, track->events, collector->capacity * sizeof(MidiEvent *));
+		if(events == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+		track->events = events;
+	}
+
+	copy = mem_malloc(midi->allocator, sizeof(MidiEvent));
+	if(copy == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	*copy = *event;
+
+	if(event->data != NULL) {
+		copy->data = mem_malloc(midi->allocator, (size_t)event->data_length + 1);
+		if(copy->data == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			mem_free(midi->allocator, copy);
+			return 1;
+		}
+		memcpy(copy->data, event->data, (size_t)event->data_length + 1);
+	}
+
+	track->events[track->num_events++] = copy;
+	return 0;
+}
+
+static void
+start_collecting(Midi *midi, MidiStream *stream, MidiCollector *collector, Allocator *allocator)
+{
+	memset(midi, 0, sizeof(Midi));
+	midi->allocator = allocator;
+	collector->midi = midi;
+	collector->stream = stream;
+	collector->capacity = 0;
+	init_midi_stream(stream, collect_event, collector);
+}
+
+static int
+finish_collecting(Midi *midi, MidiStream *stream, int status)
+{
+	if(!status) status = finish_midi_stream(stream);
+	if(!status && midi->tracks == NULL) status = allocate_tracks(midi, stream);
+
+	if(status) {
+		destroy_midi(midi);
+		return 1;
+	}
+
+	memcpy(midi->patches, stream->patches, sizeof(midi->patches));
+	return index_midi(midi);
+}
+
+// read_midi_from_stream
+// Reads a midi file from a pipe, parsing each chunk as it arrives rather
+// than waiting for whole tracks.  Memory comes from allocator, as with
+// read_midi_from_file.
+//
+// Returns:  Non-zero on error.
+int
+read_midi_from_stream(Midi *midi, FILE *infile, Allocator *allocator)
+{
+	MidiStream stream;
+	MidiCollector collector;
+	uint8_t chunk[MIDI_STREAM_CHUNK];
+	size_t length;
+	int status = 0;
+
+	start_collecting(midi, &stream, &collector, allocator);
+	while(!status && (length = fread(chunk, 1, sizeof(chunk), infile)) > 0) {
+		status = feed_midi_stream(&stream, chunk, length);
+	}
+
+	return finish_collecting(midi, &stream, status);
+}
+
+// read_midi_from_memory
+// Reads a midi file that is already in memory.
+//
+// Returns:  Non-zero on error.
+int
+read_midi_from_memory(Midi *midi, const uint8_t *data, size_t size, Allocator *allocator)
+{
+	MidiStream stream;
+	MidiCollector collector;
+
+	start_collecting(midi, &stream, &collector, allocator);
+	return finish_collecting(midi, &stream, feed_midi_stream(&stream, data, size));
+}
@@ -0,0 +1,62 @@
+/*
+ * midistream.h
+ *
+ * Push parser for midi files that arrive a piece at a time, from a pipe
+ * or an upload.  Bytes are fed in chunks of any size and each event is
+ * handed on as soon as its last byte is in.
+ *
+ */
+
+#ifndef MIDISTREAM_H
+#define MIDISTREAM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "midi.h"
+
+// Longest text meta event kept.  Longer text is cut off.
+#define MIDI_STREAM_TEXT 255
+
+// Called with each event as it is completed.  The event and its data
+// are only good until the handler returns.
+//
+// Returns:  Non-zero to stop parsing.
+typedef int (*MidiStreamHandler)(void *context, uint32_t track, const MidiEvent *event);
+
+typedef struct {
+	int stage;
+	uint8_t buffer[14];          // Header or partial value being collected.
+	uint32_t have;               // Bytes of buffer filled so far.
+	uint32_t need;               // Bytes still to come for the current stage.
+	uint32_t quantity;           // Variable length quantity being read.
+	int quantity_length;
+
+	uint16_t format;             // Good once the header has been read.
+	uint16_t division;
+	uint32_t num_tracks;
+
+	uint32_t track;              // Track being read.
+	uint32_t track_left;         // Bytes of the track still to come.
+	uint32_t track_events;       // Events handed on from the track so far.
+	uint8_t running_status;
+
+	MidiEvent event;             // Event being read.
+	uint8_t text[MIDI_STREAM_TEXT + 1];
+
+	MidiPatch patches[128];
+	int chan_patch[16];
+
+	MidiStreamHandler handler;
+	void *context;
+} MidiStream;
+
+void init_midi_stream(MidiStream *, MidiStreamHandler, void *context);
+int feed_midi_stream(MidiStream *, const uint8_t *data, size_t length);
+int finish_midi_stream(const MidiStream *);
+
+int read_midi_from_stream(Midi *, FILE *, Allocator *);
+int read_midi_from_memory(Midi *, const uint8_t *data, size_t size, Allocator *);
+
+#endif /* MIDISTREAM_H */
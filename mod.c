@@ -9,292 +9,1159 @@
 #include <string.h>
 #include "midi.h"
 #include "mod.h"
+#include "allocator.h"
+#include "modtables.h"
+#include "notespan.h"
+#include "probes.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
-#ifdef _WIN32
-#include "winsock2.h"
-#else
-#include <arpa/inet.h>
-#endif
+// Size of a MOD up to its first pattern.
+#define MOD_HEADER_SIZE 1084
 
-int
-compare_absolute_midi_event(const void *a, const void *b)
+void
+init_midi_to_mod_options(MidiToModOptions *options)
 {
-	return ((const AbsoluteMidiEvent *)a)->time - ((const AbsoluteMidiEvent *)b)->time;
+	options->channels = MIDI_TO_MOD_DEFAULT_CHANNELS;
+	options->start_time = 0;
+	options->end_time = 0;
+	options->allocator = NULL;
+	options->num_channels = 8;
+	options->max_patterns = 128;
+	options->ticks_per_beat = 0;
+	options->speed = 0;
 }
 
-int
-midi_to_mod(Mod *mod, const Midi *midi)
+// first_event_at
+// Returns:  The index of list's first event from first on at or after
+//           time, or the number of events if there is none.
+static uint32_t
+first_event_at(const MidiEventList *list, uint32_t first, long int time)
 {
-	size_t i, j, k;
-	size_t current_time;
-	int current_pattern;
-	int current_channel;
-	size_t total_events;
-	ModCommand command;
+	uint32_t low = first, high = list->num_events, middle;
+
+	while(low < high) {
+		middle = low + (high - low) / 2;
+		if(list->events[middle].time < time) low = middle + 1;
+		else high = middle;
+	}
+
+	return low;
+}
+
+// merge_channel_events
+// Merges the time ordered events of the channels in mask, and all meta
+// and sysex events, into one time ordered array.  Only events from the
+// start state up to, but not including, end_time are taken; end_time
+// of 0 takes everything.  The first num_leading entries are left free.
+//
+// Returns:  The array, or NULL on error.
+static AbsoluteMidiEvent *
+merge_channel_events(const Midi *midi, uint16_t mask, const MidiCheckpoint *start, long int end_time,
+                     size_t num_leading, size_t *total_events, Allocator *allocator)
+{
+	const MidiEventList *lists[17];
+	uint32_t next[17];
+	uint32_t last[17];
 	AbsoluteMidiEvent *events;
-	MidiEvent *event;
-	short unsigned int ticks_per_beat = 64;
-	char* env_ticks_per_beat = getenv("TICKS_PER_BEAT");
-	if (env_ticks_per_beat != NULL) {
-		int custom_ticks_per_beat = atoi(env_ticks_per_beat);
-		if (custom_ticks_per_beat > 0) {
-			ticks_per_beat = custom_ticks_per_beat;
+	size_t num_lists, i, k, best;
+	const MidiEventList *list;
+
+	num_lists = 0;
+	*total_events = num_leading;
+	for(i=0; i < 17; i++) {
+		if(i < 16 && !(mask & (1 << i))) continue;
+
+		list = &midi->channel_events[i];
+		next[num_lists] = start->next[i];
+		last[num_lists] = end_time ? first_event_at(list, next[num_lists], end_time) : list->num_events;
+		if(next[num_lists] >= last[num_lists]) continue;
+
+		lists[num_lists] = list;
+		*total_events += last[num_lists] - next[num_lists];
+		num_lists++;
+	}
+
+	PROBE1(merge_start, *total_events);
+	events = mem_calloc(allocator, *total_events ? *total_events : 1, sizeof(AbsoluteMidiEvent));
+	if(events == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return NULL;
+	}
+
+	for(k = num_leading; k < *total_events; k++) {
+		best = num_lists;
+		for(i=0; i < num_lists; i++) {
+			if(next[i] == last[i]) continue;
+			if(best == num_lists ||
+			   compare_absolute_midi_event(&lists[i]->events[next[i]], &lists[best]->events[next[best]]) < 0)
+				best = i;
 		}
+
+		events[k] = lists[best]->events[next[best]++];
 	}
-	uint8_t tempo;
-	short int division;
-	char *channel_occupied; // For tracking whether or not a channel is free to play a note.
-	uint8_t midi_channel_sample[16]; // Current sample that each midi channel is using.
+	PROBE1(merge_done, *total_events);
 
-	// TODO: This should probably be done better.
-	// To hold notes that are currently on [midi channel][note number].
-	struct {
-		char on;
-		short unsigned int channel; // Mod channel that it is on
-	} current_note[16][128];
-	memset(current_note, 0, sizeof(current_note));
+	return events;
+}
 
-	mod->num_channels = 8;
+// state_events
+// Makes the events that bring a conversion starting part way through a
+// song up to the state it would have been in: the tempo, the time
+// signature, each channel's patch and the notes that are sounding.
+//
+// Returns:  Number of events written to out, which must have room for
+//           2 + 16 * 129 events.
+static size_t
+state_events(const MidiCheckpoint *state, uint16_t mask, MidiEvent *out)
+{
+	size_t n = 0;
+	int c, note;
 
-	total_events = 0;
-	for (i = 0; i < midi->num_tracks; i++) {
-		total_events += midi->tracks[i]->num_events;
+	if(state->tempo) {
+		memset(&out[n], 0, sizeof(MidiEvent));
+		out[n].type = MIDI_EVENT_META;
+		out[n].meta_type = MIDI_META_SETTEMPO;
+		out[n].tempo = state->tempo;
+		n++;
 	}
-	events = calloc(total_events, sizeof(AbsoluteMidiEvent));
 
-	if (events == NULL) {
-		fprintf(stderr, "Out of memory.\n");
-		return 1;
+	if(state->time_signature.numerator) {
+		memset(&out[n], 0, sizeof(MidiEvent));
+		out[n].type = MIDI_EVENT_META;
+		out[n].meta_type = MIDI_META_TIMESIGNATURE;
+		out[n].time_signature = state->time_signature;
+		n++;
 	}
 
-	memset(mod->patterns, 0, sizeof(mod->patterns));
+	for(c=0; c < 16; c++) {
+		if(!(mask & (1 << c))) continue;
 
-	k = 0;
-	for(i=0; i < midi->num_tracks; i++) {
-		current_time = 0;
+		if(state->patch[c] >= 0) {
+			memset(&out[n], 0, sizeof(MidiEvent));
+			out[n].type = MIDI_EVENT;
+			out[n].command = MIDI_PATCHCHANGE;
+			out[n].channel = c;
+			out[n].patch = state->patch[c];
+			n++;
+		}
+
+		for(note=0; note < 128; note++) {
+			if(!state->velocity[c][note]) continue;
 
-		for(j=0; j < midi->tracks[i]->num_events; j++) {
-			events[k].event = midi->tracks[i]->events[j];
-			current_time += midi->tracks[i]->events[j]->delta_time;
-			events[k++].time = current_time;
+			memset(&out[n], 0, sizeof(MidiEvent));
+			out[n].type = MIDI_EVENT;
+			out[n].command = MIDI_NOTEON;
+			out[n].channel = c;
+			out[n].note = note;
+			out[n].velocity = state->velocity[c][note];
+			n++;
 		}
 	}
 
-	qsort(events, total_events, sizeof(AbsoluteMidiEvent), compare_absolute_midi_event);
+	return n;
+}
 
-	memset(midi_channel_sample, 0, sizeof(midi_channel_sample));
+static void encode_mod_pattern(const ModPattern *pattern, int num_channels, uint8_t *out);
 
-	channel_occupied = calloc(mod->num_channels, sizeof(char));
+static void
+init_conversion_state(ModConversionState *state, const Mod *mod, const Midi *midi, const MidiToModOptions *options)
+{
+	char* env_ticks_per_beat = getenv("TICKS_PER_BEAT");
 
-	current_pattern = 0;
-	for(i=0; i < total_events; i++) {
-		event = events[i].event;
+	memset(state, 0, sizeof(ModConversionState));
+	memset(state->midi_channel_sample, mod->patch_sample[0], sizeof(state->midi_channel_sample));
 
-		//printf("%-10d ", events[i].time);
-		//print_midi_event(stdout, event);
-
-		current_pattern = 1.0*events[i].time / ticks_per_beat / 64;
-		division = ((1.0*events[i].time / ticks_per_beat) - (current_pattern*64));// * 4;
-
-		if(event->type == MIDI_EVENT) {
-			// event->delta_time, event->command, event->channel
-
-			if(event->command == MIDI_NOTEON) {
-				// skip percussion.  TAKE THIS OUT
-				if(event->channel == 10) continue;
-
-				//event->note, event->velocity
-				if(current_note[event->channel][event->note].on) {
-					current_channel = current_note[event->channel][event->note].channel;
-				} else {
-					current_channel = -1;
-					for(j=0; j < mod->num_channels; j++) {
-						command = mod->patterns[current_pattern].data[j][division];
-						if(!channel_occupied[j] && !command.sample && !command.effect) {
-							current_channel = j;
-							break;
-						}
-					}
-					if(current_channel < 0) continue;
-				}
-
-				current_note[event->channel][event->note].on = 1;
-				current_note[event->channel][event->note].channel = current_channel;
-				channel_occupied[current_channel] = 1;
-
-				if(event->note > 71) {
-					command.sample = 30;
-					command.period = PERIOD[event->note - 12];
-				} else {
-					command.sample = midi_channel_sample[event->channel];
-					command.period = PERIOD[event->note];
-				}
-				command.effect = EF_VOLUME;
-				command.effect_x = ((event->velocity * 100 / 256) & 0xF0) >> 4;
-				command.effect_y = (event->velocity * 100 / 256) & 0x0F;
-
-				//command.effect = 0;
-				//command.effect_x = 0;
-				//command.effect_y = 0;
-
-				mod->patterns[current_pattern].data[current_channel][division] = command;
-			} else if(event->command == MIDI_NOTEOFF) {
-				// skip percussion.  TAKE THIS OUT
-				if(event->channel == 10) continue;
-
-				current_channel = current_note[event->channel][event->note].channel;
-				current_note[event->channel][event->note].on = 0;
-				channel_occupied[current_channel] = 0;
-
-				command.sample = 0;
-				command.period = 0;
-				command.effect = EF_VOLUME;
-				command.effect_x = 0;
-				command.effect_y = 0;
-
-				mod->patterns[current_pattern].data[current_channel][division] = command;
-			} else if(event->command == MIDI_PATCHCHANGE) {
-				// TODO: the sample number needs to be mapped from
-				// event->patch.
-				//midi_channel_sample[event->channel] = event->patch;
-				midi_channel_sample[event->channel] = 1;
+	state->speed = options->speed;
+	state->midi_division = midi->division;
+
+	state->ticks_per_beat = 64;
+	if (options->ticks_per_beat) {
+		state->ticks_per_beat = options->ticks_per_beat;
+		state->fixed_ticks = 1;
+	} else if (env_ticks_per_beat != NULL) {
+		int custom_ticks_per_beat = atoi(env_ticks_per_beat);
+		if (custom_ticks_per_beat > 0) {
+			state->ticks_per_beat = custom_ticks_per_beat;
+		}
+	}
+}
+
+// mod_tempo
+// Works out the EF_TEMPO value for a midi tempo, in microseconds per
+// beat.  Without a speed, the midi's beats per minute are used as they
+// are.  With one, they are scaled so that divisions of ticks_per_beat
+// midi ticks each play for as long as they should at that speed.
+uint8_t
+mod_tempo(uint32_t tempo, int speed, uint16_t midi_division, uint16_t ticks_per_beat)
+{
+	double bpm;
+
+	if(!speed || !midi_division || (midi_division & 0x8000)) {
+		return (1.0f/tempo) * 60000000;
+	}
+
+	// A division lasts speed * 2.5 / bpm seconds.
+	bpm = 60000000.0 / tempo * speed * midi_division / (24.0 * ticks_per_beat);
+	if(bpm < 32) bpm = 32;
+	if(bpm > 255) bpm = 255;
+	return (uint8_t)(bpm + 0.5);
+}
+
+// start_song
+// Sets the speed, and the tempo for the midi's default of 120 beats per
+// minute, at the start of the first pattern when options ask for a speed.
+static void
+start_song(Mod *mod, const ModConversionState *state)
+{
+	ModCommand *command;
+	uint8_t tempo;
+
+	if(!state->speed) return;
+
+	command = &mod->patterns[0].data[0][0];
+	command->effect = EF_TEMPO;
+	command->effect_x = state->speed >> 4;
+	command->effect_y = state->speed & 0x0F;
+
+	if(mod->num_channels < 2) return;
+
+	tempo = mod_tempo(500000, state->speed, state->midi_division, state->ticks_per_beat);
+	command = &mod->patterns[0].data[1][0];
+	command->effect = EF_TEMPO;
+	command->effect_x = tempo >> 4;
+	command->effect_y = tempo & 0x0F;
+}
+
+// convert_event
+// Writes what one midi event plays into the pattern and division it
+// falls on, on the channel plan_conversion picked for it.  Notes are
+// stopped by write_stops, so note offs write nothing.
+static void
+convert_event(Mod *mod, ModConversionState *state, const MidiEvent *event, int current_pattern, short int division,
+              int voice)
+{
+	ModCommand command;
+	uint8_t tempo;
+	ModSample *sample;
+	const ModWaveNote *wave;
+	uint8_t volume;
+	int note;
+
+	if(event->type == MIDI_EVENT) {
+		// event->delta_time, event->command, event->channel
+
+		if(event->command == MIDI_NOTEON && event->velocity) {
+			//event->note, event->velocity
+			if(voice < 0) {
+				PROBE4(voice_full, event->channel, event->note, current_pattern, division);
+				return;
 			}
-		} else if (event->type == MIDI_EVENT_META) {
-			// event->delta_time, event->meta_type
-
-			// Text event.
-			if(
-				event->meta_type >= MIDI_META_TEXT &&
-				event->meta_type <= MIDI_META_CUEPOINT) {
-				// event->data
-			} else if(event->meta_type == MIDI_META_SETTEMPO) {
-				// event->tempo
-				tempo = (1.0f/event->tempo) * 60000000;
-				fprintf(stderr, "Output tempo %"PRIu8"\n", tempo);
-
-				current_channel = -1;
-				for(j=0; j < mod->num_channels; j++) {
-					command = mod->patterns[current_pattern].data[j][division];
-					if(!channel_occupied[j] && !command.sample && !command.effect) {
-						current_channel = j;
-						break;
-					}
-				}
-				if(current_channel < 0) continue;
-
-				command.sample = 0;
-				command.period = 0;
-				command.effect = EF_TEMPO;
-				command.effect_x = (tempo >> 4) & 0x0F;
-				command.effect_y = tempo & 0x0F;
-				
-				mod->patterns[current_pattern].data[current_channel][division] = command;
-				//printf("tempo: %d\n", tempo);
-			} else if(event->meta_type == MIDI_META_TIMESIGNATURE) {
-				ticks_per_beat = event->time_signature.ticks_per_click;
+
+			sample = mod->samples[state->midi_channel_sample[event->channel]];
+			if(sample) {
+				note = event->note + sample->transpose;
+				while(note < 0) note += 12;
+				while(note > 127) note -= 12;
+				command.sample = state->midi_channel_sample[event->channel];
+				command.period = MOD_NOTE_PERIOD[0][note];
 			} else {
-				fprintf(stderr, "%d/%d ", current_pattern, division);
-				print_midi_event(stderr, event);
+				wave = &MOD_WAVE_NOTE[event->note & 0x7F];
+				command.sample = wave->octave ? MOD_HIGH_WAVE_SAMPLE : state->midi_channel_sample[event->channel];
+				command.period = wave->period;
 			}
-		} else if (event->type == MIDI_EVENT_SYSEX) {
-			// event->delta_time, event->command
+			volume = MOD_VELOCITY_VOLUME[event->velocity & 0x7F];
+			command.effect = EF_VOLUME;
+			command.effect_x = volume >> 4;
+			command.effect_y = volume & 0x0F;
+
+			//command.effect = 0;
+			//command.effect_x = 0;
+			//command.effect_y = 0;
+
+			mod->patterns[current_pattern].data[voice][division] = command;
+		} else if(event->command == MIDI_PATCHCHANGE) {
+			if(mod->patch_sample[event->patch])
+				state->midi_channel_sample[event->channel] = mod->patch_sample[event->patch];
+			else
+				state->midi_channel_sample[event->channel] = MOD_DEFAULT_SAMPLE;
+		}
+	} else if (event->type == MIDI_EVENT_META) {
+		// event->delta_time, event->meta_type
+
+		// Text event.
+		if(
+			event->meta_type >= MIDI_META_TEXT &&
+			event->meta_type <= MIDI_META_CUEPOINT) {
+			// event->data
+		} else if(event->meta_type == MIDI_META_SETTEMPO) {
+			// event->tempo
+			tempo = mod_tempo(event->tempo, state->speed, state->midi_division, state->ticks_per_beat);
+			fprintf(stderr, "Output tempo %"PRIu8"\n", tempo);
+
+			if(voice < 0) {
+				PROBE2(tempo_full, current_pattern, division);
+				return;
+			}
+
+			command.sample = 0;
+			command.period = 0;
+			command.effect = EF_TEMPO;
+			command.effect_x = (tempo >> 4) & 0x0F;
+			command.effect_y = tempo & 0x0F;
+
+			mod->patterns[current_pattern].data[voice][division] = command;
+			//printf("tempo: %d\n", tempo);
+		} else if(event->meta_type == MIDI_META_TIMESIGNATURE) {
+			if(event->time_signature.ticks_per_click && !state->fixed_ticks)
+				state->ticks_per_beat = event->time_signature.ticks_per_click;
 		} else {
-			//fprintf(stderr, "Unknown MIDI event:\t%d,\t%d,\t%x\n", event->delta_time, event->type, event->command);
 			fprintf(stderr, "%d/%d ", current_pattern, division);
 			print_midi_event(stderr, event);
 		}
+	} else if (event->type == MIDI_EVENT_SYSEX) {
+		// event->delta_time, event->command
+	} else {
+		//fprintf(stderr, "Unknown MIDI event:\t%d,\t%d,\t%x\n", event->delta_time, event->type, event->command);
+		fprintf(stderr, "%d/%d ", current_pattern, division);
+		print_midi_event(stderr, event);
+	}
+}
+
+// midi_to_mod_events
+// Collects the events that options selects, in time order, including
+// the ones that set up the state at the start time.  *leading must be
+// freed along with *events, from options->allocator.
+//
+// Returns:  Non-zero on error.
+int
+midi_to_mod_events(const Midi *midi, const MidiToModOptions *options, AbsoluteMidiEvent **events,
+                   MidiEvent **leading, size_t *total_events)
+{
+	MidiCheckpoint start;
+	size_t i, num_leading;
+
+	if(seek_midi(midi, options->start_time, &start)) {
+		return 1;
+	}
+
+	*leading = mem_calloc(options->allocator, 2 + 16 * 129, sizeof(MidiEvent));
+	if(*leading == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	num_leading = options->start_time > 0 ? state_events(&start, options->channels, *leading) : 0;
+
+	*events = merge_channel_events(midi, options->channels, &start, options->end_time, num_leading, total_events,
+	                               options->allocator);
+	if (*events == NULL) {
+		mem_free(options->allocator, *leading);
+		return 1;
+	}
+
+	for(i=0; i < num_leading; i++) {
+		(*events)[i].time = options->start_time;
+		(*events)[i].event = &(*leading)[i];
+	}
+
+	return 0;
+}
+
+// alloc_patterns
+// Gives mod count empty patterns from allocator.  With keep set, the
+// patterns mod already has are kept if they are the same.
+//
+// Returns:  Non-zero on error.
+static int
+alloc_patterns(Mod *mod, int count, Allocator *allocator, int keep)
+{
+	if(keep && mod->patterns != NULL && mod->max_patterns == count && mod->allocator == allocator) {
+		return 0;
+	}
+
+	mem_free(mod->allocator, mod->patterns);
+	mod->allocator = allocator;
+	mod->max_patterns = count;
+	mod->patterns = mem_calloc(allocator, count, sizeof(ModPattern));
+	if(mod->patterns == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		mod->max_patterns = 0;
+		return 1;
 	}
 
-	mod->num_patterns = current_pattern + 1;
+	return 0;
+}
+
+static void
+set_pattern_table(Mod *mod, int last_pattern)
+{
+	size_t i;
+
+	mod->num_patterns = last_pattern + 1;
+	mod->song_length = mod->num_patterns;
 	memset(mod->pattern_table, 0, sizeof(mod->pattern_table));
 	for(i=0; i < mod->num_patterns; i++) mod->pattern_table[i] = i;
+}
 
-	free(events);
-	free(channel_occupied);
+// Where each event goes, worked out before any are converted.
+typedef struct {
+	long int *rows;              // Division each event falls on, counting from the start.
+	int8_t *voices;              // Channel of each note on and tempo, -1 if there is none.
+	NoteSpan *spans;
+	size_t num_spans;
+	size_t num_events;           // Events that fall in the patterns there is room for.
+} ModPlan;
+
+// plan_conversion
+// Works out the division each event falls on, pairs up the notes that
+// start and end, and gives each note and tempo a mod channel.  Knowing
+// when every note ends, the channels can be shared out so that as few
+// notes as possible are dropped.  plan->spans must be freed, from
+// allocator.
+//
+// Returns:  Non-zero on error.
+static int
+plan_conversion(ModPlan *plan, const ModConversionState *state, const AbsoluteMidiEvent *events, size_t total_events,
+                long int start_time, int num_channels, int max_patterns, Allocator *allocator)
+{
+	const MidiEvent *event;
+	uint16_t ticks_per_beat = state->ticks_per_beat;
+	size_t i, n = total_events ? total_events : 1;
+	int reserved = 0;
+
+	plan->spans = mem_malloc(allocator, n * (sizeof(NoteSpan) + sizeof(long int) + sizeof(int8_t)));
+	if(plan->spans == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	plan->rows = (long int *)(plan->spans + n);
+	plan->voices = (int8_t *)(plan->rows + n);
+
+	for(i=0; i < total_events; i++) {
+		plan->rows[i] = (events[i].time - start_time) / ticks_per_beat;
+
+		// Stop at the last pattern there is room for.
+		if(plan->rows[i] / 64 >= max_patterns) break;
+
+		event = events[i].event;
+		if(event->type == MIDI_EVENT_META && event->meta_type == MIDI_META_TIMESIGNATURE &&
+		   event->time_signature.ticks_per_click && !state->fixed_ticks)
+			ticks_per_beat = event->time_signature.ticks_per_click;
+	}
+	plan->num_events = i;
+
+	// start_song takes the first division of the first two channels.
+	if(state->speed) reserved = num_channels < 2 ? num_channels : 2;
+
+	plan->num_spans = pair_note_spans(events, plan->num_events, plan->spans);
+	allocate_voices(plan->spans, plan->num_spans, events, plan->rows, plan->num_events, num_channels, reserved,
+	                plan->voices);
 
 	return 0;
 }
 
-int
-write_mod_file(Mod *mod, FILE *outfile)
+// write_stops
+// Silences the notes that the next note on their channel does not cut
+// off, in the patterns up to last that dirty marks, or all of them if
+// dirty is NULL.  Nothing already written is written over.
+static void
+write_stops(Mod *mod, const ModPlan *plan, int last, const uint8_t *dirty)
 {
-	int i, d, c;
-	char a[22];
-	char b;
+	const NoteSpan *span;
 	ModCommand *command;
-	uint32_t data;
-	uint16_t z = 0;
+	size_t i;
+	int p;
+
+	for(i=0; i < plan->num_spans; i++) {
+		span = &plan->spans[i];
+		if(span->channel < 0 || span->stop < 0) continue;
+
+		p = span->stop / 64;
+		if(p > last || (dirty && !dirty[p])) continue;
+
+		command = &mod->patterns[p].data[span->channel][span->stop % 64];
+		if(command->sample || command->period || command->effect) continue;
+
+		command->effect = EF_VOLUME;
+		command->effect_x = 0;
+		command->effect_y = 0;
+	}
+}
+
+// midi_to_mod
+// Converts midi into mod.  options may be NULL for the defaults.
+//
+// Converting part of a song starts from the nearest checkpoint of the
+// midi's seek index, so it only costs as much as the part converted.
+int
+midi_to_mod(Mod *mod, const Midi *midi, const MidiToModOptions *options)
+{
+	MidiToModOptions default_options;
+	size_t i;
+	int current_pattern;
+	int last_pattern = 0;
+	size_t total_events;
+	AbsoluteMidiEvent *events;
+	MidiEvent *leading;
+	ModConversionState state;
+	ModPlan plan;
+
+	if(options == NULL) {
+		init_midi_to_mod_options(&default_options);
+		options = &default_options;
+	}
+
+	if(options->num_channels < 1 || options->num_channels > MOD_MAX_CHANNELS ||
+	   options->max_patterns < 1 || options->max_patterns > MOD_MAX_PATTERNS) {
+		fprintf(stderr, "Can not convert to %d channels and %d patterns.\n", options->num_channels, options->max_patterns);
+		return 1;
+	}
+	mod->num_channels = options->num_channels;
+
+	if(alloc_patterns(mod, options->max_patterns, options->allocator, 0)) {
+		return 1;
+	}
+
+	if(midi_to_mod_events(midi, options, &events, &leading, &total_events)) {
+		return 1;
+	}
+
+	init_conversion_state(&state, mod, midi, options);
+	if(plan_conversion(&plan, &state, events, total_events, options->start_time, mod->num_channels,
+	                   options->max_patterns, options->allocator)) {
+		mem_free(options->allocator, events);
+		mem_free(options->allocator, leading);
+		return 1;
+	}
+	start_song(mod, &state);
+
+	current_pattern = 0;
+	for(i=0; i < plan.num_events; i++) {
+		//printf("%-10d ", events[i].time);
+		//print_midi_event(stdout, events[i].event);
+
+		current_pattern = plan.rows[i] / 64;
+		if(current_pattern != last_pattern) {
+			PROBE2(pattern_done, last_pattern, i);
+			last_pattern = current_pattern;
+		}
+
+		convert_event(mod, &state, events[i].event, current_pattern, plan.rows[i] % 64, plan.voices[i]);
+	}
+	// Stopped at the last pattern there is room for.
+	if(plan.num_events < total_events) current_pattern = options->max_patterns - 1;
+
+	write_stops(mod, &plan, current_pattern, NULL);
+
+	PROBE2(pattern_done, current_pattern, i);
+	set_pattern_table(mod, current_pattern);
+
+	mem_free(options->allocator, plan.spans);
+	mem_free(options->allocator, events);
+	mem_free(options->allocator, leading);
+
+	return 0;
+}
+
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	// FNV-1a
+	for(i=0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+// hash_event
+// Hashes everything about an event that midi_to_mod looks at.
+static uint64_t
+hash_event(uint64_t hash, const MidiEvent *event, long int time)
+{
+	hash = hash_bytes(hash, &time, sizeof(time));
+	hash = hash_bytes(hash, &event->type, sizeof(event->type));
+	hash = hash_bytes(hash, &event->command, sizeof(event->command));
+	hash = hash_bytes(hash, &event->channel, sizeof(event->channel));
+	hash = hash_bytes(hash, &event->meta_type, sizeof(event->meta_type));
+	hash = hash_bytes(hash, &event->note, sizeof(event->note));
+	hash = hash_bytes(hash, &event->velocity, sizeof(event->velocity));
+	hash = hash_bytes(hash, &event->patch, sizeof(event->patch));
+	hash = hash_bytes(hash, &event->tempo, sizeof(event->tempo));
+	hash = hash_bytes(hash, &event->time_signature.ticks_per_click, sizeof(event->time_signature.ticks_per_click));
+
+	return hash;
+}
+
+// hash_settings
+// Hashes what, besides the events, changes the whole mod.
+static uint64_t
+hash_settings(const Mod *mod, const MidiToModOptions *options)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	const ModSample *sample;
+	int i;
+
+	hash = hash_bytes(hash, &options->channels, sizeof(options->channels));
+	hash = hash_bytes(hash, &options->start_time, sizeof(options->start_time));
+	hash = hash_bytes(hash, &options->end_time, sizeof(options->end_time));
+	hash = hash_bytes(hash, mod->patch_sample, sizeof(mod->patch_sample));
+	hash = hash_bytes(hash, &options->ticks_per_beat, sizeof(options->ticks_per_beat));
+	hash = hash_bytes(hash, &options->speed, sizeof(options->speed));
+	hash = hash_bytes(hash, &options->num_channels, sizeof(options->num_channels));
+	hash = hash_bytes(hash, &options->max_patterns, sizeof(options->max_patterns));
+
+	for(i=1; i < 32; i++) {
+		sample = mod->samples[i];
+		if(sample == NULL) continue;
+
+		hash = hash_bytes(hash, &i, sizeof(i));
+		hash = hash_bytes(hash, sample->name, sizeof(sample->name));
+		hash = hash_bytes(hash, &sample->length, sizeof(sample->length));
+		hash = hash_bytes(hash, &sample->fine_tune, sizeof(sample->fine_tune));
+		hash = hash_bytes(hash, &sample->volume, sizeof(sample->volume));
+		hash = hash_bytes(hash, &sample->repeat_offset, sizeof(sample->repeat_offset));
+		hash = hash_bytes(hash, &sample->repeat_length, sizeof(sample->repeat_length));
+		hash = hash_bytes(hash, &sample->transpose, sizeof(sample->transpose));
+		hash = hash_bytes(hash, &sample->data, sizeof(sample->data));
+	}
+
+	return hash;
+}
+
+void
+init_mod_incremental(ModIncremental *incremental)
+{
+	memset(incremental, 0, sizeof(ModIncremental));
+}
+
+void
+destroy_mod_incremental(ModIncremental *incremental)
+{
+	mem_free(incremental->allocator, incremental->records);
+	mem_free(incremental->allocator, incremental->file);
+	init_mod_incremental(incremental);
+}
+
+// midi_to_mod_incremental
+// Converts midi into mod like midi_to_mod, reusing the work of the last
+// call made with the same mod and incremental.
+//
+// A pattern's content depends only on the events that fall in it and
+// on the conversion state going into it.  Both are compared with what
+// the last call recorded, and only the patterns where either changed
+// are converted again.  incremental->file holds the encoded mod, and
+// when the number of patterns stays the same only the changed patterns
+// are encoded into it again.
+//
+// Returns:  Non-zero on error.
+int
+midi_to_mod_incremental(Mod *mod, const Midi *midi, const MidiToModOptions *options, ModIncremental *incremental)
+{
+	MidiToModOptions default_options;
+	AbsoluteMidiEvent *events;
+	MidiEvent *leading;
+	ModConversionState state;
+	size_t total_events, i;
+	size_t first[129];
+	uint64_t hashes[128];
+	uint8_t dirty[128];
+	uint64_t settings;
+	ModPlan plan;
+	const NoteSpan *span;
+	long int time;
+	int pattern, num_patterns, p;
+	int last = 0;
+	int in_order = 1;
+	int reuse;
+
+	if(options == NULL) {
+		init_midi_to_mod_options(&default_options);
+		options = &default_options;
+	}
+
+	// The result is encoded as a mod, which holds at most 8 channels and
+	// 128 patterns.
+	if(options->num_channels < 1 || options->num_channels > 8 ||
+	   options->max_patterns < 1 || options->max_patterns > 128) {
+		fprintf(stderr, "A mod holds at most 8 channels and 128 patterns.\n");
+		return 1;
+	}
+	mod->num_channels = options->num_channels;
+
+	if(incremental->records == NULL) {
+		incremental->allocator = options->allocator;
+		incremental->records = mem_calloc(incremental->allocator, 129, sizeof(ModPatternRecord));
+		if(incremental->records == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+		incremental->valid = 0;
+	}
+
+	settings = hash_settings(mod, options);
+	reuse = incremental->valid && incremental->settings == settings &&
+	        mod->patterns != NULL && mod->max_patterns == options->max_patterns && mod->allocator == options->allocator;
+
+	if(alloc_patterns(mod, options->max_patterns, options->allocator, reuse)) {
+		return 1;
+	}
+
+	if(midi_to_mod_events(midi, options, &events, &leading, &total_events)) {
+		return 1;
+	}
+
+	// Work out where every event falls and hash each pattern's events.
+	// Only time signatures move the pattern boundaries, and the channels
+	// are all picked up front, so the rest of the conversion state is
+	// not needed for this.
+	init_conversion_state(&state, mod, midi, options);
+	if(plan_conversion(&plan, &state, events, total_events, options->start_time, mod->num_channels, options->max_patterns,
+	                   options->allocator)) {
+		mem_free(options->allocator, events);
+		mem_free(options->allocator, leading);
+		return 1;
+	}
+	for(p=0; p < 128; p++) hashes[p] = 0xCBF29CE484222325ULL;
+	memset(first, 0, sizeof(first));
+
+	pattern = 0;
+	for(i=0; i < plan.num_events; i++) {
+		time = events[i].time - options->start_time;
+		p = plan.rows[i] / 64;
+
+		if(p < pattern) in_order = 0;
+		for(; pattern < p; pattern++) first[pattern + 1] = i;
+		last = p;
+
+		hashes[p] = hash_event(hashes[p], events[i].event, time);
+		hashes[p] = hash_bytes(hashes[p], &plan.voices[i], sizeof(plan.voices[i]));
+	}
+	// Stopped at the last pattern there is room for.
+	if(plan.num_events < total_events) {
+		for(; pattern < options->max_patterns - 1; pattern++) first[pattern + 1] = i;
+		last = options->max_patterns - 1;
+	}
+	total_events = plan.num_events;
+	num_patterns = last + 1;
+	first[num_patterns] = total_events;
+
+	// A note's stop belongs to the pattern it falls in.
+	for(i=0; i < plan.num_spans; i++) {
+		span = &plan.spans[i];
+		if(span->channel < 0 || span->stop < 0 || span->stop / 64 >= num_patterns) continue;
+
+		p = span->stop / 64;
+		hashes[p] = hash_bytes(hashes[p], &span->stop, sizeof(span->stop));
+		hashes[p] = hash_bytes(hashes[p], &span->channel, sizeof(span->channel));
+	}
+
+	// A time signature that moves later events back into an earlier
+	// pattern breaks the pattern ranges, so convert everything as the
+	// first pattern's events then.
+	if(!in_order) {
+		reuse = 0;
+		memset(mod->patterns, 0, options->max_patterns * sizeof(ModPattern));
+		first[0] = 0;
+		for(p=1; p <= num_patterns; p++) first[p] = total_events;
+	}
+
+	memset(dirty, 0, sizeof(dirty));
+	incremental->patterns_converted = 0;
+	for(p=0; p < num_patterns; p++) {
+		if(reuse && p < incremental->num_patterns &&
+		   incremental->records[p].hash == hashes[p] &&
+		   !memcmp(&incremental->records[p].state, &state, sizeof(ModConversionState))) {
+			state = incremental->records[p+1].state;
+			continue;
+		}
+
+		incremental->records[p].hash = hashes[p];
+		incremental->records[p].state = state;
+		memset(&mod->patterns[p], 0, sizeof(ModPattern));
+		if(p == 0) start_song(mod, &state);
+		dirty[p] = 1;
+		incremental->patterns_converted++;
+
+		for(i = first[p]; i < first[p+1]; i++) {
+			convert_event(mod, &state, events[i].event, plan.rows[i] / 64, plan.rows[i] % 64, plan.voices[i]);
+		}
+	}
+	incremental->records[num_patterns].state = state;
+	write_stops(mod, &plan, num_patterns - 1, in_order ? dirty : NULL);
+
+	// Patterns past the end are left empty, as midi_to_mod leaves them.
+	for(p = num_patterns; p < options->max_patterns; p++) {
+		if(!reuse || p < incremental->num_patterns) memset(&mod->patterns[p], 0, sizeof(ModPattern));
+	}
+
+	set_pattern_table(mod, num_patterns - 1);
+
+	mem_free(options->allocator, events);
+	mem_free(options->allocator, leading);
+	mem_free(options->allocator, plan.spans);
+
+	if(reuse && in_order && incremental->file && num_patterns == incremental->num_patterns) {
+		for(p=0; p < num_patterns; p++) {
+			if(dirty[p]) encode_mod_pattern(&mod->patterns[p], mod->num_channels, incremental->file + mod_pattern_offset(mod, p));
+		}
+	} else {
+		mem_free(incremental->allocator, incremental->file);
+		incremental->file = NULL;
+		if(encode_mod_file(mod, incremental->allocator, &incremental->file, &incremental->file_size)) {
+			incremental->valid = 0;
+			return 1;
+		}
+	}
+
+	incremental->num_patterns = num_patterns;
+	incremental->settings = settings;
+	incremental->valid = in_order;
+
+	return 0;
+}
+
+// encode_mod_pattern
+// Packs one pattern into its on-disk form.
+//
+// Each cell is written as four big-endian bytes:
+//   ssss pppp  pppp pppp  ssss eeee  xxxx yyyy
+// so no byte swapping is needed afterwards.
+//
+// Takes:  pattern      - Pattern to encode.
+//         num_channels - Number of channels stored per division.
+//         out          - Buffer of at least 64 * num_channels * 4 bytes.
+static void
+encode_mod_pattern(const ModPattern *pattern, int num_channels, uint8_t *out)
+{
+	int d, c;
+	const ModCommand *command;
+
+	for(d=0; d<64; d++) {
+		for(c=0; c < num_channels; c++) {
+			command = &(pattern->data[c][d]);
+			out[0] = (command->sample & 0xF0) | ((command->period >> 8) & 0x0F);
+			out[1] = command->period & 0xFF;
+			out[2] = ((command->sample & 0x0F) << 4) | (command->effect & 0x0F);
+			out[3] = ((command->effect_x & 0x0F) << 4) | (command->effect_y & 0x0F);
+			out += 4;
+		}
+	}
+}
+
+static uint8_t *
+put_be16(uint8_t *out, uint16_t v)
+{
+	out[0] = v >> 8;
+	out[1] = v & 0xFF;
+	return out + 2;
+}
+
+// mod_pattern_offset
+// Returns:  Where pattern starts in the file encode_mod_file makes.
+size_t
+mod_pattern_offset(const Mod *mod, int pattern)
+{
+	return MOD_HEADER_SIZE + (size_t)pattern * 64 * mod->num_channels * 4;
+}
+
+// make_default_wave
+// Builds the wave that a sample mod->samples has none for is written
+// with: the low wave for samples 1 to 8, and the high wave, an octave
+// up, for the others.
+//
+// Takes:  wave - Room for MOD_WAVE_LENGTH bytes.
+void
+make_default_wave(int8_t *wave, int high)
+{
+	int d;
+
+	wave[0] = wave[1] = 0;
+	for(d=2; d<MOD_WAVE_LENGTH; d++) {
+		if(high) wave[d] = 128 * sin((1.0 * d / MOD_WAVE_LENGTH) * 2 * M_PI * 2048);
+		else     wave[d] = 128 * sin((1.0f * d / MOD_WAVE_LENGTH) * 2 * M_PI * 1024);
+	}
+}
+
+// encode_mod_file
+// Builds the whole MOD file in memory.  *data must be freed.
+//
+// Returns:  Non-zero on error.
+int
+encode_mod_file(Mod *mod, Allocator *allocator, uint8_t **data, size_t *size)
+{
+	int i;
+	uint8_t *out;
+	size_t pattern_size;
+	size_t sample_size;
+	size_t name_length;
+	int8_t low_wave[MOD_WAVE_LENGTH];
+	int8_t high_wave[MOD_WAVE_LENGTH];
+	ModSample *sample;
+
+	if(mod->num_channels > 8 || mod->num_patterns > 128) {
+		fprintf(stderr, "A mod holds at most 8 channels and 128 patterns.\n");
+		return 1;
+	}
+
+	pattern_size = (size_t)64 * mod->num_channels * 4;
+	sample_size = 0;
+	for(i=0; i<31; i++) {
+		sample = mod->samples[i+1];
+		sample_size += sample ? sample->length * 2 : MOD_WAVE_LENGTH;
+	}
+
+	PROBE1(encode_start, mod->num_patterns);
+	*size = mod_pattern_offset(mod, mod->num_patterns) + sample_size;
+	*data = mem_calloc(allocator, *size, sizeof(uint8_t));
+	if(*data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	out = *data;
 
 	// Title
-	fwrite("Test\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", sizeof(char), 20, outfile);
+	memcpy(out, "Test", 4);
+	out += 20;
 
-	memset(a, 0, sizeof(a));
-	strcpy(a, "Sample ");
 	for(i=0; i<31; i++) {
-		a[7] = i+'a';
-		fwrite(a, sizeof(a), 1, outfile);
-		uint16_t length = 8287;
-		length = htons(length);
-		fwrite(&length, sizeof(uint16_t), 1, outfile);
-		fwrite(&z, sizeof(uint8_t), 1, outfile);
-		uint8_t v = 64;
-		fwrite(&v, sizeof(uint8_t), 1, outfile);
-		fwrite(&z, sizeof(uint16_t), 1, outfile);
-		fwrite(&length, sizeof(uint16_t), 1, outfile);
-	}
-
-	fwrite(&mod->num_patterns, sizeof(uint8_t), 1, outfile);
-	b = 127;
-	fwrite(&b, sizeof(uint8_t), 1, outfile);
-
-	fwrite(mod->pattern_table, sizeof(uint8_t), 128, outfile);
-	//fwrite("M.K.", sizeof(char), 4, outfile);
-	fwrite("8CHN", sizeof(char), 4, outfile);
+		sample = mod->samples[i+1];
+		if(sample) {
+			// The name fills its 22 bytes, without a terminating 0.
+			name_length = strlen(sample->name);
+			memcpy(out, sample->name, name_length < 22 ? name_length : 22);
+			out += 22;
+			out = put_be16(out, sample->length);
+			*(out++) = sample->fine_tune & 0x0F;
+			*(out++) = sample->volume;
+			out = put_be16(out, sample->repeat_offset);
+			out = put_be16(out, sample->repeat_length);
+			continue;
+		}
+
+		memcpy(out, "Sample ", 7);
+		out[7] = i+'a';
+		out += 22;
+		out = put_be16(out, MOD_WAVE_LENGTH / 2);
+		*(out++) = 0;
+		*(out++) = 64;
+		out = put_be16(out, 0);
+		out = put_be16(out, MOD_WAVE_LENGTH / 2);
+	}
+
+	*(out++) = mod->num_patterns;
+	*(out++) = 127;
+
+	memcpy(out, mod->pattern_table, 128);
+	out += 128;
+	if(mod->num_channels == 4) {
+		memcpy(out, "M.K.", 4);
+	} else {
+		out[0] = '0' + mod->num_channels;
+		memcpy(out + 1, "CHN", 3);
+	}
+	out += 4;
 
 	for(i=0; i < mod->num_patterns; i++) {
-	//for(i=0; i < 64; i++) {
-		for(d=0; d<64; d++) {
-			for(c=0; c < mod->num_channels; c++) {
-				command = &(mod->patterns[i].data[c][d]);
-				data =
-					((command->sample & 0xf0) << 24) |
-					((command->period & 0x0FFF) << 16) |
-					((command->sample & 0x0f) << 12) |
-					((command->effect & 0x0f) << 8) |
-					((command->effect_x & 0x0f) << 4) |
-					(command->effect_y & 0x0f);
-
-				data = htonl(data);
-				fwrite(&data, sizeof(uint32_t), 1, outfile);
-			}
-		}
+		encode_mod_pattern(&mod->patterns[i], mod->num_channels, out);
+		out += pattern_size;
 	}
 
 	// Samples
-	for(i=0; i<8; i++) {
-		int8_t v = 0;
-		fwrite(&v, sizeof(uint8_t), 1, outfile);
-		fwrite(&v, sizeof(uint8_t), 1, outfile);
-		for(d=2; d<16574; d++) {
-			v = 128 * sin((1.0f * d / 16574) * 2 * M_PI * 1024);
-			//printf("%d\n", v);
-			fwrite(&v, sizeof(uint8_t), 1, outfile);
+	// Only two different waves are used, so build each one once.
+	make_default_wave(low_wave, 0);
+	make_default_wave(high_wave, 1);
+
+	for(i=0; i<31; i++) {
+		sample = mod->samples[i+1];
+		if(sample) {
+			memcpy(out, sample->data, sample->length * 2);
+			out += sample->length * 2;
+		} else {
+			memcpy(out, i < 8 ? low_wave : high_wave, MOD_WAVE_LENGTH);
+			out += MOD_WAVE_LENGTH;
+		}
+	}
+	PROBE1(encode_done, *size);
+
+	return 0;
+}
+
+int
+write_mod_file(Mod *mod, FILE *outfile)
+{
+	uint8_t *data;
+	size_t size;
+
+	if(encode_mod_file(mod, NULL, &data, &size)) {
+		return 1;
+	}
+
+	if(fwrite(data, sizeof(uint8_t), size, outfile) != size) {
+		fprintf(stderr, "Unable to write mod file.\n");
+		mem_free(NULL, data);
+		return 1;
+	}
+	PROBE1(write_done, size);
+
+	mem_free(NULL, data);
+	return 0;
+}
+
+// decode_mod_pattern
+// Unpacks one pattern written by encode_mod_pattern.
+static void
+decode_mod_pattern(ModPattern *pattern, int num_channels, const uint8_t *in)
+{
+	int d, c;
+	ModCommand *command;
+
+	for(d=0; d<64; d++) {
+		for(c=0; c < num_channels; c++) {
+			command = &(pattern->data[c][d]);
+			command->sample = (in[0] & 0xF0) | (in[2] >> 4);
+			command->period = (in[0] & 0x0F) << 8 | in[1];
+			command->effect = in[2] & 0x0F;
+			command->effect_x = in[3] >> 4;
+			command->effect_y = in[3] & 0x0F;
+			in += 4;
 		}
 	}
-	for(i = 8; i < 31; i++) {
-		int8_t v = 0;
-		fwrite(&v, sizeof(uint8_t), 1, outfile);
-		fwrite(&v, sizeof(uint8_t), 1, outfile);
-		for (d = 2; d < 16574; d++) {
-			v = 128 * sin((1.0 * d / 16574) * 2 * M_PI * 2048);
-			//printf("%d\n", v);
-			fwrite(&v, sizeof(uint8_t), 1, outfile);
+}
+
+// read_mod_file
+// Reads a 31 sample MOD of up to 8 channels.  The sample data is owned
+// by mod and freed by destroy_mod.
+int
+read_mod_file(Mod *mod, FILE *infile)
+{
+	uint8_t header[1084];
+	const uint8_t *h;
+	uint8_t *pattern_data;
+	size_t pattern_size;
+	size_t sample_bytes;
+	ModSample *sample;
+	int8_t *data;
+	int i;
+
+	memset(mod, 0, sizeof(Mod));
+
+	if(!fread(header, sizeof(header), 1, infile)) {
+		fprintf(stderr, "Unable to read mod header.\n");
+		return 1;
+	}
+
+	h = header + 1080;
+	if(!memcmp(h, "M.K.", 4) || !memcmp(h, "M!K!", 4) || !memcmp(h, "FLT4", 4) || !memcmp(h, "4CHN", 4))
+		mod->num_channels = 4;
+	else if(!memcmp(h, "FLT8", 4) || !memcmp(h, "OKTA", 4) || !memcmp(h, "CD81", 4))
+		mod->num_channels = 8;
+	else if(h[0] >= '1' && h[0] <= '9' && !memcmp(h + 1, "CHN", 3))
+		mod->num_channels = h[0] - '0';
+	else if(h[0] >= '1' && h[0] <= '9' && h[1] >= '0' && h[1] <= '9' && !memcmp(h + 2, "CH", 2))
+		mod->num_channels = (h[0] - '0') * 10 + h[1] - '0';
+
+	if(mod->num_channels == 0 || mod->num_channels > MOD_MAX_CHANNELS) {
+		fprintf(stderr, "Not a supported mod file.\n");
+		return 1;
+	}
+
+	memcpy(mod->title, header, sizeof(mod->title));
+
+	sample_bytes = 0;
+	for(i=0; i<31; i++) {
+		h = header + 20 + i * 30;
+		sample = calloc(1, sizeof(ModSample));
+		if(sample == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			destroy_mod(mod);
+			return 1;
+		}
+
+		memcpy(sample->name, h, 22);
+		sample->length = h[22] << 8 | h[23];
+		sample->fine_tune = (int8_t)(h[24] << 4) >> 4;
+		sample->volume = h[25] > 64 ? 64 : h[25];
+		sample->repeat_offset = h[26] << 8 | h[27];
+		sample->repeat_length = h[28] << 8 | h[29];
+
+		mod->samples[i+1] = sample;
+		sample_bytes += sample->length * 2;
+	}
+
+	mod->song_length = header[950] > 128 ? 128 : header[950];
+	memcpy(mod->pattern_table, header + 952, 128);
+
+	mod->num_patterns = 0;
+	for(i=0; i < 128; i++) {
+		if(mod->pattern_table[i] > 127) {
+			fprintf(stderr, "Bad pattern table.\n");
+			destroy_mod(mod);
+			return 1;
 		}
+		if(mod->pattern_table[i] >= mod->num_patterns) mod->num_patterns = mod->pattern_table[i] + 1;
+	}
+
+	pattern_size = (size_t)64 * mod->num_channels * 4;
+	pattern_data = malloc(pattern_size * mod->num_patterns);
+	mod->patterns = calloc(mod->num_patterns ? mod->num_patterns : 1, sizeof(ModPattern));
+	mod->max_patterns = mod->num_patterns;
+	if(pattern_data == NULL || mod->patterns == NULL) {
+		free(pattern_data);
+		fprintf(stderr, "Out of memory.\n");
+		destroy_mod(mod);
+		return 1;
+	}
+
+	if(fread(pattern_data, pattern_size, mod->num_patterns, infile) != mod->num_patterns) {
+		fprintf(stderr, "Unable to read patterns.\n");
+		free(pattern_data);
+		destroy_mod(mod);
+		return 1;
+	}
+
+	for(i=0; i < mod->num_patterns; i++) {
+		decode_mod_pattern(&mod->patterns[i], mod->num_channels, pattern_data + i * pattern_size);
+	}
+	free(pattern_data);
+
+	// Many modules end a little short, so a truncated last sample is
+	// padded with silence.
+	mod->sample_data = calloc(sample_bytes ? sample_bytes : 1, sizeof(int8_t));
+	if(mod->sample_data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		destroy_mod(mod);
+		return 1;
+	}
+	fread(mod->sample_data, sizeof(int8_t), sample_bytes, infile);
+
+	data = mod->sample_data;
+	for(i=1; i<32; i++) {
+		mod->samples[i]->data = data;
+		data += mod->samples[i]->length * 2;
 	}
 
 	return 0;
 }
 
+void
+destroy_mod(Mod *mod)
+{
+	size_t i;
+	for(i=0; i < 32; i++) {
+		free(mod->samples[i]);
+		mod->samples[i] = NULL;
+	}
+
+	free(mod->sample_data);
+	mod->sample_data = NULL;
+
+	mem_free(mod->allocator, mod->patterns);
+	mod->patterns = NULL;
+	mod->max_patterns = 0;
+}
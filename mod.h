@@ -13,19 +13,25 @@
 #define EF_VOLUME 0x0C
 #define EF_TEMPO 0x0F
 
-static const int PERIOD[128] =
-	{
-	0,      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-	0,      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-	1712,1616,1525,1440,1357,1281,1209,1141,1077,1017, 961, 907,
-	856,  808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
-	428,  404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
-	214,  202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113,
-	107,  101,  95,  90,  85,  80,  76,  71,  67,  64,  60,  57,
-	0,      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-	0,      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-	0,      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-	0,      0,   0,   0,   0,   0,   0,   0};
+// Amiga clock used to turn a period into a sample rate.
+#define MOD_PAL_CLOCK 3546895
+// Notes covered by the period table, MOD_NOTE_PERIOD in the generated
+// modtables.h.  MOD_BASE_NOTE plays a sample at its own rate.
+#define MOD_LOWEST_NOTE 24
+#define MOD_HIGHEST_NOTE 83
+#define MOD_BASE_NOTE 48
+#define MOD_BASE_PERIOD 428
+// Default sample with the low wave, for patches without a sample of their own.
+#define MOD_DEFAULT_SAMPLE 1
+// Default sample with the wave an octave up, for notes above the low one.
+#define MOD_HIGH_WAVE_SAMPLE 30
+// Length of the default sample waves, in bytes.
+#define MOD_WAVE_LENGTH 16574
+
+// Most channels and patterns a conversion can fill.  A mod file holds
+// at most 8 channels and 128 patterns of them, an xm file all of them.
+#define MOD_MAX_CHANNELS 32
+#define MOD_MAX_PATTERNS 256
 
 typedef struct {
 	char name[23];
@@ -34,6 +40,8 @@ typedef struct {
 	uint8_t volume;          // 0 to 64, decibels = 20*log10(volume/64).
 	uint16_t repeat_offset;  // In words.
 	uint16_t repeat_length;  // In words.  Only loops if this is greater than 1.
+	int8_t transpose;        // Semitones added to notes played with this sample.
+	const int8_t *data;      // length words of sample data, not owned.
 } ModSample;
 
 typedef struct {
@@ -45,27 +53,81 @@ typedef struct {
 } ModCommand;
 
 typedef struct {
-	ModCommand data[8][64]; // [channel][division]
+	ModCommand data[MOD_MAX_CHANNELS][64]; // [channel][division]
 } ModPattern;
 
 typedef struct {
 	char title[20];
-	ModSample *samples[32];
-	uint8_t song_length;         // Number of patterns that the song consists of.
-	uint8_t pattern_table[128];
+	ModSample *samples[32];      // By sample number, NULL for the default wave.
+	uint8_t patch_sample[128];   // Sample number for each midi patch, 0 for the default.
+	uint16_t song_length;        // Number of patterns that the song consists of.
+	uint8_t pattern_table[MOD_MAX_PATTERNS];
 	uint8_t num_channels;
 
-	uint8_t num_patterns;
-	ModPattern patterns[128];
+	uint16_t num_patterns;
+	ModPattern *patterns;        // NULL until the mod is converted or read.
+	int max_patterns;            // Number of patterns allocated.
+	Allocator *allocator;        // Where patterns came from.
+
+	int8_t *sample_data;         // Sample data read by read_mod_file.
 } Mod;
 
+// Channel 10 (counting from 0) is skipped as percussion by default.
+#define MIDI_TO_MOD_DEFAULT_CHANNELS (0xFFFF & ~(1 << 10))
+
+typedef struct {
+	uint16_t channels;  // Bit n set converts midi channel n.
+	long int start_time; // First tick to convert.
+	long int end_time;   // Tick to stop converting at, 0 for the end of the song.
+	Allocator *allocator; // Where the conversion gets its memory, NULL for malloc.
+	int num_channels;    // Mod channels to fill, up to MOD_MAX_CHANNELS.
+	int max_patterns;    // Patterns to fill before stopping, up to MOD_MAX_PATTERNS.
+	uint16_t ticks_per_beat; // Midi ticks per division, kept through time signatures.  0 for
+	                         // TICKS_PER_BEAT or 64, which time signatures change.
+	uint8_t speed;       // Mod speed to start with, scaling tempos to suit.  0 to keep tempos as they are.
+} MidiToModOptions;
+
+// Everything midi_to_mod carries from one event to the next.  Which
+// channel each note plays on is worked out before any are converted.
 typedef struct {
-	long int time;  // Absolute time of event.
-	MidiEvent *event;
-} AbsoluteMidiEvent;
+	uint8_t midi_channel_sample[16]; // Current sample that each midi channel is using.
+	uint16_t ticks_per_beat;
+	uint8_t fixed_ticks;             // Whether time signatures leave ticks_per_beat alone.
+	uint8_t speed;
+	uint16_t midi_division;          // Midi ticks per beat.
+} ModConversionState;
+
+typedef struct {
+	uint64_t hash;                   // Hash of the events that fall in the pattern.
+	ModConversionState state;        // State going into the pattern.
+} ModPatternRecord;
+
+// What midi_to_mod_incremental keeps from one conversion to the next.
+typedef struct {
+	int valid;
+	uint64_t settings;               // Hash of the options and samples used.
+	int num_patterns;
+	ModPatternRecord *records;       // One per pattern, then the state at the end.
+	uint8_t *file;                   // The encoded mod.
+	size_t file_size;
+	int patterns_converted;          // Patterns converted by the last call.
+	Allocator *allocator;            // Where records and file came from.
+} ModIncremental;
+
+void init_midi_to_mod_options(MidiToModOptions *);
+int midi_to_mod_events(const Midi *, const MidiToModOptions *, AbsoluteMidiEvent **events, MidiEvent **leading,
+                       size_t *total_events);
+uint8_t mod_tempo(uint32_t tempo, int speed, uint16_t midi_division, uint16_t ticks_per_beat);
+int midi_to_mod(Mod *, const Midi *, const MidiToModOptions *);
 
-int compare_absolute_midi_event(const void *a, const void *b);
-int midi_to_mod(Mod *, const Midi *);
+void init_mod_incremental(ModIncremental *);
+int midi_to_mod_incremental(Mod *, const Midi *, const MidiToModOptions *, ModIncremental *);
+void destroy_mod_incremental(ModIncremental *);
+void make_default_wave(int8_t *wave, int high);
+int encode_mod_file(Mod *, Allocator *, uint8_t **data, size_t *size);
+size_t mod_pattern_offset(const Mod *, int pattern);
 int write_mod_file(Mod *, FILE *);
+int read_mod_file(Mod *, FILE *);
+void destroy_mod(Mod *);
 
 #endif /* MOD_H */
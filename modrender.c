@@ -0,0 +1,530 @@
+/*
+ * modrender.c
+ *
+ * Renders a MOD to 16 bit stereo PCM.  Only what midi2mod writes is
+ * played back: notes, EF_VOLUME and EF_TEMPO.  The song is rendered a
+ * block at a time.  Within a block every channel is rendered on its
+ * own, so channels are spread over threads, and the channels are then
+ * mixed down with SSE2 where available.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mod.h"
+#include "modrender.h"
+#include "modtables.h"
+#include "thread.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_MIX
+#endif
+
+// Frames rendered and mixed at a time.
+#define MIX_BLOCK 4096
+
+typedef struct {
+	const Mod *mod;
+	uint32_t rate;
+	size_t num_rows;
+	size_t *row_start;  // First frame of each row, then the end of the song.
+	ModSample waves[2]; // Low and high default waves, for samples the mod has none for.
+} RenderPlan;
+
+// Where a channel is in the song, carried from one block to the next.
+typedef struct {
+	size_t row;         // The next row to read.
+	const ModSample *sample;
+	const int8_t *data;
+	uint32_t length;
+	uint32_t loop_start;
+	uint32_t loop_end;
+	uint32_t end;
+	double position;
+	double step;
+	int volume;
+	int playing;
+} RenderChannel;
+
+typedef struct {
+	RenderPlan *plan;
+	RenderChannel channels[MOD_MAX_CHANNELS];
+	float *scratch;     // MIX_BLOCK frames of each channel.
+	size_t start;       // First frame of the block being rendered.
+	size_t num_frames;  // Frames in it.
+	int num_workers;
+	int block;          // Counts blocks started, so workers see a new one.
+	int pending;        // Workers still rendering the block.
+	int stopping;
+	Mutex lock;
+	Condition ready;
+	Condition done;
+} Renderer;
+
+typedef struct {
+	Renderer *renderer;
+	int first;
+	int stride;
+	int started;
+} RenderWorker;
+
+static const ModCommand *
+get_cell(const RenderPlan *plan, size_t row, int channel)
+{
+	const Mod *mod = plan->mod;
+	return &mod->patterns[mod->pattern_table[row / 64]].data[channel][row % 64];
+}
+
+// plan_rows
+// Works out when each row starts, following the speed and tempo set by
+// EF_TEMPO.  A tick lasts 2.5 / bpm seconds.
+static void
+plan_rows(RenderPlan *plan)
+{
+	const ModCommand *cell;
+	double frame = 0;
+	int speed = 6;
+	int bpm = 125;
+	int value;
+	size_t r;
+	int c;
+
+	for(r=0; r < plan->num_rows; r++) {
+		for(c=0; c < plan->mod->num_channels; c++) {
+			cell = get_cell(plan, r, c);
+			if(cell->effect != EF_TEMPO) continue;
+
+			value = cell->effect_x << 4 | cell->effect_y;
+			if(value == 0)     continue;
+			else if(value < 32) speed = value;
+			else               bpm = value;
+		}
+
+		plan->row_start[r] = (size_t)frame;
+		frame += speed * plan->rate * 2.5 / bpm;
+	}
+
+	plan->row_start[plan->num_rows] = (size_t)frame;
+}
+
+// tuned_period
+// Returns:  The period that a note written with period plays at with
+//           sample's fine tune.  As in ProTracker, the note is the first
+//           in the period table at or above period's pitch.
+static uint16_t
+tuned_period(uint16_t period, const ModSample *sample)
+{
+	int fine_tune = sample->fine_tune & 0x0F;
+	int low = MOD_LOWEST_NOTE, high = MOD_HIGHEST_NOTE, mid;
+
+	if(!fine_tune || period < MOD_NOTE_PERIOD[0][high]) return period;
+
+	// Periods fall as notes rise.
+	while(low < high) {
+		mid = (low + high) / 2;
+		if(MOD_NOTE_PERIOD[0][mid] <= period) high = mid;
+		else low = mid + 1;
+	}
+
+	return MOD_NOTE_PERIOD[fine_tune][low];
+}
+
+// start_row
+// Plays channel's cell in the row state is at, and moves on to the next.
+static void
+start_row(const RenderPlan *plan, int channel, RenderChannel *state)
+{
+	const ModCommand *cell = get_cell(plan, state->row++, channel);
+	const ModSample *sample;
+
+	if(cell->sample && cell->sample < 32) {
+		state->sample = plan->mod->samples[cell->sample];
+		// Played as it would be written, as encode_mod_file does.
+		if(state->sample == NULL) state->sample = &plan->waves[cell->sample > 8];
+		state->volume = state->sample->volume;
+	}
+
+	sample = state->sample;
+	if(cell->period && sample && sample->data && sample->length) {
+		state->data = sample->data;
+		state->length = sample->length * 2;
+		state->loop_start = state->loop_end = 0;
+		if(sample->repeat_length > 1 && sample->repeat_offset * 2 < state->length) {
+			state->loop_start = sample->repeat_offset * 2;
+			state->loop_end = state->loop_start + sample->repeat_length * 2;
+			if(state->loop_end > state->length) state->loop_end = state->length;
+		}
+		state->end = state->loop_end ? state->loop_end : state->length;
+
+		state->position = 0;
+		state->step = MOD_PAL_CLOCK / (double)tuned_period(cell->period, sample) / plan->rate;
+		state->playing = 1;
+	}
+
+	if(cell->effect == EF_VOLUME) {
+		state->volume = cell->effect_x * 16 + cell->effect_y;
+		if(state->volume > 64) state->volume = 64;
+	}
+}
+
+// render_channel
+// Renders num_frames of channel from frame start into out, going on
+// from where state was left by the block before.
+static void
+render_channel(const RenderPlan *plan, int channel, RenderChannel *state, size_t start, size_t num_frames,
+               float *out)
+{
+	const int8_t *data = state->data;
+	uint32_t length = state->length, loop_start = state->loop_start, loop_end = state->loop_end;
+	uint32_t end = state->end;
+	uint32_t k;
+	double position = state->position, step = state->step, frac;
+	float gain, a, b;
+	size_t f, row_end;
+
+	for(f=0; f < num_frames; ) {
+		// Rows that start by this frame are read first, in order.
+		if(state->row < plan->num_rows && plan->row_start[state->row] <= start + f) {
+			state->position = position;
+			start_row(plan, channel, state);
+			data = state->data;
+			length = state->length;
+			loop_start = state->loop_start;
+			loop_end = state->loop_end;
+			end = state->end;
+			position = state->position;
+			step = state->step;
+			continue;
+		}
+
+		row_end = plan->row_start[state->row] - start;
+		if(row_end > num_frames) row_end = num_frames;
+
+		gain = state->volume / 64.0f;
+		if(!state->playing) {
+			memset(out + f, 0, (row_end - f) * sizeof(float));
+			f = row_end;
+			continue;
+		}
+
+		for(; f < row_end; f++) {
+			if(!state->playing) {
+				out[f] = 0;
+				continue;
+			}
+
+			k = (uint32_t)position;
+			frac = position - k;
+			a = data[k];
+			if(k + 1 < end)    b = data[k+1];
+			else if(loop_end) b = data[loop_start];
+			else              b = 0;
+			out[f] = (a + (b - a) * (float)frac) * gain;
+
+			position += step;
+			if(loop_end) {
+				while(position >= loop_end) position -= loop_end - loop_start;
+			} else if(position >= length) {
+				state->playing = 0;
+			}
+		}
+	}
+
+	state->position = position;
+}
+
+// render_share
+// Renders the block for every channel worker takes.
+static void
+render_share(RenderWorker *worker)
+{
+	Renderer *renderer = worker->renderer;
+	int c;
+
+	for(c = worker->first; c < renderer->plan->mod->num_channels; c += worker->stride) {
+		render_channel(renderer->plan, c, &renderer->channels[c], renderer->start, renderer->num_frames,
+		               renderer->scratch + (size_t)c * MIX_BLOCK);
+	}
+}
+
+static void
+render_worker(void *arg)
+{
+	RenderWorker *worker = arg;
+	Renderer *renderer = worker->renderer;
+	int block = 0;
+
+	for(;;) {
+		mutex_lock(&renderer->lock);
+		while(renderer->block == block && !renderer->stopping) condition_wait(&renderer->ready, &renderer->lock);
+		if(renderer->stopping) {
+			mutex_unlock(&renderer->lock);
+			break;
+		}
+		block = renderer->block;
+		mutex_unlock(&renderer->lock);
+
+		render_share(worker);
+
+		mutex_lock(&renderer->lock);
+		if(--renderer->pending == 0) condition_signal(&renderer->done);
+		mutex_unlock(&renderer->lock);
+	}
+}
+
+// mix_channels
+// Sums the block's channels into stereo, Amiga style: channels 0 and 3
+// of each four on the left, 1 and 2 on the right.
+static void
+mix_channels(const Renderer *renderer, int16_t *pcm)
+{
+	int num_channels = renderer->plan->mod->num_channels;
+	size_t n = renderer->num_frames;
+	float scale = 512.0f / num_channels;
+	float left[MIX_BLOCK], right[MIX_BLOCK];
+	float *side;
+	const float *in;
+	size_t i;
+	float l, r;
+	int c;
+
+	memset(left, 0, sizeof(left));
+	memset(right, 0, sizeof(right));
+
+	for(c=0; c < num_channels; c++) {
+		side = (c % 4 == 0 || c % 4 == 3) ? left : right;
+		in = renderer->scratch + (size_t)c * MIX_BLOCK;
+		i = 0;
+#ifdef HAVE_SSE2_MIX
+		for(; i + 4 <= n; i += 4)
+			_mm_storeu_ps(side + i, _mm_add_ps(_mm_loadu_ps(side + i), _mm_loadu_ps(in + i)));
+#endif
+		for(; i < n; i++) side[i] += in[i];
+	}
+
+	i = 0;
+#ifdef HAVE_SSE2_MIX
+	{
+		__m128 s = _mm_set1_ps(scale);
+		__m128i lq, rq;
+		for(; i + 4 <= n; i += 4) {
+			lq = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(left + i), s));
+			rq = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(right + i), s));
+			_mm_storeu_si128((__m128i *)(pcm + 2 * i),
+				_mm_packs_epi32(_mm_unpacklo_epi32(lq, rq), _mm_unpackhi_epi32(lq, rq)));
+		}
+	}
+#endif
+	for(; i < n; i++) {
+		l = floorf(left[i] * scale + 0.5f);
+		r = floorf(right[i] * scale + 0.5f);
+		pcm[2 * i]     = l > 32767 ? 32767 : l < -32768 ? -32768 : (int16_t)l;
+		pcm[2 * i + 1] = r > 32767 ? 32767 : r < -32768 ? -32768 : (int16_t)r;
+	}
+}
+
+// render_mod
+// Plays mod from start to end, a block at a time.  Each block's
+// channels are rendered, spread over threads, then mixed and handed to
+// output interleaved left and right, so memory does not grow with the
+// song.  Passing 0 for num_threads uses one thread per processor.
+//
+// Takes:  num_frames - Set to the frames in the song before output is
+//                      first called.  May be NULL.
+//
+// Returns:  Non-zero on error, or if output returned non-zero.
+int
+render_mod(const Mod *mod, uint32_t rate, int num_threads, ModRenderOutput output, void *context,
+           size_t *num_frames)
+{
+	RenderPlan plan;
+	Renderer renderer;
+	RenderWorker workers[MOD_MAX_CHANNELS];
+	Thread threads[MOD_MAX_CHANNELS];
+	int16_t pcm[2 * MIX_BLOCK];
+	int8_t *wave_data;
+	size_t frames;
+	int i;
+	int status = 0;
+
+	if(num_frames != NULL) *num_frames = 0;
+
+	if(mod->num_channels == 0 || mod->num_channels > MOD_MAX_CHANNELS) {
+		fprintf(stderr, "Can not render %d channels.\n", mod->num_channels);
+		return 1;
+	}
+
+	plan.mod = mod;
+	plan.rate = rate;
+	plan.num_rows = (size_t)mod->song_length * 64;
+	plan.row_start = malloc((plan.num_rows + 1) * sizeof(size_t));
+	renderer.scratch = malloc((size_t)mod->num_channels * MIX_BLOCK * sizeof(float));
+	wave_data = malloc(2 * MOD_WAVE_LENGTH);
+	if(plan.row_start == NULL || renderer.scratch == NULL || wave_data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(plan.row_start);
+		free(renderer.scratch);
+		free(wave_data);
+		return 1;
+	}
+
+	memset(plan.waves, 0, sizeof(plan.waves));
+	for(i=0; i < 2; i++) {
+		make_default_wave(wave_data + i * MOD_WAVE_LENGTH, i);
+		plan.waves[i].length = MOD_WAVE_LENGTH / 2;
+		plan.waves[i].volume = 64;
+		plan.waves[i].repeat_length = MOD_WAVE_LENGTH / 2;
+		plan.waves[i].data = wave_data + i * MOD_WAVE_LENGTH;
+	}
+
+	plan_rows(&plan);
+	frames = plan.row_start[plan.num_rows];
+	if(num_frames != NULL) *num_frames = frames;
+
+	memset(renderer.channels, 0, sizeof(renderer.channels));
+	renderer.plan = &plan;
+	renderer.block = 0;
+	renderer.pending = 0;
+	renderer.stopping = 0;
+	mutex_init(&renderer.lock);
+	condition_init(&renderer.ready);
+	condition_init(&renderer.done);
+
+	if(num_threads <= 0) num_threads = thread_count();
+	if(num_threads > mod->num_channels) num_threads = mod->num_channels;
+
+	// This thread takes the first share, and any a thread could not be
+	// started for.
+	renderer.num_workers = 0;
+	for(i=0; i < num_threads; i++) {
+		workers[i].renderer = &renderer;
+		workers[i].first = i;
+		workers[i].stride = num_threads;
+		workers[i].started = i > 0 && !thread_create(&threads[i], render_worker, &workers[i]);
+		if(workers[i].started) renderer.num_workers++;
+	}
+
+	for(renderer.start=0; renderer.start < frames && !status; renderer.start += MIX_BLOCK) {
+		renderer.num_frames = frames - renderer.start < MIX_BLOCK ? frames - renderer.start : MIX_BLOCK;
+
+		mutex_lock(&renderer.lock);
+		renderer.block++;
+		renderer.pending = renderer.num_workers;
+		condition_broadcast(&renderer.ready);
+		mutex_unlock(&renderer.lock);
+
+		for(i=0; i < num_threads; i++) {
+			if(!workers[i].started) render_share(&workers[i]);
+		}
+
+		mutex_lock(&renderer.lock);
+		while(renderer.pending) condition_wait(&renderer.done, &renderer.lock);
+		mutex_unlock(&renderer.lock);
+
+		mix_channels(&renderer, pcm);
+		status = output(context, pcm, renderer.num_frames);
+	}
+
+	mutex_lock(&renderer.lock);
+	renderer.stopping = 1;
+	condition_broadcast(&renderer.ready);
+	mutex_unlock(&renderer.lock);
+	for(i=0; i < num_threads; i++) {
+		if(workers[i].started) thread_join(threads[i]);
+	}
+
+	condition_destroy(&renderer.done);
+	condition_destroy(&renderer.ready);
+	mutex_destroy(&renderer.lock);
+	free(renderer.scratch);
+	free(plan.row_start);
+	free(wave_data);
+
+	return status;
+}
+
+static void
+put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v & 0xFFFF);
+	put_le16(p + 2, v >> 16);
+}
+
+// write_wav_header
+// Writes the header of a WAV file of 16 bit stereo frames.
+static int
+write_wav_header(size_t num_frames, uint32_t rate, FILE *outfile)
+{
+	uint8_t header[44];
+	uint32_t data_size = num_frames * 4;
+
+	memcpy(header, "RIFF", 4);
+	put_le32(header + 4, 36 + data_size);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_le32(header + 16, 16);
+	put_le16(header + 20, 1);           // PCM
+	put_le16(header + 22, 2);           // Channels
+	put_le32(header + 24, rate);
+	put_le32(header + 28, rate * 4);    // Bytes per second
+	put_le16(header + 32, 4);           // Bytes per frame
+	put_le16(header + 34, 16);          // Bits per sample
+	memcpy(header + 36, "data", 4);
+	put_le32(header + 40, data_size);
+
+	if(fwrite(header, sizeof(header), 1, outfile) != 1) {
+		fprintf(stderr, "Unable to write wav header.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// write_wav_frames
+// Writes a block of frames from render_mod to the WAV file in context.
+static int
+write_wav_frames(void *context, const int16_t *pcm, size_t num_frames)
+{
+	uint8_t data[4 * MIX_BLOCK];
+	size_t i;
+
+	for(i=0; i < num_frames * 2; i++) put_le16(data + 2 * i, pcm[i]);
+
+	if(fwrite(data, 4, num_frames, context) != num_frames) {
+		fprintf(stderr, "Unable to write wav data.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+// write_wav_file
+// Renders mod to outfile as a 16 bit stereo WAV file, a block at a
+// time.  outfile must be seekable, as the header is written last.
+//
+// Returns:  Non-zero on error.
+int
+write_wav_file(const Mod *mod, uint32_t rate, int num_threads, FILE *outfile)
+{
+	size_t num_frames;
+
+	// The size is not known until the song is planned.
+	if(write_wav_header(0, rate, outfile)) return 1;
+	if(render_mod(mod, rate, num_threads, write_wav_frames, outfile, &num_frames)) return 1;
+	if(fseek(outfile, 0, SEEK_SET)) {
+		fprintf(stderr, "Unable to write wav header.\n");
+		return 1;
+	}
+
+	return write_wav_header(num_frames, rate, outfile);
+}
@@ -0,0 +1,26 @@
+/*
+ * modrender.h
+ *
+ * Offline software mixer for previewing MOD files.
+ *
+ */
+
+#ifndef MODRENDER_H
+#define MODRENDER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "mod.h"
+
+#define MOD_RENDER_RATE 44100
+
+// Takes each block of frames render_mod mixes, interleaved left and
+// right.  Returns non-zero to stop rendering.
+typedef int (*ModRenderOutput)(void *context, const int16_t *pcm, size_t num_frames);
+
+int render_mod(const Mod *, uint32_t rate, int num_threads, ModRenderOutput, void *context, size_t *num_frames);
+int write_wav_file(const Mod *, uint32_t rate, int num_threads, FILE *);
+
+#endif /* MODRENDER_H */
@@ -0,0 +1,265 @@
+/*
+ * modtune.c
+ *
+ * Each candidate number of divisions per beat is tried against the
+ * same merged events, sharing out channels as midi_to_mod does but
+ * writing no patterns, and the candidates are spread over threads.
+ * The speed does not move any notes, it only decides how closely the
+ * tempos can be matched, so it is worked out for each candidate from
+ * the song's tempos alone.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "allocator.h"
+#include "midi.h"
+#include "mod.h"
+#include "modtune.h"
+#include "notespan.h"
+#include "thread.h"
+
+// Divisions per beat that are tried.
+static const int ROWS_PER_BEAT[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+#define MAX_CANDIDATES (sizeof(ROWS_PER_BEAT) / sizeof(ROWS_PER_BEAT[0]))
+
+// What each dropped note, beat of timing error and pattern adds to a
+// candidate's score.  A note moved by a sixteenth of a beat costs as
+// much as one that is dropped.
+#define DROPPED_NOTE_COST 1.0
+#define TIMING_ERROR_COST 16.0
+#define PATTERN_COST 4.0
+
+// The speed a mod starts with, preferred when others do as well.
+#define DEFAULT_SPEED 6
+
+typedef struct {
+	const AbsoluteMidiEvent *events;
+	size_t total_events;
+	uint32_t *tempos;            // Every tempo the song uses.
+	size_t num_tempos;
+	long int start_time;
+	uint16_t midi_division;
+	int num_channels;
+	int max_patterns;
+	ModTuning *candidates;
+	int num_candidates;
+} TuneJob;
+
+typedef struct {
+	TuneJob *job;
+	int first;
+	int stride;
+	int started;
+	long int *rows;              // Room for the plan of one candidate.
+	NoteSpan *spans;
+	int8_t *voices;
+} TuneWorker;
+
+// pick_speed
+// Sets the speed that matches all of the song's tempos best with
+// tuning->ticks_per_beat, and how far off the worst of them is.
+static void
+pick_speed(const TuneJob *job, ModTuning *tuning)
+{
+	double exact, error, worst;
+	size_t i;
+	int speed;
+
+	tuning->speed = DEFAULT_SPEED;
+	tuning->tempo_error = HUGE_VAL;
+
+	for(speed=1; speed < 32; speed++) {
+		worst = 0;
+		for(i=0; i < job->num_tempos; i++) {
+			exact = 60000000.0 / job->tempos[i] * speed * job->midi_division / (24.0 * tuning->ticks_per_beat);
+			error = fabs(mod_tempo(job->tempos[i], speed, job->midi_division, tuning->ticks_per_beat) - exact) / exact;
+			if(error > worst) worst = error;
+		}
+
+		if(worst < tuning->tempo_error ||
+		   (worst == tuning->tempo_error && abs(speed - DEFAULT_SPEED) < abs(tuning->speed - DEFAULT_SPEED))) {
+			tuning->speed = speed;
+			tuning->tempo_error = worst;
+		}
+	}
+}
+
+// score_candidate
+// Shares out the channels as midi_to_mod would with
+// tuning->ticks_per_beat, counting the notes that would be lost and how
+// far the rest move.
+static void
+score_candidate(const TuneJob *job, TuneWorker *worker, ModTuning *tuning)
+{
+	const MidiEvent *event;
+	size_t i, n, s;
+	long int time;
+
+	tuning->notes = 0;
+	tuning->dropped_notes = 0;
+	tuning->timing_error = 0;
+
+	pick_speed(job, tuning);
+
+	for(i=0; i < job->total_events; i++) {
+		time = job->events[i].time - job->start_time;
+		worker->rows[i] = time / tuning->ticks_per_beat;
+		if(worker->rows[i] / 64 >= job->max_patterns) break;
+	}
+	n = i;
+
+	tuning->notes = pair_note_spans(job->events, n, worker->spans);
+	// The speed and tempo set at the start take the first division.
+	tuning->dropped_notes = allocate_voices(worker->spans, tuning->notes, job->events, worker->rows, n,
+	                                        job->num_channels, job->num_channels > 1 ? 2 : 1, worker->voices);
+
+	for(s=0; s < tuning->notes; s++) {
+		time = job->events[worker->spans[s].on].time - job->start_time;
+		tuning->timing_error += (double)(time % tuning->ticks_per_beat) / job->midi_division;
+	}
+
+	// Notes past the last pattern are lost.
+	for(; i < job->total_events; i++) {
+		event = job->events[i].event;
+		if(event->type == MIDI_EVENT && event->command == MIDI_NOTEON && event->velocity) {
+			tuning->notes++;
+			tuning->dropped_notes++;
+		}
+	}
+
+	tuning->num_patterns = (n ? worker->rows[n - 1] : 0) / 64 + 1;
+	tuning->score = DROPPED_NOTE_COST * tuning->dropped_notes +
+	                TIMING_ERROR_COST * (tuning->timing_error + tuning->tempo_error * tuning->notes) +
+	                PATTERN_COST * tuning->num_patterns;
+}
+
+static void
+tune_worker(void *arg)
+{
+	TuneWorker *worker = arg;
+	int i;
+
+	for(i = worker->first; i < worker->job->num_candidates; i += worker->stride) {
+		score_candidate(worker->job, worker, &worker->job->candidates[i]);
+	}
+}
+
+// tune_midi_to_mod
+// Tries converting the part of midi that options select with several
+// numbers of midi ticks per division, and picks the one that drops the
+// fewest notes, moves them the least and needs the fewest patterns.
+// The options' own ticks_per_beat and speed are ignored.
+//
+// Takes:  num_threads - Threads to score candidates with, 0 for one per
+//                       processor.
+//         best        - Set to the candidate picked.
+//
+// Returns:  Non-zero on error.
+int
+tune_midi_to_mod(const Midi *midi, const MidiToModOptions *options, int num_threads, ModTuning *best)
+{
+	TuneJob job;
+	TuneWorker workers[MAX_CANDIDATES];
+	Thread threads[MAX_CANDIDATES];
+	ModTuning candidates[MAX_CANDIDATES];
+	AbsoluteMidiEvent *events;
+	MidiEvent *leading;
+	const MidiEvent *event;
+	size_t total_events, room, i;
+	int ticks, num_candidates = 0;
+	int c;
+
+	if(midi->division == 0 || (midi->division & 0x8000)) {
+		fprintf(stderr, "Can not tune a song not timed in beats.\n");
+		return 1;
+	}
+
+	if(midi_to_mod_events(midi, options, &events, &leading, &total_events)) {
+		return 1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.tempos = mem_malloc(options->allocator, (total_events + 1) * sizeof(uint32_t));
+	if(job.tempos == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		mem_free(options->allocator, events);
+		mem_free(options->allocator, leading);
+		return 1;
+	}
+
+	// The song starts at 120 beats per minute.
+	job.tempos[job.num_tempos++] = 500000;
+	for(i=0; i < total_events; i++) {
+		event = events[i].event;
+		if(event->type == MIDI_EVENT_META && event->meta_type == MIDI_META_SETTEMPO && event->tempo)
+			job.tempos[job.num_tempos++] = event->tempo;
+	}
+
+	memset(candidates, 0, sizeof(candidates));
+	for(i=0; i < MAX_CANDIDATES; i++) {
+		ticks = (midi->division + ROWS_PER_BEAT[i] / 2) / ROWS_PER_BEAT[i];
+		if(ticks < 1 || (num_candidates && candidates[num_candidates - 1].ticks_per_beat == ticks)) continue;
+		candidates[num_candidates++].ticks_per_beat = ticks;
+	}
+
+	job.events = events;
+	job.total_events = total_events;
+	job.start_time = options->start_time;
+	job.midi_division = midi->division;
+	job.num_channels = options->num_channels;
+	job.max_patterns = options->max_patterns;
+	job.candidates = candidates;
+	job.num_candidates = num_candidates;
+
+	if(num_threads <= 0) num_threads = thread_count();
+	if(num_threads > num_candidates) num_threads = num_candidates;
+
+	room = total_events ? total_events : 1;
+	for(c=0; c < num_threads; c++) {
+		workers[c].spans = mem_malloc(options->allocator, room * (sizeof(NoteSpan) + sizeof(long int) + sizeof(int8_t)));
+		if(workers[c].spans == NULL) break;
+		workers[c].rows = (long int *)(workers[c].spans + room);
+		workers[c].voices = (int8_t *)(workers[c].rows + room);
+	}
+	// Fewer threads will do if there is not room for them all.
+	if(c == 0) {
+		fprintf(stderr, "Out of memory.\n");
+		mem_free(options->allocator, job.tempos);
+		mem_free(options->allocator, events);
+		mem_free(options->allocator, leading);
+		return 1;
+	}
+	num_threads = c;
+
+	for(c=0; c < num_threads; c++) {
+		workers[c].job = &job;
+		workers[c].first = c;
+		workers[c].stride = num_threads;
+		workers[c].started = c > 0 && !thread_create(&threads[c], tune_worker, &workers[c]);
+	}
+
+	// This thread takes the first share, and any a thread could not be
+	// started for.
+	for(c=0; c < num_threads; c++) {
+		if(!workers[c].started) tune_worker(&workers[c]);
+	}
+	for(c=0; c < num_threads; c++) {
+		if(workers[c].started) thread_join(threads[c]);
+	}
+
+	*best = candidates[0];
+	for(c=1; c < num_candidates; c++) {
+		if(candidates[c].score < best->score) *best = candidates[c];
+	}
+
+	for(c=0; c < num_threads; c++) mem_free(options->allocator, workers[c].spans);
+	mem_free(options->allocator, job.tempos);
+	mem_free(options->allocator, events);
+	mem_free(options->allocator, leading);
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * modtune.h
+ *
+ * Picks the midi ticks per division and mod speed that suit a song.
+ *
+ */
+
+#ifndef MODTUNE_H
+#define MODTUNE_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "midi.h"
+#include "mod.h"
+
+typedef struct {
+	uint16_t ticks_per_beat;     // Midi ticks per division.
+	uint8_t speed;
+	size_t notes;                // Notes that fall in the song.
+	size_t dropped_notes;        // Notes with no channel free, or past the last pattern.
+	double timing_error;         // Beats that notes are moved by, in all.
+	double tempo_error;          // Largest error of a tempo, as a fraction of it.
+	int num_patterns;
+	double score;                // Lower is better.
+} ModTuning;
+
+int tune_midi_to_mod(const Midi *, const MidiToModOptions *, int num_threads, ModTuning *best);
+
+#endif /* MODTUNE_H */
@@ -0,0 +1,275 @@
+/*
+ * notespan.c
+ *
+ * Channels are handed out in the order that notes start.  When every
+ * channel is busy, the note that would go on longest, either the new
+ * one or one already playing, is the one dropped.  That plays the most
+ * notes that the channels can hold, and with the channels kept in heaps
+ * ordered by when their notes end it takes O(n log c) time.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midi.h"
+#include "mod.h"
+#include "notespan.h"
+
+typedef struct {
+	int channels[MOD_MAX_CHANNELS];
+	int position[MOD_MAX_CHANNELS];  // Where each channel is in channels.
+	int size;
+	int latest;                      // Whether the latest end is on top, rather than the earliest.
+	const long int *end;             // When each channel's note ends.
+} VoiceHeap;
+
+static int
+heap_before(const VoiceHeap *heap, int a, int b)
+{
+	return heap->latest ? heap->end[a] > heap->end[b] : heap->end[a] < heap->end[b];
+}
+
+static void
+heap_swap(VoiceHeap *heap, int i, int j)
+{
+	int c = heap->channels[i];
+
+	heap->channels[i] = heap->channels[j];
+	heap->channels[j] = c;
+	heap->position[heap->channels[i]] = i;
+	heap->position[heap->channels[j]] = j;
+}
+
+// Moves the channel at i up or down to where it belongs.
+static void
+heap_sift(VoiceHeap *heap, int i)
+{
+	int child;
+
+	while(i > 0 && heap_before(heap, heap->channels[i], heap->channels[(i - 1) / 2])) {
+		heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for(;;) {
+		child = 2 * i + 1;
+		if(child >= heap->size) break;
+		if(child + 1 < heap->size && heap_before(heap, heap->channels[child + 1], heap->channels[child])) child++;
+		if(!heap_before(heap, heap->channels[child], heap->channels[i])) break;
+		heap_swap(heap, i, child);
+		i = child;
+	}
+}
+
+static void
+heap_push(VoiceHeap *heap, int channel)
+{
+	heap->channels[heap->size] = channel;
+	heap->position[channel] = heap->size;
+	heap->size++;
+	heap_sift(heap, heap->size - 1);
+}
+
+static void
+heap_remove(VoiceHeap *heap, int channel)
+{
+	int i = heap->position[channel];
+
+	heap->size--;
+	if(i == heap->size) return;
+
+	heap_swap(heap, i, heap->size);
+	heap_sift(heap, i);
+}
+
+// Returns:  The lowest bit set in mask, which must not be 0.
+static int
+lowest_bit(uint32_t mask)
+{
+	static const int DE_BRUIJN[32] = {
+		0,  1, 28,  2, 29, 14, 24,  3, 30, 22, 20, 15, 25, 17,  4,  8,
+		31, 27, 13, 23, 21, 19, 16,  7, 26, 12, 18,  6, 11,  5, 10,  9};
+
+	return DE_BRUIJN[((mask & (0u - mask)) * 0x077CB531u) >> 27];
+}
+
+// pair_note_spans
+// Makes a span for every note, from its note on to the note off, note
+// on of velocity 0, or new start of the same note that ends it.  The
+// spans come out in the order that the notes start, in linear time.
+//
+// Takes:  spans - Room for as many spans as there are events.
+//
+// Returns:  Number of spans made.
+size_t
+pair_note_spans(const AbsoluteMidiEvent *events, size_t num_events, NoteSpan *spans)
+{
+	static const size_t NONE = 0;
+	size_t open[16][128];   // 1 + the span each note is sounding in, or NONE.
+	const MidiEvent *event;
+	size_t *slot;
+	size_t i, n = 0;
+
+	memset(open, 0, sizeof(open));
+
+	for(i=0; i < num_events; i++) {
+		event = events[i].event;
+		if(event->type != MIDI_EVENT) continue;
+		if(event->command != MIDI_NOTEON && event->command != MIDI_NOTEOFF) continue;
+
+		slot = &open[event->channel & 0x0F][event->note & 0x7F];
+		if(*slot != NONE) {
+			spans[*slot - 1].off = i;
+			*slot = NONE;
+		}
+
+		if(event->command == MIDI_NOTEON && event->velocity) {
+			memset(&spans[n], 0, sizeof(NoteSpan));
+			spans[n].on = i;
+			spans[n].off = num_events;
+			spans[n].channel = -1;
+			*slot = ++n;
+		}
+	}
+
+	return n;
+}
+
+// set_stop
+// Works out where span must be stopped, given the start of the next
+// note on its channel.  A note is stopped where it ends, or a division
+// after it starts if it ends in the same one, unless the next note
+// starts there and cuts it off anyway.
+static void
+set_stop(NoteSpan *span, long int next_start)
+{
+	span->stop = -1;
+	if(span->end == NOTE_SPAN_OPEN) return;
+
+	span->stop = span->end > span->start ? span->end : span->start + 1;
+	if(span->stop >= next_start) span->stop = -1;
+}
+
+// allocate_voices
+// Gives each span a mod channel, or drops it, and picks a channel for
+// each tempo to be set on.  A tempo only takes a channel that is free
+// for its division, and is dropped if there is none.
+//
+// Takes:  divisions - Division each event falls on.
+//         reserved  - Channels whose first division is already used.
+//         voices    - Set to the channel of each note on and tempo
+//                     event, -1 for other events and ones dropped.
+//
+// Returns:  Number of notes dropped.
+size_t
+allocate_voices(NoteSpan *spans, size_t num_spans, const AbsoluteMidiEvent *events, const long int *divisions,
+                size_t num_events, int num_channels, int reserved, int8_t *voices)
+{
+	VoiceHeap earliest, latest;
+	long int end[MOD_MAX_CHANNELS];      // Division each channel is free from.
+	size_t occupant[MOD_MAX_CHANNELS];   // Span on each channel, num_spans for a tempo or none.
+	uint32_t free_channels;
+	const MidiEvent *event;
+	NoteSpan *span;
+	long int division, span_end;
+	size_t i, s = 0, dropped = 0;
+	int c;
+
+	if(num_channels > MOD_MAX_CHANNELS) num_channels = MOD_MAX_CHANNELS;
+
+	memset(&earliest, 0, sizeof(earliest));
+	memset(&latest, 0, sizeof(latest));
+	earliest.end = latest.end = end;
+	latest.latest = 1;
+
+	free_channels = num_channels >= 32 ? 0xFFFFFFFFu : (1u << num_channels) - 1;
+	for(c=0; c < num_channels; c++) {
+		end[c] = -1;
+		occupant[c] = num_spans;
+	}
+	for(c=0; c < reserved && c < num_channels; c++) {
+		end[c] = 1;
+		free_channels &= ~(1u << c);
+		heap_push(&earliest, c);
+		heap_push(&latest, c);
+	}
+
+	memset(voices, -1, num_events);
+
+	for(i=0; i < num_events; i++) {
+		division = divisions[i];
+
+		// Channels whose notes have ended are free again.
+		while(earliest.size && end[earliest.channels[0]] <= division) {
+			c = earliest.channels[0];
+			heap_remove(&earliest, c);
+			heap_remove(&latest, c);
+			free_channels |= 1u << c;
+		}
+
+		event = events[i].event;
+		if(s < num_spans && spans[s].on == i) {
+			span = &spans[s];
+			span->start = division;
+			span->end = span->off < num_events ? divisions[span->off] : NOTE_SPAN_OPEN;
+			// A note that ends in the division it starts in still takes it.
+			span_end = span->end > division ? span->end : division + 1;
+
+			if(free_channels) {
+				c = lowest_bit(free_channels);
+			} else {
+				c = latest.size ? latest.channels[0] : -1;
+				if(c < 0 || end[c] <= span_end || occupant[c] == num_spans) {
+					dropped++;
+					s++;
+					continue;
+				}
+
+				// The note playing that goes on longest makes way.
+				spans[occupant[c]].channel = -1;
+				dropped++;
+				heap_remove(&earliest, c);
+				heap_remove(&latest, c);
+			}
+
+			span->channel = c;
+			end[c] = span_end;
+			occupant[c] = s;
+			free_channels &= ~(1u << c);
+			heap_push(&earliest, c);
+			heap_push(&latest, c);
+			s++;
+		} else if(event->type == MIDI_EVENT_META && event->meta_type == MIDI_META_SETTEMPO) {
+			// Not on a channel whose note is stopped in this division.
+			for(c=0; c < num_channels; c++) {
+				if((free_channels & (1u << c)) && end[c] != division) break;
+			}
+			if(c == num_channels) continue;
+
+			voices[i] = c;
+			end[c] = division + 1;
+			occupant[c] = num_spans;
+			free_channels &= ~(1u << c);
+			heap_push(&earliest, c);
+			heap_push(&latest, c);
+		}
+	}
+
+	// Every channel's notes are stopped before its next note starts.
+	for(c=0; c < num_channels; c++) occupant[c] = num_spans;
+	for(s=0; s < num_spans; s++) {
+		span = &spans[s];
+		if(span->channel < 0) continue;
+
+		voices[span->on] = span->channel;
+		if(occupant[span->channel] < num_spans) set_stop(&spans[occupant[span->channel]], span->start);
+		occupant[span->channel] = s;
+	}
+	for(c=0; c < num_channels; c++) {
+		if(occupant[c] < num_spans) set_stop(&spans[occupant[c]], NOTE_SPAN_OPEN);
+	}
+
+	return dropped;
+}
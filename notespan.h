@@ -0,0 +1,34 @@
+/*
+ * notespan.h
+ *
+ * Pairs each note's start with its end, so that mod channels can be
+ * handed out knowing how long every note lasts.
+ *
+ */
+
+#ifndef NOTESPAN_H
+#define NOTESPAN_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include "midi.h"
+
+// End of a note that nothing ends.
+#define NOTE_SPAN_OPEN LONG_MAX
+
+typedef struct {
+	size_t on;          // Event that starts the note.
+	size_t off;         // Event that ends it, or the number of events if none does.
+	long int start;     // Division the note starts on.
+	long int end;       // Division it ends on, NOTE_SPAN_OPEN if nothing ends it.
+	long int stop;      // Division to stop it on, -1 if the next note on its channel, or nothing, does.
+	int channel;        // Mod channel it plays on, -1 if it is dropped.
+} NoteSpan;
+
+size_t pair_note_spans(const AbsoluteMidiEvent *events, size_t num_events, NoteSpan *spans);
+size_t allocate_voices(NoteSpan *spans, size_t num_spans, const AbsoluteMidiEvent *events, const long int *divisions,
+                       size_t num_events, int num_channels, int reserved, int8_t *voices);
+
+#endif /* NOTESPAN_H */
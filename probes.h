@@ -0,0 +1,54 @@
+/*
+ * probes.h
+ *
+ * Static probes for tracing conversions with SystemTap, bpftrace or
+ * perf, without rebuilding.  They are only compiled in when CMake is run
+ * with -DENABLE_PROBES=ON, which needs sys/sdt.h, and cost nothing
+ * otherwise.  The read and track probes fire from both the file reader
+ * and the stream parser.  Each pair of start and done probes fires on
+ * the same thread, so the time between them can be put in a histogram:
+ *
+ *   bpftrace -e 'usdt:./midi2mod:midi2mod:track_start { @t[tid] = nsecs; }
+ *                usdt:./midi2mod:midi2mod:track_done /@t[tid]/ {
+ *                    @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+ *
+ * Probes, all in the midi2mod provider:
+ *   file_open(path)                       Input file opened, or read whole
+ *                                         for a batch.
+ *   read_start(num_tracks)                Header read, tracks next.
+ *   read_done(num_tracks)
+ *   track_start(length)                   Track chunk of length bytes.
+ *   track_done(num_events)
+ *   merge_start(num_events)               Channels about to be merged.
+ *   merge_done(num_events)
+ *   pattern_done(pattern, events)         Pattern converted, with the
+ *                                         events converted so far.
+ *   voice_full(channel, note, pattern, division)
+ *                                         Note dropped, no mod channel free.
+ *   tempo_full(pattern, division)         Tempo dropped, no mod channel free.
+ *   encode_start(num_patterns)            File about to be encoded.
+ *   encode_done(size)
+ *   write_done(size)                      Encoded file written.
+ *
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef MIDI2MOD_PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)          DTRACE_PROBE1(midi2mod, name, a)
+#define PROBE2(name, a, b)       DTRACE_PROBE2(midi2mod, name, a, b)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(midi2mod, name, a, b, c, d)
+
+#else
+
+#define PROBE1(name, a)          do {} while(0)
+#define PROBE2(name, a, b)       do {} while(0)
+#define PROBE4(name, a, b, c, d) do {} while(0)
+
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,375 @@
+/*
+ * resample.c
+ *
+ * Windowed sinc polyphase resampler.  The filter is applied with SSE or
+ * AVX2 when the processor has them and a plain C loop otherwise, then
+ * the result is dithered down to 8 bits.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "resample.h"
+#include "thread.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define HAVE_SSE_KERNEL
+#endif
+#if defined(__GNUC__)
+#define HAVE_AVX2_KERNEL
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#elif defined(__AVX2__)
+#define HAVE_AVX2_KERNEL
+#define TARGET_AVX2
+#endif
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Number of fractional positions the filter is tabulated at.
+#define RESAMPLE_PHASES 256
+// Most taps used when shrinking a sample a lot.
+#define RESAMPLE_MAX_TAPS 64
+
+typedef void (*FilterKernel)(const float *in, const float *table, int taps, double step, float *out, uint32_t n);
+
+static int selected_kernel = -1;
+
+// Each kernel works out output point i from the taps input points
+// starting at in[floor(i * step) + 1], using the filter phase nearest
+// to the fraction of i * step.
+
+static void
+filter_scalar(const float *in, const float *table, int taps, double step, float *out, uint32_t n)
+{
+	uint32_t i, k;
+	int p, t;
+	double position;
+	const float *x, *h;
+	float sum;
+
+	for(i=0; i < n; i++) {
+		position = i * step;
+		k = (uint32_t)position;
+		p = (int)((position - k) * RESAMPLE_PHASES + 0.5);
+
+		x = in + k + 1;
+		h = table + (size_t)p * taps;
+		sum = 0;
+		for(t=0; t < taps; t++) sum += x[t] * h[t];
+		out[i] = sum;
+	}
+}
+
+#ifdef HAVE_SSE_KERNEL
+static void
+filter_sse(const float *in, const float *table, int taps, double step, float *out, uint32_t n)
+{
+	uint32_t i, k;
+	int p, t;
+	double position;
+	const float *x, *h;
+	__m128 sum;
+
+	for(i=0; i < n; i++) {
+		position = i * step;
+		k = (uint32_t)position;
+		p = (int)((position - k) * RESAMPLE_PHASES + 0.5);
+
+		x = in + k + 1;
+		h = table + (size_t)p * taps;
+		sum = _mm_setzero_ps();
+		for(t=0; t < taps; t += 4)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + t), _mm_loadu_ps(h + t)));
+
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		out[i] = _mm_cvtss_f32(sum);
+	}
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+TARGET_AVX2 static void
+filter_avx2(const float *in, const float *table, int taps, double step, float *out, uint32_t n)
+{
+	uint32_t i, k;
+	int p, t;
+	double position;
+	const float *x, *h;
+	__m256 sum;
+	__m128 half;
+
+	for(i=0; i < n; i++) {
+		position = i * step;
+		k = (uint32_t)position;
+		p = (int)((position - k) * RESAMPLE_PHASES + 0.5);
+
+		x = in + k + 1;
+		h = table + (size_t)p * taps;
+		sum = _mm256_setzero_ps();
+		for(t=0; t < taps; t += 8)
+			sum = _mm256_fmadd_ps(_mm256_loadu_ps(x + t), _mm256_loadu_ps(h + t), sum);
+
+		half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+		half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+		half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+		out[i] = _mm_cvtss_f32(half);
+	}
+}
+#endif
+
+static int
+kernel_supported(int kernel)
+{
+	switch(kernel) {
+	case RESAMPLE_SCALAR:
+		return 1;
+#ifdef HAVE_SSE_KERNEL
+	case RESAMPLE_SSE:
+		return 1;
+#endif
+#ifdef HAVE_AVX2_KERNEL
+	case RESAMPLE_AVX2:
+#if defined(__GNUC__)
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+		return 1;
+#endif
+#endif
+	}
+
+	return 0;
+}
+
+// resample_select_kernel
+// Chooses the filter kernel to use.  Passing -1, or a kernel that this
+// processor cannot run, picks the best one available.
+//
+// Returns:  The kernel now in use.
+int
+resample_select_kernel(int kernel)
+{
+	if(kernel < 0 || kernel > RESAMPLE_AVX2) kernel = RESAMPLE_AVX2;
+	while(!kernel_supported(kernel)) kernel--;
+
+	selected_kernel = kernel;
+	return kernel;
+}
+
+const char *
+resample_kernel_name(int kernel)
+{
+	switch(kernel) {
+	case RESAMPLE_SCALAR: return "scalar";
+	case RESAMPLE_SSE:    return "sse";
+	case RESAMPLE_AVX2:   return "avx2";
+	}
+
+	return NULL;
+}
+
+static FilterKernel
+get_kernel(void)
+{
+	if(selected_kernel < 0) resample_select_kernel(-1);
+
+	switch(selected_kernel) {
+#ifdef HAVE_AVX2_KERNEL
+	case RESAMPLE_AVX2: return filter_avx2;
+#endif
+#ifdef HAVE_SSE_KERNEL
+	case RESAMPLE_SSE:  return filter_sse;
+#endif
+	}
+
+	return filter_scalar;
+}
+
+// build_filter
+// Tabulates a Blackman windowed sinc low pass filter at every phase.
+// Each phase is normalized so that it has unity gain.
+//
+// Returns:  Non-zero on error.
+static int
+build_filter(float *table, int taps, double cutoff)
+{
+	int p, t;
+	double x, w, h, sum;
+	double *row = malloc(taps * sizeof(double));
+
+	if(row == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for(p=0; p <= RESAMPLE_PHASES; p++) {
+		sum = 0;
+		for(t=0; t < taps; t++) {
+			x = (t - taps / 2 + 1) - (double)p / RESAMPLE_PHASES;
+			w = 0.42 + 0.5 * cos(M_PI * x / (taps / 2)) + 0.08 * cos(2 * M_PI * x / (taps / 2));
+			h = x == 0 ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+			row[t] = h * w;
+			sum += row[t];
+		}
+
+		for(t=0; t < taps; t++) table[(size_t)p * taps + t] = row[t] / sum;
+	}
+
+	free(row);
+	return 0;
+}
+
+// resample_to_8bit
+// Resamples job->in into job->out_length points of job->out.
+//
+// Returns:  Non-zero on error.
+int
+resample_to_8bit(const ResampleJob *job)
+{
+	int taps;
+	uint32_t i, state;
+	double cutoff;
+	float *in, *table, *filtered;
+	float dither, v;
+
+	if(job->out_length == 0) return 0;
+
+	// Shrinking needs a lower cutoff and more taps to reach it.
+	cutoff = job->step > 1 ? 0.95 / job->step : 0.95;
+	taps = 8 * (int)ceil(2 * (job->step > 1 ? job->step : 1));
+	if(taps > RESAMPLE_MAX_TAPS) taps = RESAMPLE_MAX_TAPS;
+
+	// Pad the input so that every tap reads inside the buffer.
+	in = calloc((size_t)job->in_length + taps + 1, sizeof(float));
+	table = malloc((size_t)(RESAMPLE_PHASES + 1) * taps * sizeof(float));
+	filtered = malloc((size_t)job->out_length * sizeof(float));
+	if(in == NULL || table == NULL || filtered == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(in);
+		free(table);
+		free(filtered);
+		return 1;
+	}
+
+	for(i=0; i < job->in_length; i++) in[i + taps / 2] = job->in[i] / 256.0f;
+	if(build_filter(table, taps, cutoff)) {
+		free(in);
+		free(table);
+		free(filtered);
+		return 1;
+	}
+
+	// Output points must not read past the last input point.
+	if((job->out_length - 1) * job->step >= job->in_length + 1) {
+		fprintf(stderr, "Resample output is longer than its input.\n");
+		free(in);
+		free(table);
+		free(filtered);
+		return 1;
+	}
+
+	get_kernel()(in, table, taps, job->step, filtered, job->out_length);
+
+	// Triangular dither of one 8 bit step before rounding.
+	state = job->seed ? job->seed : 1;
+	for(i=0; i < job->out_length; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		dither = (state & 0xFFFF) / 65536.0f - (state >> 16) / 65536.0f;
+
+		v = floorf(filtered[i] + dither + 0.5f);
+		if(v > 127)  v = 127;
+		if(v < -128) v = -128;
+		job->out[i] = (int8_t)v;
+	}
+
+	free(in);
+	free(table);
+	free(filtered);
+
+	return 0;
+}
+
+typedef struct {
+	ResampleJob *jobs;
+	size_t num_jobs;
+	size_t first;
+	size_t stride;
+	int started;
+	int status;
+} ResampleWorker;
+
+static void
+resample_worker(void *arg)
+{
+	ResampleWorker *worker = arg;
+	size_t i;
+
+	for(i = worker->first; i < worker->num_jobs; i += worker->stride) {
+		if(resample_to_8bit(&worker->jobs[i])) worker->status = 1;
+	}
+}
+
+// resample_batch
+// Runs every job, spread over num_threads threads.  Passing 0 uses one
+// thread per processor.
+//
+// Returns:  Non-zero if any job failed.
+int
+resample_batch(ResampleJob *jobs, size_t num_jobs, int num_threads)
+{
+	ResampleWorker *workers;
+	Thread *threads;
+	size_t i;
+	int status = 0;
+
+	if(num_threads <= 0) num_threads = thread_count();
+	if((size_t)num_threads > num_jobs) num_threads = num_jobs;
+	if(num_threads <= 1) {
+		for(i=0; i < num_jobs; i++) status |= resample_to_8bit(&jobs[i]);
+		return status;
+	}
+
+	// Pick the kernel before any thread needs it.
+	get_kernel();
+
+	workers = calloc(num_threads, sizeof(ResampleWorker));
+	threads = calloc(num_threads, sizeof(Thread));
+	if(workers == NULL || threads == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(workers);
+		free(threads);
+		return 1;
+	}
+
+	for(i=0; i < (size_t)num_threads; i++) {
+		workers[i].jobs = jobs;
+		workers[i].num_jobs = num_jobs;
+		workers[i].first = i;
+		workers[i].stride = num_threads;
+
+		// Do the work here if a thread cannot be had.
+		workers[i].started = !thread_create(&threads[i], resample_worker, &workers[i]);
+		if(!workers[i].started) resample_worker(&workers[i]);
+	}
+
+	for(i=0; i < (size_t)num_threads; i++) {
+		if(workers[i].started) thread_join(threads[i]);
+		status |= workers[i].status;
+	}
+
+	free(workers);
+	free(threads);
+
+	return status;
+}
@@ -0,0 +1,34 @@
+/*
+ * resample.h
+ *
+ * Polyphase resampling of 16 bit samples down to dithered 8 bit MOD
+ * sample data.
+ *
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define RESAMPLE_SCALAR 0
+#define RESAMPLE_SSE    1
+#define RESAMPLE_AVX2   2
+
+typedef struct {
+	const int16_t *in;
+	uint32_t in_length;
+	double step;           // Input points per output point.
+	int8_t *out;
+	uint32_t out_length;
+	uint32_t seed;         // Dither seed, so output is reproducible.
+} ResampleJob;
+
+int resample_to_8bit(const ResampleJob *);
+int resample_batch(ResampleJob *, size_t num_jobs, int num_threads);
+
+int resample_select_kernel(int kernel);
+const char *resample_kernel_name(int kernel);
+
+#endif /* RESAMPLE_H */
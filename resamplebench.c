@@ -0,0 +1,86 @@
+/*
+ * resamplebench.c
+ *
+ * Measures resampler throughput for each available kernel.
+ *
+ *   resamplebench [num_samples] [num_threads]
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "resample.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define BENCH_IN_LENGTH 44100
+
+static double
+seconds(void)
+{
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+	int num_samples = argc > 1 ? atoi(argv[1]) : 64;
+	int num_threads = argc > 2 ? atoi(argv[2]) : 0;
+	int16_t *wave;
+	ResampleJob *jobs;
+	int i, kernel, selected;
+	double start, elapsed;
+	uint64_t points;
+
+	if(num_samples <= 0) num_samples = 64;
+
+	wave = malloc(BENCH_IN_LENGTH * sizeof(int16_t));
+	jobs = calloc(num_samples, sizeof(ResampleJob));
+	if(wave == NULL || jobs == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for(i=0; i < BENCH_IN_LENGTH; i++)
+		wave[i] = 20000 * sin(2 * M_PI * 440 * i / 44100.0);
+
+	// A spread of rates, from shrinking 44.1kHz samples to growing them.
+	points = 0;
+	for(i=0; i < num_samples; i++) {
+		jobs[i].in = wave;
+		jobs[i].in_length = BENCH_IN_LENGTH;
+		jobs[i].step = 0.5 + 5.0 * i / num_samples;
+		jobs[i].out_length = (BENCH_IN_LENGTH - 1) / jobs[i].step;
+		jobs[i].out = malloc(jobs[i].out_length);
+		jobs[i].seed = i + 1;
+		if(jobs[i].out == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+		points += jobs[i].out_length;
+	}
+
+	for(kernel = RESAMPLE_SCALAR; kernel <= RESAMPLE_AVX2; kernel++) {
+		selected = resample_select_kernel(kernel);
+		if(selected != kernel) continue;
+
+		start = seconds();
+		if(resample_batch(jobs, num_samples, num_threads)) return 1;
+		elapsed = seconds() - start;
+
+		// clock() counts every thread's time, so this is per core.
+		printf("%-8s %d samples, %"PRIu64" points, %.3f cpu s, %.1f Mpoints/cpu s\n",
+			resample_kernel_name(kernel), num_samples, points, elapsed,
+			elapsed > 0 ? points / elapsed / 1e6 : 0);
+	}
+
+	for(i=0; i < num_samples; i++) free(jobs[i].out);
+	free(jobs);
+	free(wave);
+
+	return 0;
+}
@@ -0,0 +1,736 @@
+/*
+ * sf2.c
+ *
+ * Reads instrument samples out of a SoundFont 2 file for use as MOD
+ * samples.  The file is memory mapped and only the samples for patches
+ * that a midi actually uses are ever decoded.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "midi.h"
+#include "mod.h"
+#include "sf2.h"
+#include "resample.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SF2_GEN_INSTRUMENT    41
+#define SF2_GEN_KEYRANGE      43
+#define SF2_GEN_SAMPLEID      53
+#define SF2_GEN_SAMPLEMODES   54
+#define SF2_GEN_ROOTKEY       58
+
+#define SF2_PHDR_SIZE  38
+#define SF2_BAG_SIZE    4
+#define SF2_GEN_SIZE    4
+#define SF2_INST_SIZE  22
+#define SF2_SHDR_SIZE  46
+
+// Samples 1, 30 and 31 keep the default waves: 1 plays the patches the
+// soundfont has no sample for, and 30 notes above the period table.
+#define SF2_FIRST_MOD_SAMPLE 2
+#define SF2_MAX_MOD_SAMPLES 28
+
+// Largest sample a MOD can hold, in bytes.
+#define MOD_MAX_SAMPLE_LENGTH 131070
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t size;
+} Sf2Chunk;
+
+typedef struct {
+	Sf2Chunk phdr, pbag, pgen, inst, ibag, igen, shdr;
+} Sf2Hydra;
+
+static uint16_t
+le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int
+map_soundfont(SoundFont *sf, const char *filename)
+{
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+	LARGE_INTEGER size;
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Unable to open soundfont %s.\n", filename);
+		return 1;
+	}
+
+	if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		fprintf(stderr, "Unable to read soundfont %s.\n", filename);
+		CloseHandle(file);
+		return 1;
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping == NULL) {
+		fprintf(stderr, "Unable to map soundfont %s.\n", filename);
+		CloseHandle(file);
+		return 1;
+	}
+
+	sf->map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(sf->map == NULL) {
+		fprintf(stderr, "Unable to map soundfont %s.\n", filename);
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return 1;
+	}
+
+	sf->map_size = (size_t)size.QuadPart;
+	sf->file_handle = file;
+	sf->mapping_handle = mapping;
+#else
+	int fd;
+	struct stat st;
+	void *map;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "Unable to open soundfont %s.\n", filename);
+		return 1;
+	}
+
+	if(fstat(fd, &st) || st.st_size == 0) {
+		fprintf(stderr, "Unable to read soundfont %s.\n", filename);
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map soundfont %s.\n", filename);
+		return 1;
+	}
+
+	sf->map = map;
+	sf->map_size = st.st_size;
+#endif
+
+	return 0;
+}
+
+static void
+unmap_soundfont(SoundFont *sf)
+{
+	if(sf->map == NULL) return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(sf->map);
+	CloseHandle(sf->mapping_handle);
+	CloseHandle(sf->file_handle);
+#else
+	munmap((void *)sf->map, sf->map_size);
+#endif
+
+	sf->map = NULL;
+}
+
+// read_list
+// Finds the named sub-chunks of a LIST chunk.
+static void
+read_list(const uint8_t *head, const uint8_t *end, const char *names[], Sf2Chunk *chunks[], int num_names)
+{
+	uint32_t size;
+	int i;
+
+	while(head + 8 <= end) {
+		size = le32(head + 4);
+		if(size > (size_t)(end - head - 8)) break;
+
+		for(i=0; i < num_names; i++) {
+			if(!memcmp(head, names[i], 4)) {
+				chunks[i]->data = head + 8;
+				chunks[i]->size = size;
+			}
+		}
+
+		head += 8 + size + (size & 1);
+	}
+}
+
+static int
+add_region(SoundFont *sf, uint32_t *capacity, const Sf2Region *region)
+{
+	Sf2Region *regions;
+
+	if(sf->num_regions == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		regions = realloc(sf->regions, *capacity * sizeof(Sf2Region));
+		if(regions == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+		sf->regions = regions;
+	}
+
+	sf->regions[sf->num_regions++] = *region;
+	return 0;
+}
+
+// add_instrument_regions
+// Adds a region for every zone of instrument inst that overlaps the
+// preset zone's key range lo to hi.
+static int
+add_instrument_regions(SoundFont *sf, uint32_t *capacity, const Sf2Hydra *h, uint16_t inst, uint8_t lo, uint8_t hi)
+{
+	uint32_t num_inst = h->inst.size / SF2_INST_SIZE;
+	uint32_t num_bags = h->ibag.size / SF2_BAG_SIZE;
+	uint32_t num_gens = h->igen.size / SF2_GEN_SIZE;
+	uint32_t b, g, bag_first, bag_last, gen_first, gen_last;
+	const uint8_t *gen;
+	Sf2Region global, region;
+	int sample;
+
+	if((uint32_t)inst + 1 >= num_inst) return 0;
+
+	bag_first = le16(h->inst.data + inst * SF2_INST_SIZE + 20);
+	bag_last = le16(h->inst.data + (inst + 1) * SF2_INST_SIZE + 20);
+	if(bag_last >= num_bags) bag_last = num_bags - 1;
+
+	global.key_lo = 0;
+	global.key_hi = 127;
+	global.root_key = 255;
+	global.loop = 0;
+
+	for(b = bag_first; b < bag_last; b++) {
+		gen_first = le16(h->ibag.data + b * SF2_BAG_SIZE);
+		gen_last = le16(h->ibag.data + (b + 1) * SF2_BAG_SIZE);
+		if(gen_last > num_gens) gen_last = num_gens;
+
+		region = global;
+		sample = -1;
+		for(g = gen_first; g < gen_last; g++) {
+			gen = h->igen.data + g * SF2_GEN_SIZE;
+			switch(le16(gen)) {
+			case SF2_GEN_KEYRANGE:
+				region.key_lo = gen[2];
+				region.key_hi = gen[3];
+				break;
+			case SF2_GEN_ROOTKEY:
+				region.root_key = gen[2];
+				break;
+			case SF2_GEN_SAMPLEMODES:
+				region.loop = gen[2] & 1;
+				break;
+			case SF2_GEN_SAMPLEID:
+				sample = le16(gen + 2);
+				break;
+			}
+		}
+
+		// A first zone without a sample is the global zone.
+		if(sample < 0) {
+			if(b == bag_first) global = region;
+			continue;
+		}
+		if((uint32_t)sample >= sf->num_samples) continue;
+
+		if(region.key_lo < lo) region.key_lo = lo;
+		if(region.key_hi > hi) region.key_hi = hi;
+		if(region.key_lo > region.key_hi) continue;
+
+		if(region.root_key > 127) region.root_key = sf->samples[sample].original_pitch;
+		if(region.root_key > 127) region.root_key = 60;
+		region.sample = sample;
+
+		if(add_region(sf, capacity, &region)) return 1;
+	}
+
+	return 0;
+}
+
+// build_regions
+// Flattens every bank 0 preset into a list of key ranges, grouped by
+// program number.
+static int
+build_regions(SoundFont *sf, const Sf2Hydra *h)
+{
+	uint32_t num_presets = h->phdr.size / SF2_PHDR_SIZE;
+	uint32_t num_bags = h->pbag.size / SF2_BAG_SIZE;
+	uint32_t num_gens = h->pgen.size / SF2_GEN_SIZE;
+	uint32_t capacity = 0;
+	uint32_t p, b, g, bag_first, bag_last, gen_first, gen_last;
+	uint16_t program;
+	const uint8_t *preset;
+	const uint8_t *gen;
+	uint8_t global_lo, global_hi, lo, hi;
+	int inst;
+
+	// The last preset header only terminates the list.
+	for(p=0; p + 1 < num_presets; p++) {
+		preset = h->phdr.data + p * SF2_PHDR_SIZE;
+		program = le16(preset + 20);
+		if(le16(preset + 22) != 0 || program > 127 || sf->preset_count[program]) continue;
+
+		memcpy(sf->preset_names[program], preset, 20);
+		sf->preset_names[program][20] = 0;
+		sf->preset_first[program] = sf->num_regions;
+
+		bag_first = le16(preset + 24);
+		bag_last = le16(preset + SF2_PHDR_SIZE + 24);
+		if(bag_last >= num_bags) bag_last = num_bags - 1;
+
+		global_lo = 0;
+		global_hi = 127;
+		for(b = bag_first; b < bag_last; b++) {
+			gen_first = le16(h->pbag.data + b * SF2_BAG_SIZE);
+			gen_last = le16(h->pbag.data + (b + 1) * SF2_BAG_SIZE);
+			if(gen_last > num_gens) gen_last = num_gens;
+
+			lo = global_lo;
+			hi = global_hi;
+			inst = -1;
+			for(g = gen_first; g < gen_last; g++) {
+				gen = h->pgen.data + g * SF2_GEN_SIZE;
+				if(le16(gen) == SF2_GEN_KEYRANGE) {
+					lo = gen[2];
+					hi = gen[3];
+				} else if(le16(gen) == SF2_GEN_INSTRUMENT) {
+					inst = le16(gen + 2);
+				}
+			}
+
+			if(inst < 0) {
+				if(b == bag_first) {
+					global_lo = lo;
+					global_hi = hi;
+				}
+				continue;
+			}
+
+			if(add_instrument_regions(sf, &capacity, h, inst, lo, hi)) return 1;
+		}
+
+		sf->preset_count[program] = sf->num_regions - sf->preset_first[program];
+	}
+
+	return 0;
+}
+
+int
+read_soundfont(SoundFont *sf, const char *filename)
+{
+	const uint8_t *head;
+	const uint8_t *end;
+	const uint8_t *shdr;
+	uint32_t size;
+	uint32_t i;
+	Sf2Chunk smpl;
+	Sf2Hydra h;
+	Sf2Sample *sample;
+	const char *sdta_names[] = {"smpl"};
+	Sf2Chunk *sdta_chunks[] = {&smpl};
+	const char *pdta_names[] = {"phdr", "pbag", "pgen", "inst", "ibag", "igen", "shdr"};
+	Sf2Chunk *pdta_chunks[] = {&h.phdr, &h.pbag, &h.pgen, &h.inst, &h.ibag, &h.igen, &h.shdr};
+
+	memset(sf, 0, sizeof(SoundFont));
+	memset(&smpl, 0, sizeof(smpl));
+	memset(&h, 0, sizeof(h));
+
+	if(map_soundfont(sf, filename)) return 1;
+
+	if(sf->map_size < 12 || memcmp(sf->map, "RIFF", 4) || memcmp(sf->map + 8, "sfbk", 4)) {
+		fprintf(stderr, "Not a soundfont file.\n");
+		destroy_soundfont(sf);
+		return 1;
+	}
+
+	end = sf->map + sf->map_size;
+	if(le32(sf->map + 4) < sf->map_size - 8) end = sf->map + 8 + le32(sf->map + 4);
+
+	head = sf->map + 12;
+	while(head + 12 <= end) {
+		size = le32(head + 4);
+		if(size > (size_t)(end - head - 8)) break;
+
+		if(!memcmp(head, "LIST", 4)) {
+			if(!memcmp(head + 8, "sdta", 4))
+				read_list(head + 12, head + 8 + size, sdta_names, sdta_chunks, 1);
+			else if(!memcmp(head + 8, "pdta", 4))
+				read_list(head + 12, head + 8 + size, pdta_names, pdta_chunks, 7);
+		}
+
+		head += 8 + size + (size & 1);
+	}
+
+	if(smpl.data == NULL || h.phdr.data == NULL || h.pbag.data == NULL || h.pgen.data == NULL ||
+	   h.inst.data == NULL || h.ibag.data == NULL || h.igen.data == NULL || h.shdr.data == NULL) {
+		fprintf(stderr, "Soundfont is missing sample or preset data.\n");
+		destroy_soundfont(sf);
+		return 1;
+	}
+
+	// Zones are walked up to the next one's first bag or generator, so
+	// every list needs a zone and the record that ends it.
+	if(h.pbag.size < 2 * SF2_BAG_SIZE || h.pgen.size < 2 * SF2_GEN_SIZE ||
+	   h.ibag.size < 2 * SF2_BAG_SIZE || h.igen.size < 2 * SF2_GEN_SIZE) {
+		fprintf(stderr, "Soundfont has no preset or instrument zones.\n");
+		destroy_soundfont(sf);
+		return 1;
+	}
+
+	sf->sample_data = smpl.data;
+	sf->num_sample_points = smpl.size / 2;
+
+	// The last sample header only terminates the list.
+	sf->num_samples = h.shdr.size / SF2_SHDR_SIZE;
+	if(sf->num_samples) sf->num_samples--;
+	sf->samples = calloc(sf->num_samples ? sf->num_samples : 1, sizeof(Sf2Sample));
+	if(sf->samples == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		destroy_soundfont(sf);
+		return 1;
+	}
+
+	for(i=0; i < sf->num_samples; i++) {
+		shdr = h.shdr.data + i * SF2_SHDR_SIZE;
+		sample = &sf->samples[i];
+		memcpy(sample->name, shdr, 20);
+		sample->start = le32(shdr + 20);
+		sample->end = le32(shdr + 24);
+		sample->loop_start = le32(shdr + 28);
+		sample->loop_end = le32(shdr + 32);
+		sample->sample_rate = le32(shdr + 36);
+		sample->original_pitch = shdr[40];
+		sample->pitch_correction = (int8_t)shdr[41];
+
+		// Treat samples pointing outside of smpl as empty.
+		if(sample->end > sf->num_sample_points || sample->start > sample->end || !sample->sample_rate)
+			sample->end = sample->start = 0;
+	}
+
+	if(build_regions(sf, &h)) {
+		destroy_soundfont(sf);
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+destroy_soundfont(SoundFont *sf)
+{
+	size_t i;
+	for(i=0; i < sf->num_cached; i++) {
+		free(sf->cache[i].data);
+	}
+
+	free(sf->cache);
+	free(sf->regions);
+	free(sf->samples);
+	unmap_soundfont(sf);
+
+	sf->cache = NULL;
+	sf->regions = NULL;
+	sf->samples = NULL;
+	sf->num_cached = 0;
+	sf->num_regions = 0;
+	sf->num_samples = 0;
+}
+
+// find_soundfont_region
+// Finds the region of program that plays note, or the nearest one if no
+// region covers it.
+//
+// Returns:  NULL if the soundfont has no such program.
+const Sf2Region *
+find_soundfont_region(const SoundFont *sf, int program, int note)
+{
+	const Sf2Region *region;
+	const Sf2Region *best = NULL;
+	int distance, best_distance = 256;
+	uint32_t i;
+
+	for(i=0; i < sf->preset_count[program]; i++) {
+		region = &sf->regions[sf->preset_first[program] + i];
+
+		if(note < region->key_lo)      distance = region->key_lo - note;
+		else if(note > region->key_hi) distance = note - region->key_hi;
+		else return region;
+
+		if(distance < best_distance) {
+			best = region;
+			best_distance = distance;
+		}
+	}
+
+	return best;
+}
+
+static int16_t
+sample_point(const SoundFont *sf, uint32_t i)
+{
+	return (int16_t)le16(sf->sample_data + 2 * (size_t)i);
+}
+
+// prepare_sample
+// Works out the size and loop of a region's sample at rate samples per
+// second and sets up the job that converts it.
+//
+// Returns:  Non-zero on error.
+static int
+prepare_sample(const SoundFont *sf, const Sf2Region *region, double rate, Sf2CacheEntry *entry, ResampleJob *job)
+{
+	const Sf2Sample *sample = &sf->samples[region->sample];
+	double step;
+	uint32_t i, length, loop_start, loop_end;
+	int16_t *in;
+
+	// Number of source points per output point.
+	step = sample->sample_rate / rate;
+	length = (sample->end - sample->start) / step;
+
+	loop_start = loop_end = 0;
+	if(region->loop && sample->loop_start >= sample->start && sample->loop_end <= sample->end &&
+	   sample->loop_start < sample->loop_end) {
+		loop_start = (sample->loop_start - sample->start) / step;
+		loop_end = (sample->loop_end - sample->start) / step;
+
+		// Nothing after the end of the loop is ever heard.
+		length = loop_end;
+	}
+
+	if(length > MOD_MAX_SAMPLE_LENGTH) length = MOD_MAX_SAMPLE_LENGTH;
+	if(loop_end > length) loop_end = length;
+	length &= ~1u;
+	loop_start &= ~1u;
+	loop_end &= ~1u;
+	if(loop_start >= loop_end) loop_start = loop_end = 0;
+
+	entry->sample = region->sample;
+	entry->loop = region->loop;
+	entry->rate = rate;
+	entry->length = length;
+	entry->loop_start = loop_start;
+	entry->loop_length = loop_end - loop_start;
+	entry->data = calloc(length ? length : 2, sizeof(int8_t));
+
+	// The resampler wants the points in host order.
+	job->in_length = sample->end - sample->start;
+	in = malloc((job->in_length ? job->in_length : 1) * sizeof(int16_t));
+	if(entry->data == NULL || in == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(entry->data);
+		free(in);
+		return 1;
+	}
+	for(i=0; i < job->in_length; i++) in[i] = sample_point(sf, sample->start + i);
+
+	job->in = in;
+	job->step = step;
+	job->out = entry->data;
+	job->out_length = length;
+	job->seed = region->sample + 1;
+
+	return 0;
+}
+
+static Sf2CacheEntry *
+find_cached_sample(const SoundFont *sf, const Sf2Region *region, double rate)
+{
+	size_t n;
+	for(n=0; n < sf->num_cached; n++) {
+		if(sf->cache[n].sample == region->sample &&
+		   sf->cache[n].loop == region->loop &&
+		   sf->cache[n].rate == rate)
+			return &sf->cache[n];
+	}
+
+	return NULL;
+}
+
+// cache_sample
+// Keeps a converted sample for later calls.
+//
+// Returns:  NULL on error, in which case the entry's data is freed.
+static Sf2CacheEntry *
+cache_sample(SoundFont *sf, Sf2CacheEntry *entry)
+{
+	Sf2CacheEntry *cache;
+
+	// Non-looping samples start with a silent word.
+	if(!entry->loop_length && entry->length >= 2) entry->data[0] = entry->data[1] = 0;
+
+	cache = realloc(sf->cache, (sf->num_cached + 1) * sizeof(Sf2CacheEntry));
+	if(cache == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(entry->data);
+		return NULL;
+	}
+	sf->cache = cache;
+	sf->cache[sf->num_cached] = *entry;
+
+	return &sf->cache[sf->num_cached++];
+}
+
+// extract_soundfont_sample
+// Converts the sample of a region to 8 bits at rate samples per second,
+// or returns the copy made by an earlier call.
+//
+// Returns:  NULL on error.
+const Sf2CacheEntry *
+extract_soundfont_sample(SoundFont *sf, const Sf2Region *region, double rate)
+{
+	Sf2CacheEntry entry;
+	Sf2CacheEntry *cached;
+	ResampleJob job;
+	int status;
+
+	cached = find_cached_sample(sf, region, rate);
+	if(cached) return cached;
+
+	if(prepare_sample(sf, region, rate, &entry, &job)) return NULL;
+	status = resample_to_8bit(&job);
+	free((void *)job.in);
+	if(status) {
+		free(entry.data);
+		return NULL;
+	}
+
+	return cache_sample(sf, &entry);
+}
+
+// fit_period_table
+// Finds the number of octaves, in semitones, that a patch playing notes
+// min to max has to be moved by to fit within the period table.
+static int
+fit_period_table(int min, int max)
+{
+	int transpose = 0;
+
+	while(max + transpose > MOD_HIGHEST_NOTE) transpose -= 12;
+	while(min + transpose < MOD_LOWEST_NOTE && max + transpose + 12 <= MOD_HIGHEST_NOTE) transpose += 12;
+
+	return transpose;
+}
+
+// soundfont_to_mod
+// Gives every patch used in midi a MOD sample from the soundfont.
+//
+// Each sample is resampled so that the patch's notes, moved by whole
+// octaves if needed, fall within the period table.  Patches that the
+// soundfont does not have keep the default sample.
+int
+soundfont_to_mod(Mod *mod, const Midi *midi, SoundFont *sf)
+{
+	const MidiPatch *patch;
+	const Sf2Region *region[128];
+	const Sf2CacheEntry *entry;
+	ModSample *mod_sample;
+	int p, q, min, max, num_jobs;
+	int transpose[128];
+	int slot = SF2_FIRST_MOD_SAMPLE;
+	int status = 0;
+	double root, rate[128];
+	Sf2CacheEntry pending[SF2_MAX_MOD_SAMPLES];
+	ResampleJob jobs[SF2_MAX_MOD_SAMPLES];
+
+	// Find every patch's sample and the rate it is needed at.
+	for(p=0; p < 128; p++) {
+		patch = &midi->patches[p];
+		region[p] = NULL;
+		if(!patch->used) continue;
+
+		if(slot - SF2_FIRST_MOD_SAMPLE == SF2_MAX_MOD_SAMPLES) {
+			fprintf(stderr, "Too many patches, %s keeps the default sample.\n", MIDI_PATCH_NAMES[p]);
+			continue;
+		}
+
+		min = patch->min;
+		max = patch->max;
+		if(!max) min = max = 60;
+
+		region[p] = find_soundfont_region(sf, p, (min + max) / 2);
+		if(region[p] == NULL) {
+			fprintf(stderr, "Soundfont has no %s.\n", MIDI_PATCH_NAMES[p]);
+			continue;
+		}
+
+		transpose[p] = fit_period_table(min, max);
+		root = region[p]->root_key - sf->samples[region[p]->sample].pitch_correction / 100.0;
+		rate[p] = MOD_PAL_CLOCK / (double)MOD_BASE_PERIOD * pow(2, (transpose[p] + root - MOD_BASE_NOTE) / 12.0);
+		slot++;
+	}
+
+	// Convert all of the samples that are not cached yet at once.
+	num_jobs = 0;
+	for(p=0; p < 128; p++) {
+		if(region[p] == NULL || find_cached_sample(sf, region[p], rate[p])) continue;
+
+		for(q=0; q < p; q++) {
+			if(region[q] && region[q]->sample == region[p]->sample &&
+			   region[q]->loop == region[p]->loop && rate[q] == rate[p]) break;
+		}
+		if(q < p) continue;
+
+		if(prepare_sample(sf, region[p], rate[p], &pending[num_jobs], &jobs[num_jobs])) {
+			status = 1;
+			break;
+		}
+		num_jobs++;
+	}
+
+	if(!status) status = resample_batch(jobs, num_jobs, 0);
+
+	for(q=0; q < num_jobs; q++) {
+		free((void *)jobs[q].in);
+		if(status) free(pending[q].data);
+		else if(cache_sample(sf, &pending[q]) == NULL) status = 1;
+	}
+	if(status) return 1;
+
+	slot = SF2_FIRST_MOD_SAMPLE;
+	for(p=0; p < 128; p++) {
+		if(region[p] == NULL) continue;
+
+		entry = extract_soundfont_sample(sf, region[p], rate[p]);
+		if(entry == NULL) return 1;
+
+		mod_sample = calloc(1, sizeof(ModSample));
+		if(mod_sample == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+
+		strncpy(mod_sample->name, sf->preset_names[p], 22);
+		mod_sample->length = entry->length / 2;
+		mod_sample->volume = 64;
+		mod_sample->repeat_offset = entry->loop_start / 2;
+		mod_sample->repeat_length = entry->loop_length ? entry->loop_length / 2 : 1;
+		mod_sample->transpose = transpose[p];
+		mod_sample->data = entry->data;
+
+		mod->samples[slot] = mod_sample;
+		mod->patch_sample[p] = slot;
+		slot++;
+	}
+
+	return 0;
+}
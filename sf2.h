@@ -0,0 +1,81 @@
+/*
+ * sf2.h
+ *
+ * SoundFont 2 sample bank.
+ *
+ */
+
+#ifndef SF2_H
+#define SF2_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "midi.h"
+#include "mod.h"
+
+typedef struct {
+	char name[21];
+	uint32_t start;            // In sample points from the start of smpl.
+	uint32_t end;
+	uint32_t loop_start;
+	uint32_t loop_end;
+	uint32_t sample_rate;
+	uint8_t original_pitch;    // Midi note the sample was recorded at.
+	int8_t pitch_correction;   // In cents.
+} Sf2Sample;
+
+// One key range of a General MIDI program, flattened from the
+// preset -> instrument -> sample hierarchy.
+typedef struct {
+	uint8_t key_lo;
+	uint8_t key_hi;
+	uint8_t root_key;
+	uint8_t loop;              // Whether or not the sample loops.
+	uint16_t sample;           // Index into samples.
+} Sf2Region;
+
+// A sample that has already been converted to 8 bits at a given rate.
+typedef struct {
+	uint16_t sample;
+	uint8_t loop;
+	double rate;
+	int8_t *data;
+	uint32_t length;           // In bytes, always even.
+	uint32_t loop_start;       // In bytes.
+	uint32_t loop_length;      // In bytes, 0 if the sample does not loop.
+} Sf2CacheEntry;
+
+typedef struct {
+	const uint8_t *map;
+	size_t map_size;
+	void *file_handle;         // Platform handles kept for unmapping.
+	void *mapping_handle;
+
+	const uint8_t *sample_data; // 16 bit little endian points from smpl.
+	uint32_t num_sample_points;
+
+	uint32_t num_samples;
+	Sf2Sample *samples;
+
+	uint32_t num_regions;
+	Sf2Region *regions;
+	uint32_t preset_first[128]; // First region of each program in bank 0.
+	uint32_t preset_count[128];
+	char preset_names[128][21];
+
+	// Samples extracted so far.  Kept for the life of the soundfont so
+	// that conversions sharing instruments reuse them.
+	size_t num_cached;
+	Sf2CacheEntry *cache;
+} SoundFont;
+
+int read_soundfont(SoundFont *, const char *filename);
+void destroy_soundfont(SoundFont *);
+
+const Sf2Region *find_soundfont_region(const SoundFont *, int program, int note);
+const Sf2CacheEntry *extract_soundfont_sample(SoundFont *, const Sf2Region *, double rate);
+
+int soundfont_to_mod(Mod *, const Midi *, SoundFont *);
+
+#endif /* SF2_H */
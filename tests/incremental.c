@@ -0,0 +1,147 @@
+/*
+ * incremental.c
+ *
+ * Checks that midi_to_mod_incremental, converting a song again after it
+ * has been edited, writes the same mod byte for byte as midi_to_mod
+ * converting it from scratch, and that it only converts the patterns
+ * that the edit changed.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midi.h"
+#include "midistream.h"
+#include "mod.h"
+#include "testsong.h"
+
+// check_conversion
+// Converts notes incrementally, into mod and incremental, and from
+// scratch, and compares the two.
+//
+// Returns:  Non-zero if they differ, or more than most_converted
+//           patterns were converted again.
+static int
+check_conversion(const char *what, const SongNote *notes, size_t num_notes, const MidiToModOptions *options,
+                 Mod *mod, ModIncremental *incremental, int most_converted)
+{
+	uint8_t *song, *full;
+	size_t song_size, full_size;
+	Midi midi;
+	Mod scratch;
+	int status = 0;
+
+	song = malloc(SONG_OVERHEAD + 8 * num_notes);
+	if(song == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	song_size = make_song(notes, num_notes, song);
+	if(read_midi_from_memory(&midi, song, song_size, NULL)) {
+		fprintf(stderr, "%s: the song could not be read.\n", what);
+		free(song);
+		return 1;
+	}
+	free(song);
+
+	memset(&scratch, 0, sizeof(scratch));
+	if(midi_to_mod_incremental(mod, &midi, options, incremental) ||
+	   midi_to_mod(&scratch, &midi, options) ||
+	   encode_mod_file(&scratch, NULL, &full, &full_size)) {
+		fprintf(stderr, "%s: conversion failed.\n", what);
+		destroy_mod(&scratch);
+		destroy_midi(&midi);
+		return 1;
+	}
+
+	if(full_size != incremental->file_size || memcmp(full, incremental->file, full_size)) {
+		fprintf(stderr, "%s: incremental conversion differs from converting from scratch.\n", what);
+		status = 1;
+	} else if(incremental->patterns_converted > most_converted) {
+		fprintf(stderr, "%s: converted %d of %d patterns again, expected at most %d.\n", what,
+		        incremental->patterns_converted, incremental->num_patterns, most_converted);
+		status = 1;
+	}
+	printf("%s: converted %d of %d patterns.\n", what, incremental->patterns_converted, incremental->num_patterns);
+
+	free(full);
+	destroy_mod(&scratch);
+	destroy_midi(&midi);
+
+	return status;
+}
+
+// patterns_after
+// Returns:  How many patterns a song of num_notes has from the one
+//           before note's to its end: the most that an edit at note
+//           should convert again, as the note before it can sound on
+//           into note's pattern.
+static int
+patterns_after(size_t note, size_t num_notes, size_t notes_per_pattern)
+{
+	size_t first = note / notes_per_pattern;
+	size_t total = (num_notes + notes_per_pattern - 1) / notes_per_pattern;
+
+	return (int)(total - (first > 0 ? first - 1 : 0));
+}
+
+int main(void)
+{
+	// Enough notes to fill more than a few patterns.
+	enum {NUM_NOTES = 16 * 80};
+	static SongNote notes[NUM_NOTES + 64];
+	MidiToModOptions options;
+	ModIncremental incremental;
+	Mod mod;
+	size_t i, per_pattern;
+	int failed = 0;
+
+	for(i=0; i < NUM_NOTES + 64; i++) {
+		notes[i].channel = (i / 4) % 2;
+		notes[i].note = 36 + (i * 7) % 48;
+		notes[i].velocity = 64 + i % 64;
+	}
+
+	init_midi_to_mod_options(&options);
+	init_mod_incremental(&incremental);
+	memset(&mod, 0, sizeof(mod));
+
+	failed |= check_conversion("first", notes, NUM_NOTES, &options, &mod, &incremental, 128);
+	per_pattern = NUM_NOTES / (incremental.num_patterns ? incremental.num_patterns : 1);
+	failed |= check_conversion("unchanged", notes, NUM_NOTES, &options, &mod, &incremental, 0);
+
+	notes[NUM_NOTES / 2].velocity = 5;
+	failed |= check_conversion("velocity", notes, NUM_NOTES, &options, &mod, &incremental, 1);
+
+	// The note it was can end in the next pattern.
+	notes[NUM_NOTES / 3].note += 5;
+	failed |= check_conversion("note", notes, NUM_NOTES, &options, &mod, &incremental, 2);
+
+	// A note on the other channel changes what plays after it.
+	notes[NUM_NOTES / 4].channel ^= 1;
+	failed |= check_conversion("channel", notes, NUM_NOTES, &options, &mod, &incremental,
+	                           patterns_after(NUM_NOTES / 4, NUM_NOTES, per_pattern));
+
+	failed |= check_conversion("appended", notes, NUM_NOTES + 64, &options, &mod, &incremental,
+	                           patterns_after(NUM_NOTES, NUM_NOTES + 64, per_pattern));
+	failed |= check_conversion("shortened", notes, NUM_NOTES - 64, &options, &mod, &incremental,
+	                           patterns_after(NUM_NOTES - 64, NUM_NOTES - 64, per_pattern));
+
+	// Every pattern is laid out again.
+	options.num_channels = 5;
+	failed |= check_conversion("5 channels", notes, NUM_NOTES, &options, &mod, &incremental,
+	                           patterns_after(0, NUM_NOTES, per_pattern));
+	options.max_patterns = 10;
+	failed |= check_conversion("10 patterns", notes, NUM_NOTES, &options, &mod, &incremental, 10);
+	notes[NUM_NOTES - 1].velocity = 1;
+	failed |= check_conversion("past the end", notes, NUM_NOTES, &options, &mod, &incremental, 0);
+
+	destroy_mod_incremental(&incremental);
+	destroy_mod(&mod);
+
+	if(failed) return 1;
+	printf("Incremental conversion matches.\n");
+	return 0;
+}
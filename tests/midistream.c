@@ -0,0 +1,152 @@
+/*
+ * midistream.c
+ *
+ * Checks the stream parser against a track that leans on running
+ * status, for commands with one data byte and with two.  The track is
+ * fed whole, then a byte at a time, and must give the same events
+ * either way.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midi.h"
+#include "midistream.h"
+
+static const uint8_t SONG[] = {
+	'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+	'M', 'T', 'r', 'k', 0, 0, 0, 28,
+	0,  0xC0, 5,            // Patch change.
+	0,  6,                  // Patch change, running status.
+	0,  0xD1, 40,           // Channel aftertouch.
+	10, 41,                 // Channel aftertouch, running status.
+	0,  0x90, 60, 100,      // Note on.
+	10, 62, 90,             // Note on, running status.
+	10, 0x80, 60, 0,        // Note off.
+	0,  62, 0,              // Note off, running status.
+	0,  0xFF, 0x2F, 0};     // End of track.
+
+typedef struct {
+	uint32_t delta_time;
+	uint8_t type;
+	uint8_t command;
+	uint8_t channel;
+	uint8_t data[2];        // Patch or note, then velocity.
+} ExpectedEvent;
+
+static const ExpectedEvent EXPECTED[] = {
+	{0,  MIDI_EVENT,      MIDI_PATCHCHANGE,         0, {5}},
+	{0,  MIDI_EVENT,      MIDI_PATCHCHANGE,         0, {6}},
+	{0,  MIDI_EVENT,      MIDI_CHANNELAFTERTOUCH,   1, {0}},
+	{10, MIDI_EVENT,      MIDI_CHANNELAFTERTOUCH,   1, {0}},
+	{0,  MIDI_EVENT,      MIDI_NOTEON,              0, {60, 100}},
+	{10, MIDI_EVENT,      MIDI_NOTEON,              0, {62, 90}},
+	{10, MIDI_EVENT,      MIDI_NOTEOFF,             0, {60, 0}},
+	{0,  MIDI_EVENT,      MIDI_NOTEOFF,             0, {62, 0}},
+	{0,  MIDI_EVENT_META, MIDI_META,                0, {0}}};
+
+#define NUM_EXPECTED (sizeof(EXPECTED) / sizeof(EXPECTED[0]))
+
+typedef struct {
+	size_t num_events;
+	int failed;
+} Checker;
+
+static int
+check_event(void *context, uint32_t track, const MidiEvent *event)
+{
+	Checker *checker = context;
+	const ExpectedEvent *expected;
+	int same;
+
+	if(checker->num_events == NUM_EXPECTED) {
+		fprintf(stderr, "More events than the track has.\n");
+		checker->failed = 1;
+		return 1;
+	}
+	expected = &EXPECTED[checker->num_events++];
+
+	same = track == 0 && event->delta_time == expected->delta_time && event->type == expected->type &&
+	       event->command == expected->command;
+	if(same && event->type == MIDI_EVENT) {
+		same = event->channel == expected->channel;
+		if(event->command == MIDI_PATCHCHANGE) {
+			same = same && event->patch == expected->data[0];
+		} else if(event->command != MIDI_CHANNELAFTERTOUCH) {
+			same = same && event->note == expected->data[0] && event->velocity == expected->data[1];
+		}
+	} else if(same) {
+		same = event->meta_type == MIDI_META_ENDTRACK;
+	}
+
+	if(!same) {
+		fprintf(stderr, "Event %u is not as written: ", (unsigned)checker->num_events - 1);
+		print_midi_event(stderr, event);
+		checker->failed = 1;
+	}
+
+	return 0;
+}
+
+// check_feeding
+// Feeds SONG to a stream chunk bytes at a time.
+//
+// Returns:  Non-zero unless every event came out as written.
+static int
+check_feeding(size_t chunk)
+{
+	MidiStream stream;
+	Checker checker;
+	size_t i, n;
+
+	memset(&checker, 0, sizeof(checker));
+	init_midi_stream(&stream, check_event, &checker);
+
+	for(i=0; i < sizeof(SONG); i += n) {
+		n = sizeof(SONG) - i < chunk ? sizeof(SONG) - i : chunk;
+		if(feed_midi_stream(&stream, SONG + i, n)) {
+			fprintf(stderr, "Feeding %u bytes at a time failed.\n", (unsigned)chunk);
+			return 1;
+		}
+	}
+	if(finish_midi_stream(&stream)) checker.failed = 1;
+
+	if(checker.num_events != NUM_EXPECTED) {
+		fprintf(stderr, "Feeding %u bytes at a time gave %u of %u events.\n", (unsigned)chunk,
+		        (unsigned)checker.num_events, (unsigned)NUM_EXPECTED);
+		checker.failed = 1;
+	}
+
+	return checker.failed;
+}
+
+int main(void)
+{
+	Midi midi;
+	int failed = 0;
+
+	failed |= check_feeding(sizeof(SONG));
+	failed |= check_feeding(1);
+
+	if(read_midi_from_memory(&midi, SONG, sizeof(SONG), NULL)) {
+		fprintf(stderr, "read_midi_from_memory failed.\n");
+		failed = 1;
+	} else {
+		if(!midi.patches[5].used || !midi.patches[6].used || midi.patches[40].used) {
+			fprintf(stderr, "Patches used are not as written.\n");
+			failed = 1;
+		}
+		if(midi.channel_events[0].num_events != 6 || midi.channel_events[1].num_events != 2) {
+			fprintf(stderr, "Channels hold %u and %u events, not 6 and 2.\n",
+			        (unsigned)midi.channel_events[0].num_events, (unsigned)midi.channel_events[1].num_events);
+			failed = 1;
+		}
+		destroy_midi(&midi);
+	}
+
+	if(failed) return 1;
+	printf("Running status is parsed.\n");
+	return 0;
+}
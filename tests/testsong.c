@@ -0,0 +1,61 @@
+/*
+ * testsong.c
+ *
+ * Makes small midi songs in memory for the tests to convert.
+ *
+ */
+
+#include <string.h>
+#include "testsong.h"
+
+static uint8_t *
+put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+// make_song
+// Writes a format 0 midi that plays notes one after another, each for
+// most of half a beat, on the channels and patches they name.
+//
+// Takes:  out - Room for SONG_OVERHEAD + 8 * num_notes bytes.
+//
+// Returns:  Size of the midi.
+size_t
+make_song(const SongNote *notes, size_t num_notes, uint8_t *out)
+{
+	static const uint8_t HEADER[] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, SONG_DIVISION};
+	// Tempo of 500000 microseconds per beat, and patches for channels 0 and 1.
+	static const uint8_t START[] = {0, 0xFF, 0x51, 3, 0x07, 0xA1, 0x20, 0, 0xC0, 0, 0, 0xC1, 40};
+	static const uint8_t END[] = {0, 0xFF, 0x2F, 0};
+	uint8_t *p, *track;
+	size_t i;
+
+	memcpy(out, HEADER, sizeof(HEADER));
+	p = out + sizeof(HEADER);
+	memcpy(p, "MTrk", 4);
+	p += 8;
+	track = p;
+
+	memcpy(p, START, sizeof(START));
+	p += sizeof(START);
+	for(i=0; i < num_notes; i++) {
+		*(p++) = i ? 8 : 0;
+		*(p++) = 0x90 | notes[i].channel;
+		*(p++) = notes[i].note;
+		*(p++) = notes[i].velocity;
+		*(p++) = 40;
+		*(p++) = 0x80 | notes[i].channel;
+		*(p++) = notes[i].note;
+		*(p++) = 0;
+	}
+	memcpy(p, END, sizeof(END));
+	p += sizeof(END);
+
+	put_be32(track - 4, p - track);
+	return p - out;
+}
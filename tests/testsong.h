@@ -0,0 +1,27 @@
+/*
+ * testsong.h
+ *
+ * Makes small midi songs in memory for the tests to convert.
+ *
+ */
+
+#ifndef TESTSONG_H
+#define TESTSONG_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Ticks per beat of the songs made.
+#define SONG_DIVISION 96
+// Bytes of a song besides its notes, which take 8 each.
+#define SONG_OVERHEAD 64
+
+typedef struct {
+	uint8_t channel;
+	uint8_t note;
+	uint8_t velocity;
+} SongNote;
+
+size_t make_song(const SongNote *notes, size_t num_notes, uint8_t *out);
+
+#endif /* TESTSONG_H */
@@ -0,0 +1,223 @@
+/*
+ * watch.c
+ *
+ * Checks that watch_directories converts every file of a bulk upload,
+ * more files at once than it keeps conversions for, and converts them
+ * right again once they are all replaced.  Each mod is compared byte
+ * for byte with one converted from scratch.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "midistream.h"
+#include "mod.h"
+#include "testsong.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// More than the conversions kept for one directory.
+#define NUM_FILES 12
+#define NUM_NOTES 200
+
+static void
+sleep_ms(long int ms)
+{
+	struct timespec wait;
+
+	wait.tv_sec = ms / 1000;
+	wait.tv_nsec = ms % 1000 * 1000000L;
+	nanosleep(&wait, NULL);
+}
+
+// Makes the notes of file, as it is in round.
+static void
+make_notes(SongNote *notes, int file, int round)
+{
+	int i;
+
+	for(i=0; i < NUM_NOTES; i++) {
+		notes[i].channel = (i / 4) % 2;
+		notes[i].note = 36 + (i * (file + 3)) % 48;
+		notes[i].velocity = 64 + (i + file) % 64;
+	}
+	// The second round changes one note of each file.
+	if(round) notes[NUM_NOTES / 2 + file].velocity = 5;
+}
+
+// drop_files
+// Writes every file into staging, then moves them all into watched at
+// once, as an upload would.
+//
+// Returns:  Non-zero on error.
+static int
+drop_files(const char *staging, const char *watched, int round)
+{
+	static uint8_t song[SONG_OVERHEAD + 8 * NUM_NOTES];
+	SongNote notes[NUM_NOTES];
+	char from[256], to[256];
+	size_t size;
+	FILE *file;
+	int i;
+
+	for(i=0; i < NUM_FILES; i++) {
+		make_notes(notes, i, round);
+		size = make_song(notes, NUM_NOTES, song);
+		sprintf(from, "%s/song%02d.mid", staging, i);
+		file = fopen(from, "wb");
+		if(file == NULL || fwrite(song, size, 1, file) != 1) {
+			fprintf(stderr, "Unable to write %s.\n", from);
+			if(file != NULL) fclose(file);
+			return 1;
+		}
+		fclose(file);
+	}
+
+	for(i=0; i < NUM_FILES; i++) {
+		sprintf(from, "%s/song%02d.mid", staging, i);
+		sprintf(to, "%s/song%02d.mid", watched, i);
+		if(rename(from, to)) {
+			fprintf(stderr, "Unable to move %s.\n", from);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// check_file
+// Returns:  Non-zero unless the mod watching wrote for file matches
+//           the second round's song converted from scratch.
+static int
+check_file(const char *watched, int file)
+{
+	static uint8_t song[SONG_OVERHEAD + 8 * NUM_NOTES];
+	SongNote notes[NUM_NOTES];
+	char name[256];
+	uint8_t *expected, *written;
+	size_t size, expected_size;
+	long int written_size;
+	FILE *in;
+	Midi midi;
+	Mod mod;
+	int status = 1;
+
+	make_notes(notes, file, 1);
+	size = make_song(notes, NUM_NOTES, song);
+	memset(&mod, 0, sizeof(mod));
+	if(read_midi_from_memory(&midi, song, size, NULL) || midi_to_mod(&mod, &midi, NULL) ||
+	   encode_mod_file(&mod, NULL, &expected, &expected_size)) {
+		fprintf(stderr, "song%02d could not be converted.\n", file);
+		return 1;
+	}
+	destroy_mod(&mod);
+	destroy_midi(&midi);
+
+	sprintf(name, "%s/song%02d.mod", watched, file);
+	in = fopen(name, "rb");
+	if(in == NULL) {
+		fprintf(stderr, "%s was not written.\n", name);
+		free(expected);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	written_size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	written = malloc(written_size > 0 ? written_size : 1);
+	if(written != NULL && written_size == (long int)expected_size && fread(written, expected_size, 1, in) == 1 &&
+	   !memcmp(written, expected, expected_size))
+		status = 0;
+	else
+		fprintf(stderr, "%s differs from converting song%02d from scratch.\n", name, file);
+
+	fclose(in);
+	free(written);
+	free(expected);
+
+	return status;
+}
+
+int main(void)
+{
+	char root[] = "/tmp/midi2mod-watch-XXXXXX";
+	char staging[64], watched[64], name[256];
+	char *dirs[1];
+	BatchSettings settings;
+	pid_t child;
+	int i, status, failed = 0;
+
+	if(mkdtemp(root) == NULL) {
+		fprintf(stderr, "Unable to make a directory to watch.\n");
+		return 1;
+	}
+	sprintf(staging, "%s/staging", root);
+	sprintf(watched, "%s/watched", root);
+	if(mkdir(staging, 0777) || mkdir(watched, 0777)) {
+		fprintf(stderr, "Unable to make a directory to watch.\n");
+		return 1;
+	}
+
+	fflush(stdout);
+	child = fork();
+	if(child < 0) {
+		fprintf(stderr, "Unable to start watching.\n");
+		return 1;
+	}
+	if(child == 0) {
+		memset(&settings, 0, sizeof(settings));
+		init_midi_to_mod_options(&settings.options);
+		settings.num_threads = 2;
+		dirs[0] = watched;
+		_exit(watch_directories(dirs, 1, &settings));
+	}
+
+	// Let it start watching, then let the first round be converted
+	// before it is all replaced.
+	sleep_ms(500);
+	failed |= drop_files(staging, watched, 0);
+	sleep_ms(1500);
+	failed |= drop_files(staging, watched, 1);
+	sleep_ms(100);
+
+	// Files still settling are converted before it stops.
+	kill(child, SIGINT);
+	if(waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "Watching failed.\n");
+		failed = 1;
+	}
+
+	for(i=0; i < NUM_FILES; i++) failed |= check_file(watched, i);
+
+	for(i=0; i < NUM_FILES; i++) {
+		sprintf(name, "%s/song%02d.mid", watched, i);
+		remove(name);
+		sprintf(name, "%s/song%02d.mod", watched, i);
+		remove(name);
+	}
+	rmdir(staging);
+	rmdir(watched);
+	rmdir(root);
+
+	if(failed) return 1;
+	printf("Watching converts every file dropped in at once.\n");
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	printf("Watching needs inotify, which only Linux has.\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * thread.c
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef struct {
+	void (*function)(void *);
+	void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI
+thread_main(LPVOID p)
+#else
+static void *
+thread_main(void *p)
+#endif
+{
+	ThreadStart start = *(ThreadStart *)p;
+	free(p);
+	start.function(start.arg);
+	return 0;
+}
+
+// thread_create
+// Runs function(arg) on a new thread.
+//
+// Returns:  Non-zero on error.
+int
+thread_create(Thread *thread, void (*function)(void *), void *arg)
+{
+	ThreadStart *start = malloc(sizeof(ThreadStart));
+	if(start == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	start->function = function;
+	start->arg = arg;
+
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+	if(*thread == NULL) {
+#else
+	if(pthread_create(thread, NULL, thread_main, start)) {
+#endif
+		fprintf(stderr, "Unable to create thread.\n");
+		free(start);
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+thread_join(Thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+// thread_count
+// Returns:  Number of processors available, at least 1.
+int
+thread_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+void
+mutex_init(Mutex *mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void
+mutex_destroy(Mutex *mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+void
+mutex_lock(Mutex *mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void
+mutex_unlock(Mutex *mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void
+condition_init(Condition *condition)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
+
+void
+condition_destroy(Condition *condition)
+{
+#ifdef _WIN32
+	(void)condition;
+#else
+	pthread_cond_destroy(condition);
+#endif
+}
+
+// condition_wait
+// Unlocks mutex and sleeps until condition is signalled, then locks
+// mutex again.  Wakeups may be spurious, so callers wait in a loop.
+void
+condition_wait(Condition *condition, Mutex *mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void
+condition_signal(Condition *condition)
+{
+#ifdef _WIN32
+	WakeConditionVariable(condition);
+#else
+	pthread_cond_signal(condition);
+#endif
+}
+
+void
+condition_broadcast(Condition *condition)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
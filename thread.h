@@ -0,0 +1,38 @@
+/*
+ * thread.h
+ *
+ * Minimal portable threads.
+ *
+ */
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#ifdef _WIN32
+#include <windows.h>
+typedef void *Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+int thread_create(Thread *, void (*function)(void *), void *arg);
+void thread_join(Thread);
+int thread_count(void);
+
+void mutex_init(Mutex *);
+void mutex_destroy(Mutex *);
+void mutex_lock(Mutex *);
+void mutex_unlock(Mutex *);
+
+void condition_init(Condition *);
+void condition_destroy(Condition *);
+void condition_wait(Condition *, Mutex *);
+void condition_signal(Condition *);
+void condition_broadcast(Condition *);
+
+#endif /* THREAD_H */
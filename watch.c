@@ -0,0 +1,487 @@
+/*
+ * watch.c
+ *
+ * inotify reports each file in a watched directory that is closed after
+ * being written, or moved in whole.  A file is converted once it has
+ * been left alone for WATCH_SETTLE_MS, so that one written in several
+ * goes is only converted once, and the files that are ready together
+ * go through convert_batch, and its threads, together.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "batch.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+// How long a file must be left alone before it is converted.
+#define WATCH_SETTLE_MS 200
+
+// Files in each directory whose last conversion is kept, so that saving
+// one again only converts the patterns that changed.
+#define WATCH_KEPT_FILES 8
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+typedef struct {
+	char *path;
+	long int ready;              // Time it can be converted from, in milliseconds.
+} WatchFile;
+
+typedef struct {
+	char *path;                  // NULL for a free slot.
+	BatchKept *kept;
+	long int used;               // When it was last converted, so the oldest makes way.
+	int busy;                    // Whether it is handed out to the batch being converted.
+} WatchKept;
+
+typedef struct {
+	const char *path;
+	int wd;                      // inotify watch, -1 once it has gone.
+	char *output_dir;            // Where its mods go, NULL for next to each file.
+	WatchFile *pending;          // Files written, waiting to settle.
+	int num_pending;
+	int max_pending;
+	WatchKept kept[WATCH_KEPT_FILES];
+} WatchDir;
+
+static volatile sig_atomic_t watch_stopping;
+
+static void
+stop_watching(int signal_number)
+{
+	(void)signal_number;
+	watch_stopping = 1;
+}
+
+static long int
+now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// is_midi
+// Returns:  Whether name ends in .mid or .midi.  Hidden files, which
+//           uploads are often written as before being renamed, are not.
+static int
+is_midi(const char *name)
+{
+	static const char *EXTENSIONS[] = {".mid", ".midi"};
+	const char *dot = strrchr(name, '.');
+	size_t i, j;
+
+	if(name[0] == '.' || dot == NULL) return 0;
+
+	for(i=0; i < sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]); i++) {
+		for(j=0; dot[j] && tolower((unsigned char)dot[j]) == EXTENSIONS[i][j]; j++);
+		if(!dot[j] && !EXTENSIONS[i][j]) return 1;
+	}
+
+	return 0;
+}
+
+// tree_dir
+// Makes the directory in root that the mods from the watched directory
+// path go to, named after it.
+static char *
+tree_dir(const char *root, const char *path)
+{
+	char *full = realpath(path, NULL);
+	const char *base;
+	char *name;
+
+	if(full == NULL) {
+		fprintf(stderr, "Unable to find %s: %s.\n", path, strerror(errno));
+		return NULL;
+	}
+	base = strrchr(full, '/');
+	base = base && base[1] ? base + 1 : full;
+
+	name = malloc(strlen(root) + 1 + strlen(base) + 1);
+	if(name == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		free(full);
+		return NULL;
+	}
+	sprintf(name, "%s/%s", root, base);
+	free(full);
+
+	if(mkdir(name, 0777) && errno != EEXIST) {
+		fprintf(stderr, "Unable to make %s: %s.\n", name, strerror(errno));
+		free(name);
+		return NULL;
+	}
+
+	return name;
+}
+
+static WatchFile *
+find_pending(WatchDir *dir, const char *name)
+{
+	size_t length = strlen(dir->path);
+	int i;
+
+	for(i=0; i < dir->num_pending; i++) {
+		if(!strcmp(dir->pending[i].path + length + 1, name)) return &dir->pending[i];
+	}
+
+	return NULL;
+}
+
+// add_pending
+// Has name converted once it has been left alone until ready.
+//
+// Returns:  Non-zero on error.
+static int
+add_pending(WatchDir *dir, const char *name, long int ready)
+{
+	WatchFile *file = find_pending(dir, name);
+	WatchFile *pending;
+	char *path;
+
+	if(file != NULL) {
+		file->ready = ready;
+		return 0;
+	}
+
+	if(dir->num_pending == dir->max_pending) {
+		pending = realloc(dir->pending, (dir->max_pending * 2 + 8) * sizeof(WatchFile));
+		if(pending == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+		dir->pending = pending;
+		dir->max_pending = dir->max_pending * 2 + 8;
+	}
+
+	path = malloc(strlen(dir->path) + 1 + strlen(name) + 1);
+	if(path == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	sprintf(path, "%s/%s", dir->path, name);
+
+	dir->pending[dir->num_pending].path = path;
+	dir->pending[dir->num_pending].ready = ready;
+	dir->num_pending++;
+
+	return 0;
+}
+
+static void
+remove_pending(WatchDir *dir, const char *name)
+{
+	WatchFile *file = find_pending(dir, name);
+
+	if(file == NULL) return;
+
+	free(file->path);
+	*file = dir->pending[--dir->num_pending];
+}
+
+static void
+free_kept(WatchKept *kept)
+{
+	if(kept->kept != NULL) destroy_batch_kept(kept->kept);
+	free(kept->kept);
+	free(kept->path);
+	memset(kept, 0, sizeof(WatchKept));
+}
+
+// Forgets the conversion kept for name, which has gone.
+static void
+forget_kept(WatchDir *dir, const char *name)
+{
+	size_t length = strlen(dir->path);
+	int i;
+
+	for(i=0; i < WATCH_KEPT_FILES; i++) {
+		if(dir->kept[i].path != NULL && !strcmp(dir->kept[i].path + length + 1, name)) free_kept(&dir->kept[i]);
+	}
+}
+
+// find_kept
+// Returns:  The conversion kept for path, or a new one in place of the
+//           one used longest ago.  Ones already handed out to the batch
+//           being put together are never given up.  NULL if none can be,
+//           or there is no memory, which only means path is converted
+//           in full.
+static BatchKept *
+find_kept(WatchDir *dir, const char *path, long int now)
+{
+	WatchKept *slot = NULL;
+	WatchKept *kept;
+	int i;
+
+	for(i=0; i < WATCH_KEPT_FILES; i++) {
+		kept = &dir->kept[i];
+		if(kept->path != NULL && !strcmp(kept->path, path)) {
+			kept->used = now;
+			kept->busy = 1;
+			return kept->kept;
+		}
+		if(kept->busy) continue;
+
+		if(slot == NULL || (slot->path != NULL && (kept->path == NULL || kept->used < slot->used))) slot = kept;
+	}
+	if(slot == NULL) return NULL;
+
+	free_kept(slot);
+	slot->path = malloc(strlen(path) + 1);
+	slot->kept = calloc(1, sizeof(BatchKept));
+	if(slot->path == NULL || slot->kept == NULL) {
+		free_kept(slot);
+		return NULL;
+	}
+	strcpy(slot->path, path);
+	init_mod_incremental(&slot->kept->incremental);
+	slot->used = now;
+	slot->busy = 1;
+
+	return slot->kept;
+}
+
+// convert_ready
+// Converts the files that have been left alone long enough by now.
+static void
+convert_ready(WatchDir *dirs, int num_dirs, const BatchSettings *settings, long int now)
+{
+	BatchSettings dir_settings = *settings;
+	WatchDir *dir;
+	BatchKept **kept_inputs;
+	char **inputs;
+	int i, j, n, kept;
+
+	for(i=0; i < num_dirs; i++) {
+		dir = &dirs[i];
+		if(!dir->num_pending) continue;
+
+		inputs = malloc(dir->num_pending * sizeof(char *));
+		kept_inputs = malloc(dir->num_pending * sizeof(BatchKept *));
+		if(inputs == NULL || kept_inputs == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			free(inputs);
+			free(kept_inputs);
+			continue;
+		}
+
+		n = 0;
+		for(j=0; j < dir->num_pending; j++) {
+			if(dir->pending[j].ready > now) continue;
+			inputs[n] = dir->pending[j].path;
+			kept_inputs[n++] = find_kept(dir, dir->pending[j].path, now_ms());
+		}
+
+		if(n) {
+			dir_settings.output_dir = dir->output_dir;
+			convert_batch(inputs, kept_inputs, n, &dir_settings);
+			fflush(stdout);
+			for(j=0; j < WATCH_KEPT_FILES; j++) dir->kept[j].busy = 0;
+
+			kept = 0;
+			for(j=0; j < dir->num_pending; j++) {
+				if(dir->pending[j].ready <= now) free(dir->pending[j].path);
+				else dir->pending[kept++] = dir->pending[j];
+			}
+			dir->num_pending = kept;
+		}
+
+		free(inputs);
+		free(kept_inputs);
+	}
+}
+
+// next_wait
+// Returns:  Milliseconds until the next file is ready, -1 if none are
+//           waiting.
+static int
+next_wait(const WatchDir *dirs, int num_dirs, long int now)
+{
+	long int wait = -1;
+	int i, j;
+
+	for(i=0; i < num_dirs; i++) {
+		for(j=0; j < dirs[i].num_pending; j++) {
+			if(wait < 0 || dirs[i].pending[j].ready - now < wait) wait = dirs[i].pending[j].ready - now;
+		}
+	}
+
+	return wait < 0 ? -1 : (int)wait;
+}
+
+// read_events
+// Takes in everything inotify has to say, without waiting.
+//
+// Returns:  Non-zero on error.
+static int
+read_events(int fd, WatchDir *dirs, int num_dirs, int *watching)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	WatchDir *dir;
+	ssize_t length;
+	char *p;
+	int status = 0;
+	int i;
+
+	while((length = read(fd, buffer, sizeof(buffer))) > 0) {
+		for(p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if(event->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "Too many files at once, some were missed.\n");
+				continue;
+			}
+
+			dir = NULL;
+			for(i=0; i < num_dirs; i++) {
+				if(dirs[i].wd >= 0 && dirs[i].wd == event->wd) dir = &dirs[i];
+			}
+			if(dir == NULL) continue;
+
+			if(event->mask & IN_IGNORED) {
+				fprintf(stderr, "Stopped watching %s, which has gone.\n", dir->path);
+				dir->wd = -1;
+				(*watching)--;
+				continue;
+			}
+			if(!event->len || !is_midi(event->name)) continue;
+
+			// A file that is written again, or goes, waits for the
+			// next time it is closed.
+			if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+				if(add_pending(dir, event->name, now_ms() + WATCH_SETTLE_MS)) status = 1;
+			} else {
+				remove_pending(dir, event->name);
+				if(event->mask & (IN_DELETE | IN_MOVED_FROM)) forget_kept(dir, event->name);
+			}
+		}
+	}
+	if(length < 0 && errno != EAGAIN && errno != EINTR) {
+		fprintf(stderr, "Unable to watch directories: %s.\n", strerror(errno));
+		status = 1;
+	}
+
+	return status;
+}
+
+// watch_directories
+// Converts the midi files written into, or moved into, each of dirs
+// until interrupted, as convert_batch would.  settings->output_dir, if
+// set, gets a directory named after each one watched.  Files that are
+// already there are left alone, and the files still settling when it
+// is interrupted are converted before it returns.
+//
+// Returns:  Non-zero on error.
+int
+watch_directories(char **paths, int num_dirs, const BatchSettings *settings)
+{
+	struct pollfd poll_fd;
+	WatchDir *dirs, *dir;
+	int watching, fd, i, j;
+	int status = 0;
+
+	fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if(fd < 0) {
+		fprintf(stderr, "Unable to watch directories: %s.\n", strerror(errno));
+		return 1;
+	}
+
+	dirs = calloc(num_dirs, sizeof(WatchDir));
+	if(dirs == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		close(fd);
+		return 1;
+	}
+
+	if(settings->output_dir != NULL && mkdir(settings->output_dir, 0777) && errno != EEXIST) {
+		fprintf(stderr, "Unable to make %s: %s.\n", settings->output_dir, strerror(errno));
+		status = 1;
+	}
+
+	for(watching=0; !status && watching < num_dirs; watching++) {
+		dir = &dirs[watching];
+		dir->path = paths[watching];
+		dir->wd = inotify_add_watch(fd, dir->path, WATCH_EVENTS);
+		if(dir->wd < 0) {
+			fprintf(stderr, "Unable to watch %s: %s.\n", dir->path, strerror(errno));
+			status = 1;
+			break;
+		}
+		if(settings->output_dir != NULL) {
+			dir->output_dir = tree_dir(settings->output_dir, dir->path);
+			if(dir->output_dir == NULL) {
+				status = 1;
+				break;
+			}
+		}
+		printf("Watching %s.\n", dir->path);
+	}
+	fflush(stdout);
+
+	watch_stopping = 0;
+	signal(SIGINT, stop_watching);
+	signal(SIGTERM, stop_watching);
+
+	poll_fd.fd = fd;
+	poll_fd.events = POLLIN;
+	while(!status && watching && !watch_stopping) {
+		// Sleep until something happens, or the next file is ready.
+		if(poll(&poll_fd, 1, next_wait(dirs, num_dirs, now_ms())) < 0 && errno != EINTR) {
+			fprintf(stderr, "Unable to watch directories: %s.\n", strerror(errno));
+			status = 1;
+			break;
+		}
+
+		if(read_events(fd, dirs, num_dirs, &watching)) status = 1;
+
+		convert_ready(dirs, num_dirs, settings, now_ms());
+	}
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	// Files that were closed are whole, even if they have not settled.
+	if(!status && read_events(fd, dirs, num_dirs, &watching)) status = 1;
+	convert_ready(dirs, num_dirs, settings, LONG_MAX);
+
+	for(i=0; i < num_dirs; i++) {
+		free(dirs[i].output_dir);
+		free(dirs[i].pending);
+		for(j=0; j < WATCH_KEPT_FILES; j++) free_kept(&dirs[i].kept[j]);
+	}
+	free(dirs);
+	close(fd);
+
+	return status;
+}
+
+#else
+
+int
+watch_directories(char **paths, int num_dirs, const BatchSettings *settings)
+{
+	(void)paths;
+	(void)num_dirs;
+	(void)settings;
+
+	fprintf(stderr, "Watching directories needs inotify, which only Linux has.\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * watch.h
+ *
+ * Converts midi files as they arrive in watched directories, for drop
+ * folders that would otherwise be polled.
+ *
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "batch.h"
+
+int watch_directories(char **dirs, int num_dirs, const BatchSettings *);
+
+#endif /* WATCH_H */
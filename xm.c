@@ -0,0 +1,356 @@
+/*
+ * xm.c
+ *
+ * Writes a Mod as an XM.  Patterns are packed, so the empty cells most
+ * of a converted song is made of take a byte each, a pattern the same
+ * as an earlier one is only stored once, and samples are stored as 16
+ * bit deltas.  Only the instruments that the patterns play are given
+ * their sample data.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "mod.h"
+#include "probes.h"
+#include "xm.h"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+// Size of the part of the header before its size field, and of the
+// rest of it, which ends with the pattern order table.
+#define XM_PREAMBLE_SIZE 60
+#define XM_HEADER_SIZE 276
+#define XM_PATTERN_HEADER_SIZE 9
+#define XM_INSTRUMENT_HEADER_SIZE 263
+#define XM_EMPTY_INSTRUMENT_SIZE 29
+#define XM_SAMPLE_HEADER_SIZE 40
+
+// Note that plays a sample at its own rate, as MOD_BASE_PERIOD does in a mod.
+#define XM_BASE_NOTE 49
+
+static uint8_t *
+put_le16(uint8_t *out, uint16_t v)
+{
+	out[0] = v & 0xFF;
+	out[1] = v >> 8;
+	return out + 2;
+}
+
+static uint8_t *
+put_le32(uint8_t *out, uint32_t v)
+{
+	out[0] = v & 0xFF;
+	out[1] = (v >> 8) & 0xFF;
+	out[2] = (v >> 16) & 0xFF;
+	out[3] = v >> 24;
+	return out + 4;
+}
+
+// xm_cell
+// Works out the note, instrument, volume, effect and parameter columns
+// for a mod command.  EF_VOLUME moves to the volume column, the other
+// effects mean the same in an XM.
+static void
+xm_cell(const ModCommand *command, uint8_t cell[5])
+{
+	int note;
+	int volume;
+
+	memset(cell, 0, 5);
+
+	if(command->period) {
+		note = XM_BASE_NOTE + (int)lround(12 * log2((double)MOD_BASE_PERIOD / command->period));
+		cell[0] = note < 1 ? 1 : note > 96 ? 96 : note;
+	}
+	cell[1] = command->sample;
+
+	if(command->effect == EF_VOLUME) {
+		volume = command->effect_x << 4 | command->effect_y;
+		cell[2] = 0x10 + (volume > 64 ? 64 : volume);
+	} else {
+		cell[3] = command->effect;
+		cell[4] = command->effect_x << 4 | command->effect_y;
+	}
+}
+
+static int
+is_empty(const ModCommand *command)
+{
+	return !command->period && !command->sample && !command->effect && !command->effect_x && !command->effect_y;
+}
+
+// pattern_rows
+// Returns:  Rows of pattern to store.  When the pattern is only played
+//           at the end of the song, the empty rows after its last
+//           command are left out.
+static int
+pattern_rows(const Mod *mod, int pattern)
+{
+	int uses = 0;
+	int i, r, c;
+
+	for(i=0; i < mod->song_length; i++) uses += mod->pattern_table[i] == pattern;
+	if(uses != 1 || mod->pattern_table[mod->song_length - 1] != pattern) return 64;
+
+	for(r=63; r > 0; r--) {
+		for(c=0; c < mod->num_channels; c++) {
+			if(!is_empty(&mod->patterns[pattern].data[c][r])) return r + 1;
+		}
+	}
+
+	return 1;
+}
+
+// pack_pattern
+// Packs the first rows of pattern.  A cell with all five columns set is
+// written as it is, any other starts with a byte flagging the columns
+// that follow it, so an empty cell takes one byte.
+//
+// Takes:  num_channels - Channels of pattern that are used.
+//         xm_channels  - Channels to write, any past num_channels empty.
+//
+// Returns:  The end of what was written.
+static uint8_t *
+pack_pattern(const ModPattern *pattern, int num_channels, int xm_channels, int rows, uint8_t *out)
+{
+	uint8_t cell[5];
+	int flags;
+	int r, c, i;
+
+	for(r=0; r < rows; r++) {
+		for(c=0; c < xm_channels; c++) {
+			if(c < num_channels) xm_cell(&pattern->data[c][r], cell);
+			else                 memset(cell, 0, sizeof(cell));
+
+			flags = 0;
+			for(i=0; i < 5; i++) {
+				if(cell[i]) flags |= 1 << i;
+			}
+
+			if(flags == 0x1F) {
+				memcpy(out, cell, 5);
+				out += 5;
+				continue;
+			}
+
+			*(out++) = 0x80 | flags;
+			for(i=0; i < 5; i++) {
+				if(cell[i]) *(out++) = cell[i];
+			}
+		}
+	}
+
+	return out;
+}
+
+// put_deltas
+// Writes length 16 bit samples as the differences between them, taking
+// them from 8 bit data, or from wave when data is NULL.
+static uint8_t *
+put_deltas(uint8_t *out, const int8_t *data, const int16_t *wave, size_t length)
+{
+	int16_t last = 0;
+	int16_t value;
+	size_t i;
+
+	for(i=0; i < length; i++) {
+		value = data ? data[i] * 256 : wave[i];
+		out = put_le16(out, (uint16_t)(value - last));
+		last = value;
+	}
+
+	return out;
+}
+
+// encode_xm_file
+// Builds the whole XM file in memory.  *data must be freed.
+//
+// Returns:  Non-zero on error.
+int
+encode_xm_file(const Mod *mod, Allocator *allocator, uint8_t **data, size_t *size)
+{
+	int xm_channels = mod->num_channels + (mod->num_channels & 1);
+	int index[MOD_MAX_PATTERNS];            // XM pattern that each pattern is stored as.
+	const uint8_t *packed[MOD_MAX_PATTERNS]; // Packed data of each XM pattern.
+	size_t packed_size[MOD_MAX_PATTERNS];
+	int packed_rows[MOD_MAX_PATTERNS];
+	int num_xm_patterns = 0;
+	int num_instruments = 0;
+	uint8_t used[32];
+	int16_t low_wave[MOD_WAVE_LENGTH];
+	int16_t high_wave[MOD_WAVE_LENGTH];
+	const ModSample *sample;
+	uint8_t *out, *header, *end;
+	size_t bound, length, loop_start, loop_length, name_length;
+	int rows;
+	int i, p, c, r, x;
+
+	if(mod->num_channels < 1 || mod->num_channels > MOD_MAX_CHANNELS || mod->num_patterns > MOD_MAX_PATTERNS) {
+		fprintf(stderr, "An xm holds 1 to %d channels and at most %d patterns.\n", MOD_MAX_CHANNELS, MOD_MAX_PATTERNS);
+		return 1;
+	}
+
+	PROBE1(encode_start, mod->num_patterns);
+	memset(used, 0, sizeof(used));
+	for(p=0; p < mod->num_patterns; p++) {
+		for(c=0; c < mod->num_channels; c++) {
+			for(r=0; r < 64; r++) used[mod->patterns[p].data[c][r].sample & 0x1F] = 1;
+		}
+	}
+	for(i=1; i < 32; i++) {
+		if(used[i]) num_instruments = i;
+	}
+
+	bound = XM_PREAMBLE_SIZE + XM_HEADER_SIZE;
+	bound += (size_t)mod->num_patterns * (XM_PATTERN_HEADER_SIZE + 64 * xm_channels * 5);
+	for(i=1; i <= num_instruments; i++) {
+		sample = mod->samples[i];
+		if(!used[i]) bound += XM_EMPTY_INSTRUMENT_SIZE;
+		else         bound += XM_INSTRUMENT_HEADER_SIZE + XM_SAMPLE_HEADER_SIZE +
+		                      (sample ? (size_t)sample->length * 4 : MOD_WAVE_LENGTH * 2);
+	}
+
+	*data = mem_calloc(allocator, bound, sizeof(uint8_t));
+	if(*data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	out = *data;
+
+	memcpy(out, "Extended Module: ", 17);
+	memcpy(out + 17, mod->title, sizeof(mod->title));
+	out[37] = 0x1A;
+	memcpy(out + 38, "midi2mod", 8);
+	put_le16(out + 58, 0x0104);
+	out += XM_PREAMBLE_SIZE;
+
+	// Filled in once the patterns are known.
+	header = out;
+	out += XM_HEADER_SIZE;
+
+	for(p=0; p < mod->num_patterns; p++) {
+		rows = pattern_rows(mod, p);
+		end = pack_pattern(&mod->patterns[p], mod->num_channels, xm_channels, rows, out + XM_PATTERN_HEADER_SIZE);
+		length = end - (out + XM_PATTERN_HEADER_SIZE);
+
+		// A pattern the same as an earlier one is played from that one.
+		for(x=0; x < num_xm_patterns; x++) {
+			if(packed_rows[x] == rows && packed_size[x] == length &&
+			   !memcmp(packed[x], out + XM_PATTERN_HEADER_SIZE, length)) break;
+		}
+		index[p] = x;
+		if(x < num_xm_patterns) {
+			// The rest of the file is written over zeros.
+			memset(out, 0, end - out);
+			continue;
+		}
+
+		put_le32(out, XM_PATTERN_HEADER_SIZE);
+		out[4] = 0;
+		put_le16(out + 5, rows);
+		put_le16(out + 7, length);
+
+		packed[x] = out + XM_PATTERN_HEADER_SIZE;
+		packed_size[x] = length;
+		packed_rows[x] = rows;
+		num_xm_patterns++;
+		out = end;
+	}
+
+	put_le32(header, XM_HEADER_SIZE);
+	put_le16(header + 4, mod->song_length);
+	put_le16(header + 6, 0);
+	put_le16(header + 8, xm_channels);
+	put_le16(header + 10, num_xm_patterns);
+	put_le16(header + 12, num_instruments);
+	put_le16(header + 14, 0);   // Amiga periods, as in a mod.
+	put_le16(header + 16, 6);
+	put_le16(header + 18, 125);
+	for(i=0; i < mod->song_length; i++) {
+		header[20 + i] = mod->pattern_table[i] < mod->num_patterns ? index[mod->pattern_table[i]] : 0;
+	}
+
+	// Same waves as the mod's default samples, at 16 bits.
+	low_wave[0] = low_wave[1] = 0;
+	high_wave[0] = high_wave[1] = 0;
+	for(i=2; i < MOD_WAVE_LENGTH; i++) {
+		low_wave[i] = 32767 * sin((1.0 * i / MOD_WAVE_LENGTH) * 2 * M_PI * 1024);
+		high_wave[i] = 32767 * sin((1.0 * i / MOD_WAVE_LENGTH) * 2 * M_PI * 2048);
+	}
+
+	for(i=1; i <= num_instruments; i++) {
+		if(!used[i]) {
+			put_le32(out, XM_EMPTY_INSTRUMENT_SIZE);
+			out += XM_EMPTY_INSTRUMENT_SIZE;
+			continue;
+		}
+
+		sample = mod->samples[i];
+		// Names fill their 22 bytes, without a terminating 0.
+		name_length = sample ? strlen(sample->name) : 0;
+		if(name_length > 22) name_length = 22;
+
+		if(sample) {
+			memcpy(out + 4, sample->name, name_length);
+			length = sample->data ? (size_t)sample->length * 2 : 0;
+			loop_start = (size_t)sample->repeat_offset * 2;
+			loop_length = sample->repeat_length > 1 ? (size_t)sample->repeat_length * 2 : 0;
+		} else {
+			memcpy(out + 4, "Sample ", 7);
+			out[11] = i - 1 + 'a';
+			length = MOD_WAVE_LENGTH;
+			loop_start = 0;
+			loop_length = MOD_WAVE_LENGTH;
+		}
+		if(loop_start > length) loop_start = length;
+		if(loop_length > length - loop_start) loop_length = length - loop_start;
+
+		put_le32(out, XM_INSTRUMENT_HEADER_SIZE);
+		put_le16(out + 27, 1);
+		put_le32(out + 29, XM_SAMPLE_HEADER_SIZE);
+		out += XM_INSTRUMENT_HEADER_SIZE;
+
+		put_le32(out, length * 2);
+		put_le32(out + 4, loop_start * 2);
+		put_le32(out + 8, loop_length * 2);
+		out[12] = sample ? sample->volume : 64;
+		out[13] = sample ? (uint8_t)(sample->fine_tune * 16) : 0;
+		out[14] = 0x10 | (loop_length ? 1 : 0);    // 16 bit, forward loop.
+		out[15] = 0x80;
+		if(sample) memcpy(out + 18, sample->name, name_length);
+		out += XM_SAMPLE_HEADER_SIZE;
+
+		if(sample) out = put_deltas(out, sample->data, NULL, length);
+		else       out = put_deltas(out, NULL, i <= 8 ? low_wave : high_wave, length);
+	}
+
+	*size = out - *data;
+	PROBE1(encode_done, *size);
+	return 0;
+}
+
+int
+write_xm_file(const Mod *mod, FILE *outfile)
+{
+	uint8_t *data;
+	size_t size;
+
+	if(encode_xm_file(mod, NULL, &data, &size)) {
+		return 1;
+	}
+
+	if(fwrite(data, sizeof(uint8_t), size, outfile) != size) {
+		fprintf(stderr, "Unable to write xm file.\n");
+		mem_free(NULL, data);
+		return 1;
+	}
+	PROBE1(write_done, size);
+
+	mem_free(NULL, data);
+	return 0;
+}
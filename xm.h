@@ -0,0 +1,22 @@
+/*
+ * xm.h
+ *
+ * FastTracker 2 extended module output, for songs that need more than
+ * the 8 channels and 128 patterns a MOD can hold.
+ *
+ */
+
+#ifndef XM_H
+#define XM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "allocator.h"
+#include "mod.h"
+
+int encode_xm_file(const Mod *, Allocator *, uint8_t **data, size_t *size);
+int write_xm_file(const Mod *, FILE *);
+
+#endif /* XM_H */